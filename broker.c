@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "dict.h"
+#include "log.h"
+#include "table_stdio.h"
+
+/*
+ * The broker is a table-postgres process that owns the database
+ * connections and the cache on behalf of the other processes of the
+ * host, which forward their requests over a unix socket.
+ */
+
+struct client {
+	int		 fd;
+	char		*buf;
+	size_t		 len;
+	size_t		 size;
+	char		*out;		/* the replies not sent yet */
+	size_t		 outlen;
+	size_t		 outsize;
+};
+
+static struct client	*clients;
+static size_t		 nclients;
+
+static int
+broker_sockaddr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlcpy(sun->sun_path, path, sizeof(sun->sun_path)) >=
+	    sizeof(sun->sun_path)) {
+		log_warnx("warn: socket path too long: %s", path);
+		return 0;
+	}
+	return 1;
+}
+
+static long long
+broker_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait for the descriptor to be ready until the deadline, in
+ * milliseconds on the monotonic clock.
+ */
+static int
+broker_wait(int fd, int events, long long deadline)
+{
+	struct pollfd	 pfd;
+	long long	 left;
+
+	for (;;) {
+		if ((left = deadline - broker_now()) <= 0)
+			return 0;
+		pfd.fd = fd;
+		pfd.events = events;
+		switch (poll(&pfd, 1, left)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			return 0;
+		case 0:
+			return 0;
+		default:
+			return 1;
+		}
+	}
+}
+
+static int
+broker_write(int fd, const void *buf, size_t len, long long deadline)
+{
+	const char	*p = buf;
+	ssize_t		 n;
+
+	while (len > 0) {
+		if (!broker_wait(fd, POLLOUT, deadline))
+			return 0;
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int
+broker_read(int fd, void *buf, size_t len, long long deadline)
+{
+	char		*p = buf;
+	ssize_t		 n;
+
+	while (len > 0) {
+		if (!broker_wait(fd, POLLIN, deadline))
+			return 0;
+		if ((n = read(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (n == 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+int
+broker_connect(const char *path)
+{
+	struct sockaddr_un	 sun;
+	int			 fd;
+
+	if (!broker_sockaddr(&sun, path))
+		return -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_warn("warn: socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Forward a request to the broker.  Return the result of the request,
+ * or -2 if the broker could not be reached, did not answer in time or
+ * serves another configuration than the one tagged.
+ */
+int
+broker_request(int fd, uint32_t tag, int type, int service, const char *key,
+    char *dst, size_t sz)
+{
+	struct broker_hdr	 hdr;
+	long long		 deadline;
+	size_t			 len;
+
+	len = key ? strlen(key) : 0;
+	if (len > BROKER_MAXLEN)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.len = len;
+	hdr.tag = tag;
+	hdr.service = service;
+	hdr.type = type;
+
+	deadline = broker_now() + BROKER_TIMEOUT * 1000;
+	if (!broker_write(fd, &hdr, sizeof(hdr), deadline) ||
+	    !broker_write(fd, key, len, deadline))
+		return -2;
+	if (!broker_read(fd, &hdr, sizeof(hdr), deadline)) {
+		log_warnx("warn: the broker did not answer");
+		return -2;
+	}
+
+	if (hdr.len > BROKER_MAXLEN || (dst ? hdr.len >= sz : hdr.len != 0)) {
+		log_warnx("warn: bogus reply from the broker");
+		return -2;
+	}
+	/*
+	 * An update gives the broker the configuration it is reloading,
+	 * unless it refused it because it serves another one.
+	 */
+	if (hdr.tag != tag && (type != BROKER_UPDATE || hdr.result != 1)) {
+		log_warnx("warn: the broker serves another configuration");
+		return -2;
+	}
+	if (dst) {
+		if (!broker_read(fd, dst, hdr.len, deadline))
+			return -2;
+		dst[hdr.len] = '\0';
+	}
+
+	return hdr.result;
+}
+
+static void
+broker_drop(size_t i)
+{
+	close(clients[i].fd);
+	free(clients[i].buf);
+	free(clients[i].out);
+	clients[i] = clients[--nclients];
+}
+
+static void
+broker_accept(int sock)
+{
+	struct client	*c;
+	int		 fd;
+
+	if ((fd = accept(sock, NULL, NULL)) == -1) {
+		if (errno != EINTR && errno != ECONNABORTED)
+			log_warn("warn: accept");
+		return;
+	}
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		log_warn("warn: fcntl");
+		close(fd);
+		return;
+	}
+
+	c = reallocarray(clients, nclients + 1, sizeof(*clients));
+	if (c == NULL) {
+		log_warn("warn: reallocarray");
+		close(fd);
+		return;
+	}
+	clients = c;
+	c = &clients[nclients++];
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+}
+
+/*
+ * Queue a reply, to be sent once the client can take it.
+ */
+static int
+broker_queue(struct client *c, const void *buf, size_t len)
+{
+	char	*t;
+	size_t	 size;
+
+	if (c->outsize - c->outlen < len) {
+		size = c->outsize ? c->outsize : BUFSIZ;
+		while (size - c->outlen < len)
+			size *= 2;
+		if ((t = realloc(c->out, size)) == NULL) {
+			log_warn("warn: realloc");
+			return 0;
+		}
+		c->out = t;
+		c->outsize = size;
+	}
+	memcpy(c->out + c->outlen, buf, len);
+	c->outlen += len;
+	return 1;
+}
+
+/*
+ * Send what the client can take of the replies.  Return 0 if the client
+ * has to be dropped.
+ */
+static int
+broker_flush(struct client *c)
+{
+	ssize_t	 n;
+
+	if (c->outlen == 0)
+		return 1;
+	if ((n = write(c->fd, c->out, c->outlen)) == -1)
+		return errno == EINTR || errno == EAGAIN;
+	memmove(c->out, c->out + n, c->outlen - n);
+	c->outlen -= n;
+	return 1;
+}
+
+/*
+ * Read what the client sent and queue the answers to the complete
+ * requests.  Return 0 if the client has to be dropped.
+ */
+static int
+broker_client(struct client *c, uint32_t (*tag)(void),
+    int (*handler)(int, int, const char *, char *, size_t))
+{
+	struct broker_hdr	 hdr;
+	char			 buf[LINE_MAX];
+	char			*t;
+	size_t			 off, len;
+	ssize_t			 n;
+	int			 r;
+
+	if (c->size - c->len < BUFSIZ) {
+		if ((t = realloc(c->buf, c->size + BUFSIZ)) == NULL) {
+			log_warn("warn: realloc");
+			return 0;
+		}
+		c->buf = t;
+		c->size += BUFSIZ;
+	}
+
+	if ((n = read(c->fd, c->buf + c->len, c->size - c->len - 1)) == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 1;
+		return 0;
+	}
+	if (n == 0)
+		return 0;
+	c->len += n;
+
+	off = 0;
+	while (c->len - off >= sizeof(hdr)) {
+		memcpy(&hdr, c->buf + off, sizeof(hdr));
+		if (hdr.len > BROKER_MAXLEN || hdr.type > BROKER_FETCH)
+			return 0;
+		if (c->len - off - sizeof(hdr) < hdr.len)
+			break;
+
+		/* the key is NUL-terminated in place */
+		t = c->buf + off + sizeof(hdr) - 1;
+		memmove(t, t + 1, hdr.len);
+		t[hdr.len] = '\0';
+
+		/* refuse to answer for, or reload, another configuration */
+		memset(buf, 0, sizeof(buf));
+		if (hdr.tag != tag())
+			r = -1;
+		else
+			r = handler(hdr.type, hdr.service, t, buf,
+			    sizeof(buf));
+		off += sizeof(hdr) + hdr.len;
+
+		len = (r == 1 && (hdr.type == BROKER_LOOKUP ||
+		    hdr.type == BROKER_FETCH)) ? strlen(buf) : 0;
+		hdr.len = len;
+		hdr.tag = tag();
+		hdr.result = r;
+		if (!broker_queue(c, &hdr, sizeof(hdr)) ||
+		    !broker_queue(c, buf, len))
+			return 0;
+	}
+
+	memmove(c->buf, c->buf + off, c->len - off);
+	c->len -= off;
+	return broker_flush(c);
+}
+
+void
+broker_serve(const char *path, uint32_t (*tag)(void),
+    int (*handler)(int, int, const char *, char *, size_t))
+{
+	struct sockaddr_un	 sun;
+	struct pollfd		*pfd = NULL;
+	size_t			 i, npfd = 0, nw;
+	mode_t			 old;
+	int			 sock, fd, timeout;
+
+	if (!broker_sockaddr(&sun, path))
+		fatalx("bad broker socket");
+
+	/* refuse to steal the socket of a running broker */
+	if ((fd = broker_connect(path)) != -1)
+		fatalx("a broker is already listening on %s", path);
+	(void)unlink(path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		fatal("socket");
+	old = umask(0117);
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		fatal("bind: %s", path);
+	umask(old);
+	if (listen(sock, 128) == -1)
+		fatal("listen");
+
+	log_debug("debug: broker listening on %s", path);
+
+	for (;;) {
+		timeout = table_api_run_timers();
+
+		nw = table_api_watched(NULL);
+		if (npfd < nclients + 1 + nw) {
+			pfd = reallocarray(pfd, nclients + 1 + nw,
+			    sizeof(*pfd));
+			if (pfd == NULL)
+				fatal("reallocarray");
+			npfd = nclients + 1 + nw;
+		}
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			pfd[i + 1].fd = clients[i].fd;
+			pfd[i + 1].events = 0;
+			/* stop reading a client that does not read its replies */
+			if (clients[i].outlen < BROKER_MAXLEN)
+				pfd[i + 1].events |= POLLIN;
+			if (clients[i].outlen > 0)
+				pfd[i + 1].events |= POLLOUT;
+		}
+		/* the descriptors the table watches come last */
+		table_api_watched(pfd + nclients + 1);
+
+		if (poll(pfd, nclients + 1 + nw, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll");
+		}
+		table_api_run_watch(pfd + nclients + 1, nw);
+
+		/* walk backward since dropping a client moves the last one */
+		for (i = nclients; i > 0; i--) {
+			if (pfd[i].revents == 0)
+				continue;
+			if (((pfd[i].revents & POLLOUT) &&
+			    !broker_flush(&clients[i - 1])) ||
+			    ((pfd[i].revents & ~POLLOUT) &&
+			    !broker_client(&clients[i - 1], tag, handler)))
+				broker_drop(i - 1);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			broker_accept(sock);
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_BROKER_H_
+#define	_BROKER_H_
+
+enum broker_type {
+	BROKER_UPDATE = 0,
+	BROKER_CHECK,
+	BROKER_LOOKUP,
+	BROKER_FETCH,
+};
+
+/*
+ * Every message, in both directions, is a header followed by len bytes
+ * of payload: the key of a request or the value of a reply.  The tag
+ * identifies the configuration of the sender.
+ */
+struct broker_hdr {
+	uint32_t	len;
+	uint32_t	tag;
+	uint16_t	service;
+	uint8_t		type;
+	int8_t		result;		/* replies only */
+};
+
+#define	BROKER_MAXLEN	65535
+#define	BROKER_TIMEOUT	5	/* seconds for the broker to answer */
+
+/* broker.c */
+int		 broker_connect(const char *);
+int		 broker_request(int, uint32_t, int, int, const char *, char *,
+		    size_t);
+__dead void	 broker_serve(const char *, uint32_t (*)(void),
+		    int (*)(int, int, const char *, char *, size_t));
+
+#endif
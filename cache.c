@@ -0,0 +1,1142 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "log.h"
+
+/*
+ * A cache of the results of the lookups, indexed by service and key.
+ * The entries of a check carry no value: they can answer a check but
+ * not a lookup.  The least recently used entry is evicted when the
+ * cache is full.
+ *
+ * The entries live in an array that grows up to the size of the cache
+ * and are linked by index.  They are found through an open-addressed
+ * table of fingerprints and indexes, probed linearly.  Their key is
+ * kept in a chunk of a slab page, so that an entry costs no allocation
+ * of its own.  A timer wheel of one slot per second drops the expired
+ * entries as time goes.
+ *
+ * The values live in an interned pool, shared by reference count,
+ * since many keys resolve to the same few values (a mailbox user, a
+ * list of destinations).
+ *
+ * With refresh-ahead, an entry in use that is hit close to its expiry
+ * is queued for the caller to fetch again, so that it is replaced
+ * before it expires.  The entries that are not used any more expire.
+ *
+ * Expired entries are kept for the stale period, during which they only
+ * answer when the database cannot.
+ *
+ * With admission, a count-min sketch estimates how often each key was
+ * asked recently, and a new key only evicts the least recently used
+ * entry if it was asked more often (TinyLFU).  A flood of keys asked
+ * once then leaves the frequently used entries in place.
+ */
+
+#define	NIL		UINT32_MAX
+
+struct cacheentry {
+	char			*key;		/* "service:key" */
+	struct poolstr		*value;
+	uint64_t		 hash;
+	time_t			 expire;
+	uint32_t		 prev;		/* toward the most recent */
+	uint32_t		 next;		/* also links the free ones */
+	uint32_t		 wprev;		/* in the wheel slot */
+	uint32_t		 wnext;
+	int			 service;
+	int			 ttl;
+	uint16_t		 hits;		/* since it was filled */
+	uint8_t			 sclass;
+	int8_t			 found;
+	uint8_t			 due;		/* queued for a refresh */
+};
+
+#define	ENTRY_VALUE(e)	((e)->value ? (e)->value->s : NULL)
+
+/* an interned value, in a slab chunk */
+struct poolstr {
+	uint64_t		 hash;
+	uint32_t		 refs;
+	uint8_t			 sclass;
+	char			 s[];
+};
+
+/* open-addressed, like the buckets, and at most half full */
+struct pool {
+	struct poolstr		**slots;
+	uint32_t		 mask;
+	uint32_t		 count;
+};
+
+struct bucket {
+	uint32_t		 fp;		/* 0 if empty */
+	uint32_t		 idx;
+};
+
+/*
+ * The chunks of a size class are carved out of the pages as needed,
+ * and the free ones are chained through their first bytes.
+ */
+#define	SLAB_PAGE	65536
+#define	SLAB_NCLASS	(sizeof(slab_sizes) / sizeof(slab_sizes[0]))
+
+static const size_t	 slab_sizes[] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+	3072, 4096, 6144, 8192
+};
+
+struct slab {
+	void			*free[SLAB_NCLASS];
+	char			**pages;
+	size_t			 npages;
+};
+
+#define	WHEEL_SLOTS	1024		/* seconds */
+#define	CACHE_MINCAP	1024
+#define	POOL_MINSIZE	1024
+#define	CACHE_DUE_MAX	256
+
+struct cachedue {
+	int			 service;
+	int			 lookup;
+	char			*key;
+};
+
+#define	SKETCH_DEPTH	4
+#define	SKETCH_MAXCOUNT	15
+#define	SKETCH_SAMPLES	10	/* per counter of a row, before aging */
+
+struct sketch {
+	uint8_t			*counts;	/* SKETCH_DEPTH rows */
+	size_t			 width;		/* a power of two */
+	size_t			 samples;
+};
+
+/*
+ * The cache file is a header followed by the records, each aligned on
+ * 8 bytes so that the file can be used in place once mapped.  The
+ * checksum covers the records.
+ */
+#define	CACHEFILE_MAGIC		"TPGCACHE"
+#define	CACHEFILE_VERSION	1
+#define	CACHEFILE_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+struct cachefile_hdr {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 tag;
+	uint64_t	 count;
+	uint64_t	 size;
+	uint32_t	 crc;
+	uint32_t	 pad;
+};
+
+struct cachefile_rec {
+	int64_t		 expire;
+	uint32_t	 service;
+	int32_t		 found;
+	uint32_t	 klen;		/* both without the NUL */
+	uint32_t	 vlen;
+};
+
+struct cache {
+	struct cacheentry	*entries;
+	uint32_t		 cap;		/* entries allocated */
+	uint32_t		 count;
+	uint32_t		 freelist;
+	struct bucket		*buckets;
+	uint32_t		 mask;		/* number of buckets - 1 */
+	struct slab		 slab;
+	struct pool		 pool;
+	uint32_t		 wheel[WHEEL_SLOTS];
+	time_t			 swept;		/* wheel position */
+	uint32_t		 head;		/* most recently used */
+	uint32_t		 tail;
+	size_t			 max;
+	int			 ttl;
+	int			 negttl;
+	int			 ahead;		/* percent of the ttl */
+	int			 stale;		/* seconds */
+	struct sketch		*sketch;
+	struct cachedue		*due;
+	size_t			 ndue;
+};
+
+/* 64-bit FNV-1a, with the finalizer of MurmurHash3 to spread the bits */
+static uint64_t
+cache_hash(const char *s)
+{
+	uint64_t	 h = 14695981039346656037ULL;
+
+	for (; *s; s++) {
+		h ^= (unsigned char)*s;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint32_t
+cache_fp(uint64_t h)
+{
+	return (h >> 32) | 1;
+}
+
+static void *
+slab_alloc(struct slab *s, size_t len, uint8_t *sclass)
+{
+	char		**pages, *p;
+	void		 *chunk;
+	size_t		  c, i, sz;
+
+	for (c = 0; c < SLAB_NCLASS; c++)
+		if (slab_sizes[c] >= len)
+			break;
+	if (c == SLAB_NCLASS)
+		return NULL;
+	sz = slab_sizes[c];
+
+	if (s->free[c] == NULL) {
+		pages = reallocarray(s->pages, s->npages + 1, sizeof(*pages));
+		if (pages == NULL) {
+			log_warn("warn: reallocarray");
+			return NULL;
+		}
+		s->pages = pages;
+		if ((p = malloc(SLAB_PAGE)) == NULL) {
+			log_warn("warn: malloc");
+			return NULL;
+		}
+		s->pages[s->npages++] = p;
+		for (i = 0; i + sz <= SLAB_PAGE; i += sz) {
+			*(void **)(p + i) = s->free[c];
+			s->free[c] = p + i;
+		}
+	}
+
+	chunk = s->free[c];
+	s->free[c] = *(void **)chunk;
+	*sclass = c;
+	return chunk;
+}
+
+static void
+slab_release(struct slab *s, void *chunk, uint8_t sclass)
+{
+	*(void **)chunk = s->free[sclass];
+	s->free[sclass] = chunk;
+}
+
+/*
+ * Tell if the item at j, whose home slot is home, can fill the hole at
+ * i without breaking its probe sequence.
+ */
+static int
+probe_fills(uint32_t i, uint32_t j, uint32_t home)
+{
+	return (j > i && (home <= i || home > j)) ||
+	    (j < i && home <= i && home > j);
+}
+
+static int
+pool_grow(struct pool *p)
+{
+	struct poolstr	**slots;
+	uint32_t	  i, j, size;
+
+	size = p->slots ? (p->mask + 1) * 2 : POOL_MINSIZE;
+	if ((slots = calloc(size, sizeof(*slots))) == NULL) {
+		log_warn("warn: calloc");
+		return 0;
+	}
+	for (i = 0; p->slots && i <= p->mask; i++) {
+		if (p->slots[i] == NULL)
+			continue;
+		for (j = p->slots[i]->hash & (size - 1); slots[j];
+		    j = (j + 1) & (size - 1))
+			;
+		slots[j] = p->slots[i];
+	}
+	free(p->slots);
+	p->slots = slots;
+	p->mask = size - 1;
+	return 1;
+}
+
+/* Return a reference to the interned copy of the value. */
+static struct poolstr *
+pool_intern(struct cache *c, const char *value)
+{
+	struct pool	*p = &c->pool;
+	struct poolstr	*ps;
+	uint64_t	 h;
+	uint32_t	 i;
+	size_t		 len;
+	uint8_t		 sclass;
+
+	if ((p->count + 1) * 2 > p->mask + 1 && !pool_grow(p))
+		return NULL;
+
+	h = cache_hash(value);
+	for (i = h & p->mask; (ps = p->slots[i]) != NULL;
+	    i = (i + 1) & p->mask)
+		if (ps->hash == h && !strcmp(ps->s, value)) {
+			ps->refs++;
+			return ps;
+		}
+
+	len = strlen(value);
+	if ((ps = slab_alloc(&c->slab, sizeof(*ps) + len + 1, &sclass)) == NULL)
+		return NULL;
+	ps->hash = h;
+	ps->refs = 1;
+	ps->sclass = sclass;
+	memcpy(ps->s, value, len + 1);
+	p->slots[i] = ps;
+	p->count++;
+	return ps;
+}
+
+static void
+pool_release(struct cache *c, struct poolstr *ps)
+{
+	struct pool	*p = &c->pool;
+	uint32_t	 i, j;
+
+	if (ps == NULL || --ps->refs > 0)
+		return;
+
+	for (i = ps->hash & p->mask; p->slots[i] != ps; i = (i + 1) & p->mask)
+		;
+	for (j = i; ; ) {
+		j = (j + 1) & p->mask;
+		if (p->slots[j] == NULL)
+			break;
+		if (probe_fills(i, j, p->slots[j]->hash & p->mask)) {
+			p->slots[i] = p->slots[j];
+			i = j;
+		}
+	}
+	p->slots[i] = NULL;
+	p->count--;
+	slab_release(&c->slab, ps, ps->sclass);
+}
+
+/* the counter of the key in row i, by double hashing */
+static uint8_t *
+sketch_counter(struct sketch *sk, uint64_t h, int i)
+{
+	uint32_t	 h1 = h, h2 = (h >> 32) | 1;
+
+	return &sk->counts[i * sk->width + ((h1 + i * h2) & (sk->width - 1))];
+}
+
+static void
+sketch_add(struct sketch *sk, uint64_t h)
+{
+	size_t		 i;
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+		if (*sketch_counter(sk, h, i) < SKETCH_MAXCOUNT)
+			(*sketch_counter(sk, h, i))++;
+
+	/* halve everything once in a while, so that old keys fade out */
+	if (++sk->samples >= SKETCH_SAMPLES * sk->width) {
+		for (i = 0; i < SKETCH_DEPTH * sk->width; i++)
+			sk->counts[i] >>= 1;
+		sk->samples /= 2;
+	}
+}
+
+static int
+sketch_estimate(struct sketch *sk, uint64_t h)
+{
+	int		 i, n, min = SKETCH_MAXCOUNT;
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+		if ((n = *sketch_counter(sk, h, i)) < min)
+			min = n;
+	return min;
+}
+
+static void
+cache_unlink(struct cache *c, uint32_t i)
+{
+	struct cacheentry	*e = &c->entries[i];
+
+	if (e->prev != NIL)
+		c->entries[e->prev].next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NIL)
+		c->entries[e->next].prev = e->prev;
+	else
+		c->tail = e->prev;
+	e->prev = e->next = NIL;
+}
+
+static void
+cache_link(struct cache *c, uint32_t i)
+{
+	struct cacheentry	*e = &c->entries[i];
+
+	e->prev = NIL;
+	e->next = c->head;
+	if (c->head != NIL)
+		c->entries[c->head].prev = i;
+	c->head = i;
+	if (c->tail == NIL)
+		c->tail = i;
+}
+
+/* the entry is dropped from the wheel slot of the second it goes */
+static void
+wheel_unlink(struct cache *c, uint32_t i)
+{
+	struct cacheentry	*e = &c->entries[i];
+
+	if (e->wprev != NIL)
+		c->entries[e->wprev].wnext = e->wnext;
+	else
+		c->wheel[(e->expire + c->stale) % WHEEL_SLOTS] = e->wnext;
+	if (e->wnext != NIL)
+		c->entries[e->wnext].wprev = e->wprev;
+	e->wprev = e->wnext = NIL;
+}
+
+static void
+wheel_link(struct cache *c, uint32_t i)
+{
+	struct cacheentry	*e = &c->entries[i];
+	uint32_t		*slot;
+
+	slot = &c->wheel[(e->expire + c->stale) % WHEEL_SLOTS];
+	e->wprev = NIL;
+	e->wnext = *slot;
+	if (*slot != NIL)
+		c->entries[*slot].wprev = i;
+	*slot = i;
+}
+
+/* Return the bucket of the key, or of where it would go. */
+static uint32_t
+cache_find(struct cache *c, const char *key, uint64_t h)
+{
+	struct bucket	*b;
+	uint32_t	 i, fp;
+
+	fp = cache_fp(h);
+	for (i = h & c->mask; ; i = (i + 1) & c->mask) {
+		b = &c->buckets[i];
+		if (b->fp == 0 ||
+		    (b->fp == fp && !strcmp(c->entries[b->idx].key, key)))
+			return i;
+	}
+}
+
+/*
+ * Empty the bucket, and move back the entries that probed past it so
+ * that no probe sequence is broken.
+ */
+static void
+cache_unbucket(struct cache *c, uint32_t i)
+{
+	uint32_t	 j, home;
+
+	for (j = i; ; ) {
+		j = (j + 1) & c->mask;
+		if (c->buckets[j].fp == 0)
+			break;
+		home = c->entries[c->buckets[j].idx].hash & c->mask;
+		if (probe_fills(i, j, home)) {
+			c->buckets[i] = c->buckets[j];
+			i = j;
+		}
+	}
+	c->buckets[i].fp = 0;
+}
+
+static void
+cache_remove(struct cache *c, uint32_t i)
+{
+	struct cacheentry	*e = &c->entries[i];
+
+	cache_unbucket(c, cache_find(c, e->key, e->hash));
+	cache_unlink(c, i);
+	wheel_unlink(c, i);
+	slab_release(&c->slab, e->key, e->sclass);
+	pool_release(c, e->value);
+	e->key = NULL;
+	e->value = NULL;
+	e->next = c->freelist;
+	c->freelist = i;
+	c->count--;
+}
+
+/* Drop the entries whose time came since the last sweep. */
+static void
+cache_sweep(struct cache *c, time_t now)
+{
+	struct cacheentry	*e;
+	uint32_t		 i, next;
+	time_t			 t;
+
+	if (c->swept == 0 || now - c->swept > WHEEL_SLOTS)
+		c->swept = now - WHEEL_SLOTS;
+
+	for (t = c->swept + 1; t <= now; t++)
+		for (i = c->wheel[t % WHEEL_SLOTS]; i != NIL; i = next) {
+			e = &c->entries[i];
+			next = e->wnext;
+			if (e->expire + c->stale <= now)
+				cache_remove(c, i);
+		}
+	if (now > c->swept)
+		c->swept = now;
+}
+
+/* Make room for more entries, up to the size of the cache. */
+static int
+cache_grow(struct cache *c)
+{
+	struct cacheentry	*entries;
+	struct bucket		*buckets;
+	uint32_t		 cap, i, j, nb;
+
+	if (c->cap >= c->max)
+		return 0;
+	cap = c->cap ? c->cap * 2 : CACHE_MINCAP;
+	if (cap > c->max)
+		cap = c->max;
+
+	for (nb = 1; nb < cap * 2; nb *= 2)
+		;
+	if ((buckets = calloc(nb, sizeof(*buckets))) == NULL) {
+		log_warn("warn: calloc");
+		return 0;
+	}
+	entries = reallocarray(c->entries, cap, sizeof(*entries));
+	if (entries == NULL) {
+		log_warn("warn: reallocarray");
+		free(buckets);
+		return 0;
+	}
+	c->entries = entries;
+
+	for (i = cap; i > c->cap; i--) {
+		memset(&entries[i - 1], 0, sizeof(*entries));
+		entries[i - 1].next = c->freelist;
+		c->freelist = i - 1;
+	}
+
+	/* the live entries are the ones that have a key */
+	free(c->buckets);
+	c->buckets = buckets;
+	c->mask = nb - 1;
+	for (i = 0; i < c->cap; i++) {
+		if (entries[i].key == NULL)
+			continue;
+		for (j = entries[i].hash & c->mask; buckets[j].fp;
+		    j = (j + 1) & c->mask)
+			;
+		buckets[j].fp = cache_fp(entries[i].hash);
+		buckets[j].idx = i;
+	}
+	c->cap = cap;
+
+	return 1;
+}
+
+static int
+cache_key(char *buf, size_t sz, int service, const char *key)
+{
+	int	 r;
+
+	r = snprintf(buf, sz, "%x:%s", service, key);
+	return r >= 0 && (size_t)r < sz;
+}
+
+static uint32_t
+crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char	*p = buf;
+	int			 i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
+	}
+	return ~crc;
+}
+
+struct cache *
+cache_new(size_t max, int ttl, int negttl)
+{
+	struct cache	*c;
+	size_t		 i;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		log_warn("warn: calloc");
+		return NULL;
+	}
+
+	c->max = max;
+	if (c->max == 0 || c->max >= NIL)
+		c->max = NIL - 1;
+	c->ttl = ttl;
+	c->negttl = negttl;
+	c->freelist = c->head = c->tail = NIL;
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		c->wheel[i] = NIL;
+
+	if (!cache_grow(c)) {
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+void
+cache_free(struct cache *c)
+{
+	size_t	 i;
+
+	if (c == NULL)
+		return;
+
+	for (i = 0; i < c->slab.npages; i++)
+		free(c->slab.pages[i]);
+	free(c->slab.pages);
+	free(c->pool.slots);
+	free(c->entries);
+	free(c->buckets);
+	for (i = 0; i < c->ndue; i++)
+		free(c->due[i].key);
+	free(c->due);
+	if (c->sketch)
+		free(c->sketch->counts);
+	free(c->sketch);
+	free(c);
+}
+
+/*
+ * Queue the entries hit in the last pct percent of their lifetime, if
+ * they were hit before, for a refresh.
+ */
+void
+cache_refresh_ahead(struct cache *c, int pct)
+{
+	c->ahead = pct;
+}
+
+/*
+ * Only let a new key evict an entry if it was asked more often.  The
+ * sketch has about as many counters per row as the cache has entries.
+ */
+int
+cache_admission(struct cache *c)
+{
+	struct sketch	*sk;
+
+	if ((sk = calloc(1, sizeof(*sk))) == NULL) {
+		log_warn("warn: calloc");
+		return 0;
+	}
+	for (sk->width = 64; sk->width < c->max; sk->width *= 2)
+		;
+	if ((sk->counts = calloc(SKETCH_DEPTH, sk->width)) == NULL) {
+		log_warn("warn: calloc");
+		free(sk);
+		return 0;
+	}
+	c->sketch = sk;
+	return 1;
+}
+
+/*
+ * Keep the expired entries for max seconds, to serve them stale.  It is
+ * set before the cache is filled, since the wheel depends on it.
+ */
+void
+cache_serve_stale(struct cache *c, int max)
+{
+	c->stale = max;
+}
+
+static void
+cache_queue(struct cache *c, struct cacheentry *e)
+{
+	struct cachedue	*d;
+
+	if (c->ndue == CACHE_DUE_MAX)
+		return;
+	if (c->due == NULL &&
+	    (c->due = calloc(CACHE_DUE_MAX, sizeof(*c->due))) == NULL) {
+		log_warn("warn: calloc");
+		return;
+	}
+
+	d = &c->due[c->ndue];
+	if ((d->key = strdup(strchr(e->key, ':') + 1)) == NULL) {
+		log_warn("warn: strdup");
+		return;
+	}
+	d->service = e->service;
+	d->lookup = !e->found || e->value;
+	c->ndue++;
+	e->due = 1;
+}
+
+/*
+ * Take the next entry to refresh, and tell if it answers lookups or
+ * only checks.  Return 0 if there is none.
+ */
+int
+cache_due(struct cache *c, int *service, int *lookup, char *key, size_t sz)
+{
+	struct cachedue	 d;
+	int		 r;
+
+	if (c->ndue == 0)
+		return 0;
+
+	d = c->due[0];
+	memmove(c->due, c->due + 1, --c->ndue * sizeof(*c->due));
+
+	*service = d.service;
+	*lookup = d.lookup;
+	r = strlcpy(key, d.key, sz) < sz;
+	free(d.key);
+	return r;
+}
+
+size_t
+cache_ndue(struct cache *c)
+{
+	return c->ndue;
+}
+
+static int
+cache_value(struct cacheentry *e, char *dst, size_t sz)
+{
+	if (e->found && dst) {
+		if (e->value == NULL)
+			return 0;
+		if (strlcpy(dst, ENTRY_VALUE(e), sz) >= sz)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Look the key up in the cache.  Return -1 if there is no usable entry,
+ * otherwise 1 or 0 depending on whether the key was found.  For a
+ * lookup, dst is filled with the value.
+ */
+int
+cache_get(struct cache *c, int service, const char *key, char *dst,
+    size_t sz)
+{
+	struct cacheentry	*e;
+	char			 buf[LINE_MAX];
+	uint64_t		 h;
+	uint32_t		 b, i;
+	time_t			 now;
+
+	if (!cache_key(buf, sizeof(buf), service, key))
+		return -1;
+
+	h = cache_hash(buf);
+	if (c->sketch)
+		sketch_add(c->sketch, h);
+
+	now = time(NULL);
+	cache_sweep(c, now);
+
+	b = cache_find(c, buf, h);
+	if (c->buckets[b].fp == 0)
+		return -1;
+	i = c->buckets[b].idx;
+	e = &c->entries[i];
+
+	if (e->expire <= now || !cache_value(e, dst, sz))
+		return -1;
+
+	cache_unlink(c, i);
+	cache_link(c, i);
+
+	if (e->hits < UINT16_MAX)
+		e->hits++;
+	if (e->hits > 1 && c->ahead && !e->due &&
+	    now >= e->expire - (time_t)e->ttl * c->ahead / 100)
+		cache_queue(c, e);
+
+	return e->found;
+}
+
+/*
+ * Like cache_get(), but leave the cache as it is: the entry is not
+ * counted as used, moved or queued for a refresh.  It tells whether a
+ * request would be answered locally.
+ */
+int
+cache_peek(struct cache *c, int service, const char *key, char *dst,
+    size_t sz)
+{
+	struct cacheentry	*e;
+	char			 buf[LINE_MAX];
+	uint32_t		 b;
+
+	if (!cache_key(buf, sizeof(buf), service, key))
+		return -1;
+
+	b = cache_find(c, buf, cache_hash(buf));
+	if (c->buckets[b].fp == 0)
+		return -1;
+	e = &c->entries[c->buckets[b].idx];
+
+	if (e->expire <= time(NULL) || !cache_value(e, dst, sz))
+		return -1;
+
+	return e->found;
+}
+
+/*
+ * Like cache_get(), but also use an entry that expired less than the
+ * stale period ago.
+ */
+int
+cache_get_stale(struct cache *c, int service, const char *key, char *dst,
+    size_t sz)
+{
+	struct cacheentry	*e;
+	char			 buf[LINE_MAX];
+	uint32_t		 b;
+
+	if (!cache_key(buf, sizeof(buf), service, key))
+		return -1;
+
+	b = cache_find(c, buf, cache_hash(buf));
+	if (c->buckets[b].fp == 0)
+		return -1;
+	e = &c->entries[c->buckets[b].idx];
+
+	if (e->expire + c->stale <= time(NULL) || !cache_value(e, dst, sz))
+		return -1;
+
+	return e->found;
+}
+
+/*
+ * Remember the result of a check, when value is NULL, or of a lookup,
+ * for ttl seconds or, if it is -1, the default of the cache.  A check
+ * never replaces the value of a previous lookup that agrees with it.
+ */
+void
+cache_set(struct cache *c, int service, const char *key, int found,
+    const char *value, int ttl)
+{
+	if (ttl == -1)
+		ttl = found ? c->ttl : c->negttl;
+	if (ttl == 0)
+		return;
+
+	cache_insert(c, service, key, found, value, time(NULL) + ttl);
+}
+
+void
+cache_insert(struct cache *c, int service, const char *key, int found,
+    const char *value, time_t expire)
+{
+	struct cacheentry	*e;
+	struct poolstr		*ps = NULL;
+	char			 buf[LINE_MAX];
+	char			*k;
+	uint64_t		 h;
+	uint32_t		 b, i;
+	size_t			 len;
+	uint8_t			 sclass;
+	time_t			 now;
+
+	if (found == -1 || !cache_key(buf, sizeof(buf), service, key))
+		return;
+	if (!found)
+		value = NULL;
+
+	now = time(NULL);
+	cache_sweep(c, now);
+
+	h = cache_hash(buf);
+	b = cache_find(c, buf, h);
+	if (c->buckets[b].fp) {
+		i = c->buckets[b].idx;
+		e = &c->entries[i];
+		if (value == NULL && e->found == found) {
+			ps = e->value;
+			e->value = NULL;
+		}
+	} else {
+		/* a victim that is still of use has to lose the comparison */
+		if (c->sketch && c->count >= c->max &&
+		    c->entries[c->tail].expire + c->stale > now &&
+		    sketch_estimate(c->sketch, h) <=
+		    sketch_estimate(c->sketch, c->entries[c->tail].hash))
+			return;
+		if (c->count >= c->max ||
+		    (c->freelist == NIL && !cache_grow(c)))
+			cache_remove(c, c->tail);
+		i = NIL;
+		e = NULL;
+	}
+
+	if (value && (ps = pool_intern(c, value)) == NULL) {
+		if (e)
+			cache_remove(c, i);
+		return;
+	}
+
+	if (e) {
+		cache_unlink(c, i);
+		wheel_unlink(c, i);
+		pool_release(c, e->value);
+	} else {
+		len = strlen(buf);
+		if ((k = slab_alloc(&c->slab, len + 1, &sclass)) == NULL) {
+			pool_release(c, ps);
+			return;
+		}
+		memcpy(k, buf, len + 1);
+
+		i = c->freelist;
+		e = &c->entries[i];
+		c->freelist = e->next;
+		c->count++;
+		/* an eviction may have moved the buckets, so look again */
+		b = cache_find(c, buf, h);
+		c->buckets[b].fp = cache_fp(h);
+		c->buckets[b].idx = i;
+		e->key = k;
+		e->sclass = sclass;
+		e->hash = h;
+	}
+
+	e->value = ps;
+	e->service = service;
+	e->found = found;
+	e->expire = expire;
+	e->ttl = expire - now;
+	e->hits = 0;
+	e->due = 0;
+	cache_link(c, i);
+	wheel_link(c, i);
+}
+
+/*
+ * Write the live entries to path, through a temporary file renamed
+ * over it.  The tag identifies the configuration the entries belong to.
+ */
+int
+cache_save(struct cache *c, const char *path, uint32_t tag)
+{
+	struct cachefile_hdr	 hdr;
+	struct cachefile_rec	 rec;
+	struct cacheentry	*e;
+	FILE			*fp;
+	char			 tmp[PATH_MAX];
+	static const char	 zero[8];
+	const char		*k, *v;
+	uint32_t		 i;
+	size_t			 len, pad;
+	time_t			 now;
+	int			 fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		log_warnx("warn: cache file path too long");
+		return 0;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		log_warn("warn: mkstemp: %s", tmp);
+		return 0;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		log_warn("warn: fdopen");
+		close(fd);
+		unlink(tmp);
+		return 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHEFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHEFILE_VERSION;
+	hdr.tag = tag;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	now = time(NULL);
+	for (i = c->tail; i != NIL; i = e->prev) {
+		e = &c->entries[i];
+		if (e->expire <= now)
+			continue;
+		k = strchr(e->key, ':') + 1;
+		v = ENTRY_VALUE(e);
+
+		memset(&rec, 0, sizeof(rec));
+		rec.expire = e->expire;
+		rec.service = e->service;
+		rec.found = e->found;
+		rec.klen = strlen(k);
+		rec.vlen = v ? strlen(v) : 0;
+		len = sizeof(rec) + rec.klen + 1 + rec.vlen + 1;
+		pad = CACHEFILE_ALIGN(len) - len;
+
+		fwrite(&rec, sizeof(rec), 1, fp);
+		fwrite(k, rec.klen + 1, 1, fp);
+		fwrite(v ? v : "", rec.vlen + 1, 1, fp);
+		fwrite(zero, pad, 1, fp);
+
+		hdr.crc = crc32(hdr.crc, &rec, sizeof(rec));
+		hdr.crc = crc32(hdr.crc, k, rec.klen + 1);
+		hdr.crc = crc32(hdr.crc, v ? v : "", rec.vlen + 1);
+		hdr.crc = crc32(hdr.crc, zero, pad);
+		hdr.count++;
+		hdr.size += len + pad;
+	}
+
+	if (fseek(fp, 0, SEEK_SET) == -1 ||
+	    fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+		log_warn("warn: %s", tmp);
+		fclose(fp);
+		unlink(tmp);
+		return 0;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path) == -1) {
+		log_warn("warn: rename %s", path);
+		unlink(tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Fill the cache with the entries of the file that did not expire yet.
+ * A missing file, or one written for another configuration, is not an
+ * error.
+ */
+int
+cache_load(struct cache *c, const char *path, uint32_t tag)
+{
+	struct cachefile_hdr	 hdr;
+	struct cachefile_rec	 rec;
+	struct stat		 sb;
+	const char		*base, *p, *end, *k, *v;
+	time_t			 now;
+	uint64_t		 n;
+	size_t			 len;
+	int			 fd, r = 0;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 1;
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: fstat: %s", path);
+		close(fd);
+		return 0;
+	}
+	if ((size_t)sb.st_size < sizeof(hdr)) {
+		log_warnx("warn: %s: truncated", path);
+		close(fd);
+		return 0;
+	}
+
+	base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		log_warn("warn: mmap: %s", path);
+		return 0;
+	}
+
+	p = base;
+	end = base + sb.st_size;
+	memcpy(&hdr, p, sizeof(hdr));
+	if (memcmp(hdr.magic, CACHEFILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != CACHEFILE_VERSION ||
+	    hdr.size != sb.st_size - sizeof(hdr) ||
+	    crc32(0, p + sizeof(hdr), hdr.size) != hdr.crc) {
+		log_warnx("warn: %s: bad cache file, ignored", path);
+		goto done;
+	}
+	if (hdr.tag != tag) {
+		log_debug("debug: %s: written for another configuration",
+		    path);
+		r = 1;
+		goto done;
+	}
+
+	now = time(NULL);
+	p += sizeof(hdr);
+	for (n = 0; n < hdr.count; n++) {
+		if ((size_t)(end - p) < sizeof(rec))
+			goto done;
+		memcpy(&rec, p, sizeof(rec));
+		len = sizeof(rec) + rec.klen + 1 + rec.vlen + 1;
+		if ((size_t)(end - p) < len)
+			goto done;
+		k = p + sizeof(rec);
+		v = k + rec.klen + 1;
+		if (k[rec.klen] != '\0' || v[rec.vlen] != '\0')
+			goto done;
+		if (rec.expire > now)
+			cache_insert(c, rec.service, k, rec.found,
+			    rec.vlen ? v : NULL, rec.expire);
+		p += CACHEFILE_ALIGN(len);
+	}
+	r = 1;
+
+	log_debug("debug: %s: loaded %llu entries", path,
+	    (unsigned long long)n);
+
+done:
+	munmap((void *)base, sb.st_size);
+	return r;
+}
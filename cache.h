@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_CACHE_H_
+#define	_CACHE_H_
+
+struct cache;
+
+/* cache.c */
+struct cache	*cache_new(size_t, int, int);
+void		 cache_free(struct cache *);
+void		 cache_refresh_ahead(struct cache *, int);
+int		 cache_admission(struct cache *);
+int		 cache_due(struct cache *, int *, int *, char *, size_t);
+size_t		 cache_ndue(struct cache *);
+int		 cache_get(struct cache *, int, const char *, char *, size_t);
+int		 cache_peek(struct cache *, int, const char *, char *, size_t);
+void		 cache_serve_stale(struct cache *, int);
+int		 cache_get_stale(struct cache *, int, const char *, char *,
+		    size_t);
+void		 cache_set(struct cache *, int, const char *, int, const char *,
+		    int);
+void		 cache_insert(struct cache *, int, const char *, int, const char *,
+		    time_t);
+int		 cache_save(struct cache *, const char *, uint32_t);
+int		 cache_load(struct cache *, const char *, uint32_t);
+
+#endif
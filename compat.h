@@ -22,6 +22,10 @@ int		 asprintf(char **, const char *, ...);
 const char	*getprogname(void);
 #endif
 
+#ifndef HAVE_REALLOCARRAY
+void		*reallocarray(void *, size_t, size_t);
+#endif
+
 #ifndef HAVE_STRLCAT
 size_t		 strlcat(char *, const char *, size_t);
 #endif
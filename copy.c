@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/tree.h>
+
+#include <ctype.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libpq-fe.h>
+
+#include "copy.h"
+#include "dict.h"
+#include "log.h"
+#include "table_stdio.h"
+
+/*
+ * Bulk queries are streamed with COPY (query) TO STDOUT rather than
+ * collected in a PGresult, so that each row can be stored where it
+ * belongs as soon as it arrives and is freed right after.
+ */
+
+enum copy_state {
+	COPY_CONNECT,
+	COPY_QUERY,
+	COPY_STREAM,
+	COPY_END,
+};
+
+#define	COPY_TIMEOUT	5	/* seconds to establish the connection */
+#define	COPY_STALL	60	/* seconds the server may stay silent */
+
+struct copy {
+	struct copy	 *next;
+	PGconn		 *db;
+	char		 *query;
+	char		 *param;
+	int		  fd;
+	int		  state;
+	int		  ok;
+	time_t		  deadline;
+	int		(*row)(char **, int, void *);
+	void		(*done)(int, void *);
+	void		 *arg;
+};
+
+static struct copy	*copies;
+static int		 expiring;
+
+static int
+copy_hex(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	return tolower(c) - 'a' + 10;
+}
+
+/*
+ * Split a row of the text format into its fields, decoding the escapes
+ * in place.  A NULL is returned as an empty field, like PQgetvalue()
+ * does.  Return the number of fields, or -1 if there are too many.
+ */
+int
+copy_fields(char *line, size_t len, char **fields, int max)
+{
+	char	*s, *end, *d;
+	int	 n, v, i;
+
+	end = line + len;
+	if (end > line && end[-1] == '\n')
+		end--;
+
+	n = 0;
+	s = d = line;
+	fields[n++] = d;
+	while (s < end) {
+		if (*s == '\t') {
+			*d++ = '\0';
+			s++;
+			if (n == max)
+				return -1;
+			fields[n++] = d;
+			continue;
+		}
+		if (*s != '\\' || s + 1 == end) {
+			*d++ = *s++;
+			continue;
+		}
+
+		s++;
+		switch (*s) {
+		case 'N':
+			s++;
+			break;
+		case 'b':
+			*d++ = '\b';
+			s++;
+			break;
+		case 'f':
+			*d++ = '\f';
+			s++;
+			break;
+		case 'n':
+			*d++ = '\n';
+			s++;
+			break;
+		case 'r':
+			*d++ = '\r';
+			s++;
+			break;
+		case 't':
+			*d++ = '\t';
+			s++;
+			break;
+		case 'v':
+			*d++ = '\v';
+			s++;
+			break;
+		case 'x':
+			s++;
+			for (v = 0, i = 0; i < 2 && s < end &&
+			    isxdigit((unsigned char)*s); i++)
+				v = v * 16 + copy_hex(*s++);
+			*d++ = v;
+			break;
+		default:
+			if (*s >= '0' && *s <= '7') {
+				for (v = 0, i = 0; i < 3 && s < end &&
+				    *s >= '0' && *s <= '7'; i++)
+					v = v * 8 + *s++ - '0';
+				*d++ = v;
+			} else
+				*d++ = *s++;
+			break;
+		}
+	}
+	*d = '\0';
+
+	return n;
+}
+
+static char *
+copy_command(const char *query)
+{
+	char	*q;
+	size_t	 len;
+
+	/* COPY takes a bare statement */
+	len = strlen(query);
+	while (len > 0 && (isspace((unsigned char)query[len - 1]) ||
+	    query[len - 1] == ';'))
+		len--;
+	if (asprintf(&q, "COPY (%.*s) TO STDOUT", (int)len, query) == -1) {
+		log_warn("warn: asprintf");
+		return NULL;
+	}
+	return q;
+}
+
+/*
+ * COPY takes no parameters, so the $1 of the query is replaced with the
+ * parameter as a literal, escaped for the connection.
+ */
+static char *
+copy_bind(PGconn *db, const char *query, const char *param)
+{
+	char		*lit, *q, *d;
+	const char	*p;
+	size_t		 len, n;
+
+	if ((lit = PQescapeLiteral(db, param, strlen(param))) == NULL)
+		return NULL;
+	len = strlen(lit);
+
+	n = 0;
+	for (p = query; (p = strstr(p, "$1")) != NULL; p += 2)
+		if (!isdigit((unsigned char)p[2]))
+			n++;
+	if ((q = malloc(strlen(query) + n * len + 1)) == NULL) {
+		log_warn("warn: malloc");
+		PQfreemem(lit);
+		return NULL;
+	}
+
+	for (p = query, d = q; *p; ) {
+		if (p[0] == '$' && p[1] == '1' &&
+		    !isdigit((unsigned char)p[2])) {
+			memcpy(d, lit, len);
+			d += len;
+			p += 2;
+		} else
+			*d++ = *p++;
+	}
+	*d = '\0';
+	PQfreemem(lit);
+
+	return q;
+}
+
+static int
+copy_row(char *buf, int n, int (*row)(char **, int, void *), void *arg)
+{
+	char	*fields[COPY_MAXFIELDS];
+	int	 nfields;
+
+	if ((nfields = copy_fields(buf, n, fields, COPY_MAXFIELDS)) == -1) {
+		log_warnx("warn: too many columns in bulk query");
+		return 0;
+	}
+	return row(fields, nfields, arg);
+}
+
+/*
+ * Run the query through COPY and hand each row to the callback, which
+ * returns 0 to reject it.  The rows keep streaming until the end so
+ * that the connection stays usable.  Return 1 if every row made it, 0
+ * if the query failed, or -1 if the connection did.
+ */
+int
+copy_exec(PGconn *db, const char *query,
+    int (*row)(char **, int, void *), void *arg)
+{
+	PGresult	*res, *r;
+	const char	*errfld;
+	char		*q, *buf;
+	int		 n, ok;
+
+	if ((q = copy_command(query)) == NULL)
+		return 0;
+	res = PQexec(db, q);
+	free(q);
+
+	ok = 1;
+	if (PQresultStatus(res) == PGRES_COPY_OUT) {
+		PQclear(res);
+		while ((n = PQgetCopyData(db, &buf, 0)) > 0) {
+			if (ok && !copy_row(buf, n, row, arg))
+				ok = 0;
+			PQfreemem(buf);
+		}
+
+		/* the status of the command follows the data */
+		res = PQgetResult(db);
+		while ((r = PQgetResult(db)) != NULL)
+			PQclear(r);
+	}
+
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		errfld = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+		ok = (errfld == NULL || (errfld[0] == '0' && errfld[1] == '8')) ?
+		    -1 : 0;
+		log_warnx("warn: COPY: %s", PQerrorMessage(db));
+		PQclear(res);
+		return ok;
+	}
+	PQclear(res);
+
+	return ok;
+}
+
+static time_t
+copy_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void
+copy_finish(struct copy *c, int ok)
+{
+	void	(*done)(int, void *) = c->done;
+	void	 *arg = c->arg;
+
+	copy_abort(c);
+	done(ok, arg);
+}
+
+static void	copy_read(int, void *);
+
+static void
+copy_watch(struct copy *c, int events)
+{
+	int	 fd;
+
+	/* libpq may open another socket while it tries the hosts */
+	if ((fd = PQsocket(c->db)) != c->fd) {
+		table_api_watch(c->fd, NULL, NULL);
+		c->fd = fd;
+		table_api_watch(fd, copy_read, c);
+	}
+	table_api_watch_events(fd, events);
+}
+
+/*
+ * Fail the copies that could not connect in time, or whose server went
+ * silent in the middle of the query.
+ */
+static void
+copy_expire(void *arg)
+{
+	struct copy	*c;
+	time_t		 now;
+
+	(void)arg;
+
+	expiring = 0;
+	now = copy_now();
+again:
+	for (c = copies; c != NULL; c = c->next) {
+		if (c->deadline > now)
+			continue;
+		if (c->state == COPY_CONNECT)
+			log_warnx("warn: COPY: connection timed out");
+		else
+			log_warnx("warn: COPY: no data for %d seconds",
+			    COPY_STALL);
+		copy_finish(c, 0);
+		goto again;
+	}
+
+	if (copies && !expiring) {
+		expiring = 1;
+		table_api_add_timer(1000, copy_expire, NULL);
+	}
+}
+
+static void
+copy_read(int fd, void *arg)
+{
+	struct copy	*c = arg;
+	PGresult	*res;
+	char		*buf, *q;
+	int		 n;
+
+	if (c->state == COPY_CONNECT) {
+		switch (PQconnectPoll(c->db)) {
+		case PGRES_POLLING_READING:
+			copy_watch(c, POLLIN);
+			return;
+		case PGRES_POLLING_WRITING:
+			copy_watch(c, POLLOUT);
+			return;
+		case PGRES_POLLING_OK:
+			break;
+		default:
+			goto fail;
+		}
+		if (c->param) {
+			if ((q = copy_bind(c->db, c->query, c->param)) == NULL)
+				goto fail;
+			free(c->query);
+			c->query = q;
+		}
+		if ((q = copy_command(c->query)) == NULL)
+			goto fail;
+		free(c->query);
+		c->query = q;
+		if (PQsetnonblocking(c->db, 1) == -1 ||
+		    !PQsendQuery(c->db, c->query))
+			goto fail;
+		c->state = COPY_QUERY;
+		c->deadline = copy_now() + COPY_STALL;
+		copy_watch(c, POLLIN | POLLOUT);
+		return;
+	}
+
+	if ((n = PQflush(c->db)) == -1 || !PQconsumeInput(c->db))
+		goto fail;
+	c->deadline = copy_now() + COPY_STALL;
+	if (n == 0)
+		table_api_watch_events(fd, POLLIN);
+
+	if (c->state == COPY_QUERY) {
+		if (PQisBusy(c->db))
+			return;
+		res = PQgetResult(c->db);
+		if (PQresultStatus(res) != PGRES_COPY_OUT) {
+			PQclear(res);
+			goto fail;
+		}
+		PQclear(res);
+		c->state = COPY_STREAM;
+	}
+
+	if (c->state == COPY_STREAM) {
+		while ((n = PQgetCopyData(c->db, &buf, 1)) > 0) {
+			if (c->ok && !copy_row(buf, n, c->row, c->arg))
+				c->ok = 0;
+			PQfreemem(buf);
+		}
+		if (n == 0)
+			return;
+		if (n == -2)
+			goto fail;
+		c->state = COPY_END;
+	}
+
+	/* the status of the command follows the data, maybe later */
+	if (PQisBusy(c->db))
+		return;
+	res = PQgetResult(c->db);
+	n = PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+	if (!n)
+		goto fail;
+	copy_finish(c, c->ok);
+	return;
+
+fail:
+	log_warnx("warn: COPY: %s", PQerrorMessage(c->db));
+	copy_finish(c, 0);
+}
+
+/*
+ * Run the query through COPY on a connection of its own, and stream the
+ * rows to the callback between requests.  The connection is
+ * established in the background too.  If param is not NULL, it is the
+ * value of $1 in the query.  The done callback tells whether every row
+ * made it, once the copy is over.
+ */
+struct copy *
+copy_start(const char *conninfo, const char *query, const char *param,
+    int (*row)(char **, int, void *), void (*done)(int, void *), void *arg)
+{
+	struct copy	*c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		log_warn("warn: calloc");
+		return NULL;
+	}
+	c->row = row;
+	c->done = done;
+	c->arg = arg;
+	c->ok = 1;
+	c->fd = -1;
+
+	if ((c->query = strdup(query)) == NULL ||
+	    (param && (c->param = strdup(param)) == NULL)) {
+		log_warn("warn: strdup");
+		free(c->query);
+		free(c);
+		return NULL;
+	}
+	c->db = PQconnectStart(conninfo);
+	if (c->db == NULL || PQstatus(c->db) == CONNECTION_BAD) {
+		log_warnx("warn: COPY: %s",
+		    c->db ? PQerrorMessage(c->db) : "out of memory");
+		PQfinish(c->db);
+		free(c->query);
+		free(c->param);
+		free(c);
+		return NULL;
+	}
+
+	c->state = COPY_CONNECT;
+	c->deadline = copy_now() + COPY_TIMEOUT;
+	c->next = copies;
+	copies = c;
+	copy_watch(c, POLLOUT);
+	if (!expiring) {
+		expiring = 1;
+		table_api_add_timer(1000, copy_expire, NULL);
+	}
+
+	return c;
+}
+
+void
+copy_abort(struct copy *c)
+{
+	struct copy	**p;
+
+	if (c == NULL)
+		return;
+
+	for (p = &copies; *p != NULL; p = &(*p)->next)
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	if (c->fd != -1)
+		table_api_watch(c->fd, NULL, NULL);
+	PQfinish(c->db);
+	free(c->query);
+	free(c->param);
+	free(c);
+}
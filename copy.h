@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_COPY_H_
+#define	_COPY_H_
+
+#define	COPY_MAXFIELDS	32
+
+struct copy;
+
+/* copy.c */
+int		 copy_exec(PGconn *, const char *,
+		    int (*)(char **, int, void *), void *);
+int		 copy_fields(char *, size_t, char **, int);
+struct copy	*copy_start(const char *, const char *, const char *,
+		    int (*)(char **, int, void *), void (*)(int, void *), void *);
+void		 copy_abort(struct copy *);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "radix.h"
+
+/*
+ * A radix tree of network blocks, one per address family, answering
+ * with the longest block that contains an address.  Chains of nodes
+ * with a single child are collapsed, so a lookup visits at most one
+ * node per distinct prefix length on its path.
+ */
+
+struct rnode {
+	uint8_t		 key[16];
+	int		 plen;
+	char		*value;		/* NULL for a branching node */
+	struct rnode	*child[2];
+};
+
+struct radix {
+	struct rnode	*root[2];	/* IPv4, IPv6 */
+};
+
+static int
+rbit(const uint8_t *key, int n)
+{
+	return (key[n / 8] >> (7 - n % 8)) & 1;
+}
+
+/* number of leading bits a and b share, up to max */
+static int
+rcommon(const uint8_t *a, const uint8_t *b, int max)
+{
+	int	 n = 0;
+	uint8_t	 x;
+
+	while (n + 8 <= max && a[n / 8] == b[n / 8])
+		n += 8;
+	if (n < max) {
+		x = a[n / 8] ^ b[n / 8];
+		while (n < max && !(x & (0x80 >> (n % 8))))
+			n++;
+	}
+	return n;
+}
+
+/*
+ * Parse an address, with an optional prefix length, the way smtpd and
+ * PostgreSQL print them.
+ */
+static int
+radix_parse(const char *s, uint8_t *key, int *af, int *plen)
+{
+	char		 buf[INET6_ADDRSTRLEN + 8], *p, *slash;
+	const char	*e;
+	int		 bits, i;
+
+	if (strncasecmp(s, "IPv6:", 5) == 0)
+		s += 5;
+	if (strlcpy(buf, s, sizeof(buf)) >= sizeof(buf))
+		return 0;
+	p = buf;
+	if (*p == '[') {
+		p++;
+		if ((slash = strchr(p, ']')) == NULL)
+			return 0;
+		memmove(slash, slash + 1, strlen(slash + 1) + 1);
+	}
+
+	if ((slash = strchr(p, '/')) != NULL)
+		*slash++ = '\0';
+
+	memset(key, 0, 16);
+	if (inet_pton(AF_INET, p, key) == 1) {
+		*af = 0;
+		bits = 32;
+	} else if (inet_pton(AF_INET6, p, key) == 1) {
+		*af = 1;
+		bits = 128;
+	} else
+		return 0;
+
+	*plen = bits;
+	if (slash) {
+		e = NULL;
+		*plen = strtonum(slash, 0, bits, &e);
+		if (e)
+			return 0;
+	}
+
+	/* clear the host bits */
+	for (i = *plen; i < bits; i++)
+		key[i / 8] &= ~(0x80 >> (i % 8));
+
+	return 1;
+}
+
+struct radix *
+radix_new(void)
+{
+	struct radix	*r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		log_warn("warn: calloc");
+	return r;
+}
+
+static void
+rnode_free(struct rnode *n)
+{
+	if (n == NULL)
+		return;
+	rnode_free(n->child[0]);
+	rnode_free(n->child[1]);
+	free(n->value);
+	free(n);
+}
+
+void
+radix_free(struct radix *r)
+{
+	if (r == NULL)
+		return;
+	rnode_free(r->root[0]);
+	rnode_free(r->root[1]);
+	free(r);
+}
+
+static struct rnode *
+rnode_new(const uint8_t *key, int plen)
+{
+	struct rnode	*n;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		return NULL;
+	memcpy(n->key, key, sizeof(n->key));
+	n->plen = plen;
+	return n;
+}
+
+/*
+ * Add the block, or replace its value.  Return 0 if the block is not
+ * valid or memory ran out.
+ */
+int
+radix_insert(struct radix *r, const char *cidr, const char *value)
+{
+	struct rnode	**np, *n, *b, *leaf;
+	uint8_t		  key[16];
+	char		 *v;
+	int		  af, plen, common;
+
+	if (!radix_parse(cidr, key, &af, &plen))
+		return 0;
+	if ((v = strdup(value)) == NULL)
+		return 0;
+
+	np = &r->root[af];
+	for (;;) {
+		if ((n = *np) == NULL) {
+			if ((leaf = rnode_new(key, plen)) == NULL)
+				goto fail;
+			leaf->value = v;
+			*np = leaf;
+			return 1;
+		}
+
+		common = rcommon(key, n->key, plen < n->plen ? plen : n->plen);
+		if (common == n->plen) {
+			if (plen == n->plen) {
+				free(n->value);
+				n->value = v;
+				return 1;
+			}
+			np = &n->child[rbit(key, n->plen)];
+			continue;
+		}
+
+		/* the block sits above n, or they branch apart */
+		if (common == plen) {
+			if ((leaf = rnode_new(key, plen)) == NULL)
+				goto fail;
+			leaf->value = v;
+			leaf->child[rbit(n->key, plen)] = n;
+			*np = leaf;
+			return 1;
+		}
+		if ((b = rnode_new(key, common)) == NULL)
+			goto fail;
+		if ((leaf = rnode_new(key, plen)) == NULL) {
+			free(b);
+			goto fail;
+		}
+		leaf->value = v;
+		b->child[rbit(key, common)] = leaf;
+		b->child[rbit(n->key, common)] = n;
+		*np = b;
+		return 1;
+	}
+
+fail:
+	log_warn("warn: radix");
+	free(v);
+	return 0;
+}
+
+/*
+ * Return the value of the longest block that contains the address, or
+ * NULL if there is none.
+ */
+const char *
+radix_match(struct radix *r, const char *addr)
+{
+	struct rnode	*n;
+	const char	*best = NULL;
+	uint8_t		 key[16];
+	int		 af, plen;
+
+	if (!radix_parse(addr, key, &af, &plen))
+		return NULL;
+
+	for (n = r->root[af]; n != NULL; n = n->child[rbit(key, n->plen)]) {
+		if (n->plen > plen || rcommon(key, n->key, n->plen) < n->plen)
+			break;
+		if (n->value)
+			best = n->value;
+		if (n->plen == plen)
+			break;
+	}
+
+	return best;
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Fill the cache of the lookups with keys asked often, flood it with
+ * keys asked once, and check which ones it keeps.  Then remove entries
+ * and values from the middle of their probe sequences, and check that
+ * the others can still be found.  The cache is included to reach its
+ * tables.
+ */
+
+#include "../cache.c"
+
+#define	SVC_ALIAS	1
+
+#define	CACHE_SIZE	1024
+#define	NHOT		64
+#define	NFLOOD		(CACHE_SIZE * 2)
+
+static int	 failed;
+
+static void
+check(int ok, const char *what, int line)
+{
+	if (!ok) {
+		printf("FAIL: line %d: %s\n", line, what);
+		failed = 1;
+	}
+}
+
+#define	CHECK(ok, what)		check(ok, what, __LINE__)
+
+/* ask the key n times, and fill it in after the first miss */
+static void
+ask(struct cache *c, const char *key, int n)
+{
+	char	 buf[64];
+
+	while (n-- > 0)
+		if (cache_get(c, SVC_ALIAS, key, buf, sizeof(buf)) == -1)
+			cache_set(c, SVC_ALIAS, key, 1, "vmail", -1);
+}
+
+/* the number of keys in prefix0 .. prefixn-1 in the cache */
+static int
+count(struct cache *c, const char *prefix, int n)
+{
+	char	 key[64];
+	int	 i, r = 0;
+
+	for (i = 0; i < n; i++) {
+		(void)snprintf(key, sizeof(key), "%s%d", prefix, i);
+		if (cache_peek(c, SVC_ALIAS, key, NULL, 0) == 1)
+			r++;
+	}
+	return r;
+}
+
+static struct cache *
+flood(int admission)
+{
+	struct cache	*c;
+	char		 key[64];
+	int		 i;
+
+	if ((c = cache_new(CACHE_SIZE, 3600, 3600)) == NULL ||
+	    (admission && !cache_admission(c)))
+		exit(1);
+
+	for (i = 0; i < NHOT; i++) {
+		(void)snprintf(key, sizeof(key), "hot%d", i);
+		ask(c, key, 8);
+	}
+	for (i = 0; i < NFLOOD; i++) {
+		(void)snprintf(key, sizeof(key), "once%d", i);
+		ask(c, key, 1);
+	}
+	return c;
+}
+
+/* without admission the flood pushes out the keys asked often */
+static void
+test_lru(void)
+{
+	struct cache	*c;
+
+	c = flood(0);
+	CHECK(count(c, "hot", NHOT) == 0, "keys asked often kept");
+	CHECK(count(c, "once", NFLOOD) == CACHE_SIZE, "cache not full");
+	cache_free(c);
+}
+
+/* with it they stay, and the keys asked once only fill the free room */
+static void
+test_admission(void)
+{
+	struct cache	*c;
+
+	c = flood(1);
+	CHECK(count(c, "hot", NHOT) == NHOT, "keys asked often evicted");
+	CHECK(count(c, "once", NFLOOD) == CACHE_SIZE - NHOT,
+	    "keys asked once admitted");
+
+	/* a new key asked more often than the victim gets in */
+	ask(c, "late", 12);
+	CHECK(cache_peek(c, SVC_ALIAS, "late", NULL, 0) == 1,
+	    "key asked often refused");
+	CHECK(count(c, "hot", NHOT) == NHOT - 1, "not one victim");
+	cache_free(c);
+}
+
+/* every entry can be reached from its home bucket */
+static void
+check_buckets(struct cache *c, int line)
+{
+	uint32_t	 i, j, n = 0;
+	uint64_t	 h;
+
+	for (j = 0; j <= c->mask; j++) {
+		if (c->buckets[j].fp == 0)
+			continue;
+		n++;
+		h = c->entries[c->buckets[j].idx].hash;
+		for (i = h & c->mask; i != j; i = (i + 1) & c->mask)
+			if (c->buckets[i].fp == 0) {
+				printf("FAIL: line %d: bucket %u cut off "
+				    "at %u\n", line, j, i);
+				failed = 1;
+				return;
+			}
+	}
+	if (n != c->count) {
+		printf("FAIL: line %d: %u buckets, %u entries\n", line, n,
+		    c->count);
+		failed = 1;
+	}
+}
+
+/* every value can be reached from its home slot, and is referenced */
+static void
+check_pool(struct cache *c, int line)
+{
+	struct pool	*p = &c->pool;
+	uint32_t	 i, j, n = 0, refs = 0, used = 0;
+
+	for (j = 0; j <= p->mask; j++) {
+		if (p->slots[j] == NULL)
+			continue;
+		n++;
+		refs += p->slots[j]->refs;
+		for (i = p->slots[j]->hash & p->mask; i != j;
+		    i = (i + 1) & p->mask)
+			if (p->slots[i] == NULL) {
+				printf("FAIL: line %d: value %u cut off "
+				    "at %u\n", line, j, i);
+				failed = 1;
+				return;
+			}
+	}
+	for (i = 0; i < c->cap; i++)
+		if (c->entries[i].key && c->entries[i].value)
+			used++;
+	if (n != p->count || refs != used) {
+		printf("FAIL: line %d: %u values, %u counted, %u references, "
+		    "%u used\n", line, n, p->count, refs, used);
+		failed = 1;
+	}
+}
+
+#define	CHECK_BUCKETS(c)	check_buckets(c, __LINE__)
+#define	CHECK_POOL(c)		check_pool(c, __LINE__)
+
+/* the nth name of the form prefix%d whose slot is home, in the table */
+static void
+collide(char *name, size_t sz, const char *prefix, int service,
+    uint32_t mask, uint32_t home, int nth)
+{
+	char	 buf[64];
+	int	 i;
+
+	for (i = 0; ; i++) {
+		(void)snprintf(name, sz, "%s%d", prefix, i);
+		if (service == -1)
+			(void)strlcpy(buf, name, sizeof(buf));
+		else
+			(void)cache_key(buf, sizeof(buf), service, name);
+		if ((cache_hash(buf) & mask) == home && nth-- == 0)
+			return;
+	}
+}
+
+#define	NCLUSTER	6
+
+/*
+ * Keys that collide on the last bucket, and on the first one, so that
+ * their probes wrap around the table and run into each other.  Each
+ * one in turn is removed from the middle of the cluster.
+ */
+static void
+test_buckets(void)
+{
+	struct cache	*c;
+	char		 keys[NCLUSTER][64], buf[64];
+	uint32_t	 b, mask;
+	int		 i, j;
+
+	if ((c = cache_new(CACHE_SIZE, 3600, 3600)) == NULL)
+		exit(1);
+	mask = c->mask;
+	cache_free(c);
+
+	for (i = 0; i < NCLUSTER; i++)
+		collide(keys[i], sizeof(keys[i]), "key", SVC_ALIAS, mask,
+		    i < NCLUSTER / 2 ? mask : 0, i % (NCLUSTER / 2));
+
+	for (i = 0; i < NCLUSTER; i++) {
+		if ((c = cache_new(CACHE_SIZE, 3600, 3600)) == NULL)
+			exit(1);
+		for (j = 0; j < NCLUSTER; j++)
+			cache_set(c, SVC_ALIAS, keys[j], 1, keys[j], -1);
+		CHECK_BUCKETS(c);
+
+		(void)cache_key(buf, sizeof(buf), SVC_ALIAS, keys[i]);
+		b = cache_find(c, buf, cache_hash(buf));
+		cache_remove(c, c->buckets[b].idx);
+		CHECK_BUCKETS(c);
+
+		for (j = 0; j < NCLUSTER; j++)
+			CHECK((cache_peek(c, SVC_ALIAS, keys[j], buf,
+			    sizeof(buf)) == 1 && !strcmp(buf, keys[j])) ==
+			    (i != j), "wrong key removed");
+		cache_free(c);
+	}
+}
+
+/*
+ * The same with the interned values: each value is dropped in turn by
+ * giving its key another one, after a key that shares it is removed.
+ */
+static void
+test_pool(void)
+{
+	struct cache	*c;
+	char		 values[NCLUSTER][64], key[64], buf[64];
+	uint32_t	 mask;
+	int		 i, j;
+
+	if ((c = cache_new(CACHE_SIZE, 3600, 3600)) == NULL)
+		exit(1);
+	cache_set(c, SVC_ALIAS, "key", 1, "value", -1);
+	mask = c->pool.mask;
+	cache_free(c);
+
+	for (i = 0; i < NCLUSTER; i++)
+		collide(values[i], sizeof(values[i]), "value", -1, mask,
+		    i < NCLUSTER / 2 ? mask : 0, i % (NCLUSTER / 2));
+
+	for (i = 0; i < NCLUSTER; i++) {
+		if ((c = cache_new(CACHE_SIZE, 3600, 3600)) == NULL)
+			exit(1);
+		for (j = 0; j < NCLUSTER; j++) {
+			(void)snprintf(key, sizeof(key), "a%d", j);
+			cache_set(c, SVC_ALIAS, key, 1, values[j], -1);
+			(void)snprintf(key, sizeof(key), "b%d", j);
+			cache_set(c, SVC_ALIAS, key, 1, values[j], -1);
+		}
+		CHECK_POOL(c);
+
+		(void)snprintf(key, sizeof(key), "a%d", i);
+		cache_set(c, SVC_ALIAS, key, 0, NULL, -1);
+		CHECK_POOL(c);
+		CHECK(c->pool.count == NCLUSTER, "shared value dropped");
+
+		(void)snprintf(key, sizeof(key), "b%d", i);
+		cache_set(c, SVC_ALIAS, key, 1, "other", -1);
+		CHECK_POOL(c);
+
+		for (j = 0; j < NCLUSTER; j++) {
+			(void)snprintf(key, sizeof(key), "b%d", j);
+			CHECK(cache_peek(c, SVC_ALIAS, key, buf,
+			    sizeof(buf)) == 1 &&
+			    !strcmp(buf, i == j ? "other" : values[j]),
+			    "wrong value");
+		}
+		cache_free(c);
+	}
+}
+
+/* many keys replaced and evicted, through a small cache */
+static void
+test_churn(void)
+{
+	struct cache	*c;
+	char		 key[64], value[64];
+	int		 i;
+
+	if ((c = cache_new(CACHE_SIZE, 3600, 3600)) == NULL)
+		exit(1);
+	srandom(1);
+	for (i = 0; i < 50000; i++) {
+		(void)snprintf(key, sizeof(key), "k%ld",
+		    random() % (CACHE_SIZE * 4));
+		(void)snprintf(value, sizeof(value), "v%ld",
+		    random() % (CACHE_SIZE * 2));
+		cache_set(c, SVC_ALIAS, key, random() % 4 != 0, value, -1);
+		if (i % 1000 == 0) {
+			CHECK_BUCKETS(c);
+			CHECK_POOL(c);
+		}
+	}
+	CHECK(c->count == CACHE_SIZE, "cache not full");
+	CHECK_BUCKETS(c);
+	CHECK_POOL(c);
+	cache_free(c);
+}
+
+int
+main(void)
+{
+	log_init(1);
+
+	test_lru();
+	test_admission();
+	test_buckets();
+	test_pool();
+	test_churn();
+
+	return failed;
+}
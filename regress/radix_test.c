@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Insert network blocks in a radix tree and check that addresses match
+ * the longest block that contains them.
+ */
+
+#include "compat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "radix.h"
+
+static int	 failed;
+
+static void
+add(struct radix *r, const char *cidr, const char *value, int line)
+{
+	if (!radix_insert(r, cidr, value)) {
+		printf("FAIL: line %d: %s not inserted\n", line, cidr);
+		failed = 1;
+	}
+}
+
+static void
+expect(struct radix *r, const char *addr, const char *want, int line)
+{
+	const char	*got;
+
+	got = radix_match(r, addr);
+	if ((got == NULL) != (want == NULL) ||
+	    (got != NULL && strcmp(got, want) != 0)) {
+		printf("FAIL: line %d: %s: got \"%s\", want \"%s\"\n", line,
+		    addr, got ? got : "(none)", want ? want : "(none)");
+		failed = 1;
+	}
+}
+
+#define	ADD(r, c, v)	add(r, c, v, __LINE__)
+#define	EXPECT(r, a, w)	expect(r, a, w, __LINE__)
+
+/* nested blocks, inserted from the widest down */
+static void
+test_nested(void)
+{
+	struct radix	*r;
+
+	if ((r = radix_new()) == NULL)
+		exit(1);
+	ADD(r, "10.0.0.0/8", "a");
+	ADD(r, "10.1.0.0/16", "b");
+	ADD(r, "10.1.2.0/24", "c");
+	ADD(r, "10.1.2.3", "d");
+
+	EXPECT(r, "10.1.2.3", "d");
+	EXPECT(r, "10.1.2.4", "c");
+	EXPECT(r, "10.1.3.4", "b");
+	EXPECT(r, "10.2.0.1", "a");
+	EXPECT(r, "11.0.0.1", NULL);
+	EXPECT(r, "9.255.255.255", NULL);
+
+	/* a block inserted again takes the new value */
+	ADD(r, "10.1.0.0/16", "b2");
+	EXPECT(r, "10.1.3.4", "b2");
+	EXPECT(r, "10.1.2.4", "c");
+
+	radix_free(r);
+}
+
+/* a block inserted above the ones already in the tree */
+static void
+test_above(void)
+{
+	struct radix	*r;
+
+	if ((r = radix_new()) == NULL)
+		exit(1);
+	ADD(r, "192.168.1.0/24", "x");
+	EXPECT(r, "192.168.2.1", NULL);
+
+	ADD(r, "192.168.0.0/16", "y");
+	EXPECT(r, "192.168.1.5", "x");
+	EXPECT(r, "192.168.2.1", "y");
+	EXPECT(r, "192.169.0.1", NULL);
+
+	ADD(r, "0.0.0.0/0", "z");
+	EXPECT(r, "192.168.1.5", "x");
+	EXPECT(r, "192.168.2.1", "y");
+	EXPECT(r, "192.169.0.1", "z");
+
+	radix_free(r);
+}
+
+/* blocks that branch apart, under a branching node without a value */
+static void
+test_branch(void)
+{
+	struct radix	*r;
+
+	if ((r = radix_new()) == NULL)
+		exit(1);
+	ADD(r, "172.16.0.0/16", "p");
+	ADD(r, "172.17.0.0/16", "q");
+	ADD(r, "172.18.0.0/15", "s");
+
+	EXPECT(r, "172.16.9.9", "p");
+	EXPECT(r, "172.17.9.9", "q");
+	EXPECT(r, "172.19.9.9", "s");
+	EXPECT(r, "172.20.0.1", NULL);
+
+	radix_free(r);
+}
+
+/* the IPv6 tree, kept apart from the IPv4 one */
+static void
+test_inet6(void)
+{
+	struct radix	*r;
+
+	if ((r = radix_new()) == NULL)
+		exit(1);
+	ADD(r, "2001:db8::/32", "v6a");
+	ADD(r, "2001:db8:1::/48", "v6b");
+	ADD(r, "10.0.0.0/8", "v4");
+
+	EXPECT(r, "2001:db8:1::1", "v6b");
+	EXPECT(r, "IPv6:2001:db8:2::1", "v6a");
+	EXPECT(r, "[2001:db8:1::2]", "v6b");
+	EXPECT(r, "2001:db9::1", NULL);
+	EXPECT(r, "10.0.0.1", "v4");
+
+	/* the default route of one family is not the other's */
+	ADD(r, "::/0", "any6");
+	EXPECT(r, "2001:db9::1", "any6");
+	EXPECT(r, "192.0.2.1", NULL);
+
+	ADD(r, "2001:db8:1::/47", "v6c");
+	EXPECT(r, "2001:db8:1::1", "v6b");
+	EXPECT(r, "2001:db8:0::1", "v6c");
+	EXPECT(r, "2001:db8:2::1", "v6a");
+
+	radix_free(r);
+}
+
+int
+main(void)
+{
+	log_init(1);
+
+	test_nested();
+	test_above();
+	test_branch();
+	test_inet6();
+
+	return failed;
+}
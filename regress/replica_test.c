@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Feed hand-built pgoutput messages to a replica and check what its
+ * lookups return.  The replica is included to reach its decoder.
+ */
+
+#include "../replica.c"
+
+#define	RELID		16384
+#define	SVC_ALIAS	1
+#define	SVC_USER	2
+
+struct msg {
+	unsigned char	 b[1024];
+	size_t		 n;
+};
+
+static int	 failed;
+
+static void
+put(struct msg *m, uint64_t v, size_t n)
+{
+	while (n-- > 0)
+		m->b[m->n++] = v >> (n * 8);
+}
+
+static void
+putstr(struct msg *m, const char *s)
+{
+	size_t	 len = strlen(s) + 1;
+
+	memcpy(m->b + m->n, s, len);
+	m->n += len;
+}
+
+/* a row of text columns, NULL for a column left out */
+static void
+puttuple(struct msg *m, int ncols, const char **vals)
+{
+	int	 i;
+
+	put(m, ncols, 2);
+	for (i = 0; i < ncols; i++) {
+		if (vals[i] == NULL) {
+			put(m, 'n', 1);
+			continue;
+		}
+		put(m, 't', 1);
+		put(m, strlen(vals[i]), 4);
+		memcpy(m->b + m->n, vals[i], strlen(vals[i]));
+		m->n += strlen(vals[i]);
+	}
+}
+
+static void
+feed(struct replica *r, struct msg *m)
+{
+	struct rmsg	 rm;
+
+	rm.p = m->b;
+	rm.left = m->n;
+	rm.bad = 0;
+	if (!replica_xlog(r, &rm) || rm.bad) {
+		printf("FAIL: message not taken\n");
+		failed = 1;
+	}
+}
+
+static void
+begin(struct replica *r)
+{
+	struct msg	 m = { .n = 0 };
+
+	put(&m, 'B', 1);
+	put(&m, 0, 8 + 8 + 4);
+	feed(r, &m);
+}
+
+static void
+commit(struct replica *r)
+{
+	struct msg	 m = { .n = 0 };
+
+	put(&m, 'C', 1);
+	put(&m, 0, 1 + 8 + 8 + 8);
+	feed(r, &m);
+}
+
+/* the relation, with its columns and those in its identity */
+static void
+relation(struct replica *r, const char *rel, int ident, int natts,
+    const char **names, const int *key)
+{
+	struct msg	 m = { .n = 0 };
+	int		 i;
+
+	put(&m, 'R', 1);
+	put(&m, RELID, 4);
+	putstr(&m, "public");
+	putstr(&m, rel);
+	put(&m, ident, 1);
+	put(&m, natts, 2);
+	for (i = 0; i < natts; i++) {
+		put(&m, key[i], 1);
+		putstr(&m, names[i]);
+		put(&m, 25, 4);
+		put(&m, 0xffffffff, 4);
+	}
+	feed(r, &m);
+}
+
+static void
+insert(struct replica *r, int ncols, const char **new)
+{
+	struct msg	 m = { .n = 0 };
+
+	put(&m, 'I', 1);
+	put(&m, RELID, 4);
+	put(&m, 'N', 1);
+	puttuple(&m, ncols, new);
+	feed(r, &m);
+}
+
+/* kind is 'O' or 'K' for an old row, 'N' for none */
+static void
+update(struct replica *r, int kind, int ncols, const char **old,
+    const char **new)
+{
+	struct msg	 m = { .n = 0 };
+
+	put(&m, 'U', 1);
+	put(&m, RELID, 4);
+	if (kind != 'N') {
+		put(&m, kind, 1);
+		puttuple(&m, ncols, old);
+	}
+	put(&m, 'N', 1);
+	puttuple(&m, ncols, new);
+	feed(r, &m);
+}
+
+static void
+delete(struct replica *r, int kind, int ncols, const char **old)
+{
+	struct msg	 m = { .n = 0 };
+
+	put(&m, 'D', 1);
+	put(&m, RELID, 4);
+	put(&m, kind, 1);
+	puttuple(&m, ncols, old);
+	feed(r, &m);
+}
+
+static void
+expect(struct replica *r, int service, const char *key, int want,
+    const char *value, int line)
+{
+	char	 buf[LINE_MAX];
+	int	 got;
+
+	got = replica_get(r, service, key, buf, sizeof(buf));
+	if (got != want || (want == 1 && strcmp(buf, value) != 0)) {
+		printf("FAIL: line %d: %s: got %d \"%s\", want %d \"%s\"\n",
+		    line, key, got, got == 1 ? buf : "", want,
+		    value ? value : "");
+		failed = 1;
+	}
+}
+
+#define	EXPECT(r, s, k, w, v)	expect(r, s, k, w, v, __LINE__)
+
+static struct replica *
+aliases(void)
+{
+	struct replica	*r;
+
+	if ((r = replica_new("", "pub")) == NULL ||
+	    !replica_add(r, SVC_ALIAS, 1, "aliases alias dest"))
+		exit(1);
+	r->state = REPLICA_LIVE;
+	rvals_add(&r->svcs[0].rows, "a", "x");
+	rvals_add(&r->svcs[0].rows, "a", "y");
+	rvals_add(&r->svcs[0].rows, "a", "z");
+	rvals_add(&r->svcs[0].rows, "b", "q");
+	return r;
+}
+
+static const char	*acols[] = { "id", "alias", "dest" };
+
+/* REPLICA IDENTITY FULL: every old row is complete */
+static void
+test_full(void)
+{
+	struct replica	*r = aliases();
+	const int	 key[] = { 1, 1, 1 };
+
+	begin(r);
+	relation(r, "aliases", 'f', 3, acols, key);
+	update(r, 'O', 3, (const char *[]){ "2", "a", "y" },
+	    (const char *[]){ "2", "a", "w" });
+	/* nothing shows before the commit */
+	EXPECT(r, SVC_ALIAS, "a", 1, "x, y, z");
+	commit(r);
+	EXPECT(r, SVC_ALIAS, "a", 1, "x, z, w");
+
+	begin(r);
+	delete(r, 'O', 3, (const char *[]){ "1", "a", "x" });
+	commit(r);
+	EXPECT(r, SVC_ALIAS, "a", 1, "w, z");
+
+	/* the key changes */
+	begin(r);
+	update(r, 'O', 3, (const char *[]){ "3", "a", "z" },
+	    (const char *[]){ "3", "c", "z" });
+	insert(r, 3, (const char *[]){ "4", "c", "v" });
+	commit(r);
+	EXPECT(r, SVC_ALIAS, "a", 1, "w");
+	EXPECT(r, SVC_ALIAS, "c", 1, "z, v");
+	EXPECT(r, SVC_ALIAS, "b", 1, "q");
+
+	replica_free(r);
+}
+
+/* an identity covering the columns of the service */
+static void
+test_index(void)
+{
+	struct replica	*r = aliases();
+	const int	 key[] = { 0, 1, 1 };
+
+	begin(r);
+	relation(r, "aliases", 'i', 3, acols, key);
+	/* the identity did not change, so neither did the service */
+	update(r, 'N', 3, NULL, (const char *[]){ "9", "a", "x" });
+	commit(r);
+	EXPECT(r, SVC_ALIAS, "a", 1, "x, y, z");
+
+	begin(r);
+	update(r, 'K', 3, (const char *[]){ NULL, "a", "y" },
+	    (const char *[]){ "2", "a", "v" });
+	delete(r, 'K', 3, (const char *[]){ NULL, "a", "x" });
+	commit(r);
+	EXPECT(r, SVC_ALIAS, "a", 1, "v, z");
+	EXPECT(r, SVC_ALIAS, "b", 1, "q");
+
+	replica_free(r);
+}
+
+/* the default identity on a primary key outside of the service */
+static void
+test_refused(void)
+{
+	struct replica	*r = aliases();
+	const int	 key[] = { 1, 0, 0 };
+
+	EXPECT(r, SVC_ALIAS, "a", 1, "x, y, z");
+	begin(r);
+	relation(r, "aliases", 'd', 3, acols, key);
+	update(r, 'N', 3, NULL, (const char *[]){ "2", "a", "w" });
+	commit(r);
+	EXPECT(r, SVC_ALIAS, "a", -1, NULL);
+	EXPECT(r, SVC_ALIAS, "b", -1, NULL);
+
+	/* even if the identity becomes usable, changes were missed */
+	begin(r);
+	relation(r, "aliases", 'f', 3, acols, (const int[]){ 1, 1, 1 });
+	commit(r);
+	EXPECT(r, SVC_ALIAS, "a", -1, NULL);
+
+	replica_free(r);
+}
+
+/* the key column alone as the identity */
+static void
+test_key(void)
+{
+	struct replica	*r;
+	const char	*cols[] = { "name", "uid" };
+	const int	 key[] = { 1, 0 };
+
+	if ((r = replica_new("", "pub")) == NULL ||
+	    !replica_add(r, SVC_USER, 0, "users name uid"))
+		exit(1);
+	r->state = REPLICA_LIVE;
+	rvals_add(&r->svcs[0].rows, "u", "1");
+	rvals_add(&r->svcs[0].rows, "t", "5");
+
+	begin(r);
+	relation(r, "users", 'd', 2, cols, key);
+	update(r, 'N', 2, NULL, (const char *[]){ "u", "2" });
+	commit(r);
+	EXPECT(r, SVC_USER, "u", 1, "2");
+
+	begin(r);
+	update(r, 'K', 2, (const char *[]){ "t", NULL },
+	    (const char *[]){ "s", "6" });
+	commit(r);
+	EXPECT(r, SVC_USER, "t", 0, NULL);
+	EXPECT(r, SVC_USER, "s", 1, "6");
+
+	begin(r);
+	delete(r, 'K', 2, (const char *[]){ "u", NULL });
+	commit(r);
+	EXPECT(r, SVC_USER, "u", 0, NULL);
+
+	replica_free(r);
+}
+
+int
+main(void)
+{
+	log_init(1);
+
+	test_full();
+	test_index();
+	test_refused();
+	test_key();
+
+	return failed;
+}
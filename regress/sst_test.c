@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Write sorted string tables and read them back, then check that a
+ * damaged file is refused.  The table is included to reach its header.
+ */
+
+#include "../sst.c"
+
+#define	NKEYS		(SST_BLOCK * 6 + 5)
+
+static int	 failed;
+static char	 dir[] = "/tmp/sst_test.XXXXXXXXXX";
+static char	 path[PATH_MAX];
+
+static void
+expect(struct sst *t, const char *key, int want, const char *value,
+    int line)
+{
+	char	 buf[LINE_MAX];
+	int	 got;
+
+	got = sst_get(t, key, buf, sizeof(buf));
+	if (got != want || (want == 1 && strcmp(buf, value) != 0)) {
+		printf("FAIL: line %d: %s: got %d \"%s\", want %d \"%s\"\n",
+		    line, key, got, got == 1 ? buf : "", want,
+		    value ? value : "");
+		failed = 1;
+	}
+}
+
+#define	EXPECT(t, k, w, v)	expect(t, k, w, v, __LINE__)
+
+static void
+check(int ok, const char *what, int line)
+{
+	if (!ok) {
+		printf("FAIL: line %d: %s\n", line, what);
+		failed = 1;
+	}
+}
+
+#define	CHECK(ok, what)		check(ok, what, __LINE__)
+
+/* keys sharing long prefixes, so that entries store only their suffix */
+static void
+key(char *buf, size_t sz, int i)
+{
+	(void)snprintf(buf, sz, "user%04d@example.com", i * 2);
+}
+
+static int
+build(int n)
+{
+	struct sst_writer	*w;
+	char			 k[64], v[64];
+	int			 i;
+
+	if ((w = sst_writer_open(path)) == NULL)
+		return 0;
+	for (i = 0; i < n; i++) {
+		key(k, sizeof(k), i);
+		(void)snprintf(v, sizeof(v), "value %d", i);
+		if (!sst_writer_add(w, k, v)) {
+			sst_writer_close(w, 0);
+			return 0;
+		}
+	}
+	return sst_writer_close(w, 1);
+}
+
+/* every key comes back, on both sides of every block boundary */
+static void
+test_roundtrip(void)
+{
+	struct sst	*t;
+	char		 k[64], v[64], buf[4];
+	int		 i;
+
+	CHECK(build(NKEYS), "table not written");
+	if ((t = sst_open(path)) == NULL) {
+		CHECK(0, "table not opened");
+		return;
+	}
+
+	for (i = 0; i < NKEYS; i++) {
+		key(k, sizeof(k), i);
+		(void)snprintf(v, sizeof(v), "value %d", i);
+		EXPECT(t, k, 1, v);
+	}
+
+	/* the odd keys fall in between, the others out of range */
+	for (i = 0; i < NKEYS; i++) {
+		(void)snprintf(k, sizeof(k), "user%04d@example.com", i * 2 + 1);
+		EXPECT(t, k, 0, NULL);
+	}
+	EXPECT(t, "a", 0, NULL);
+	EXPECT(t, "user", 0, NULL);
+	EXPECT(t, "z", 0, NULL);
+
+	CHECK(sst_get(t, "user0000@example.com", NULL, 0) == 1,
+	    "check of a key");
+	CHECK(sst_get(t, "user0000@example.com", buf, sizeof(buf)) == -1,
+	    "value larger than the buffer");
+
+	sst_close(t);
+}
+
+/* an empty table, and one that is written out of order */
+static void
+test_empty(void)
+{
+	struct sst_writer	*w;
+	struct sst		*t;
+
+	CHECK(build(0), "empty table not written");
+	if ((t = sst_open(path)) == NULL) {
+		CHECK(0, "empty table not opened");
+		return;
+	}
+	EXPECT(t, "user0000@example.com", 0, NULL);
+	sst_close(t);
+
+	if ((w = sst_writer_open(path)) == NULL) {
+		CHECK(0, "writer not opened");
+		return;
+	}
+	CHECK(sst_writer_add(w, "b", "1"), "first key refused");
+	CHECK(!sst_writer_add(w, "a", "2"), "key out of order taken");
+	CHECK(!sst_writer_close(w, 1), "table out of order committed");
+
+	/* the previous table is left in place */
+	if ((t = sst_open(path)) == NULL) {
+		CHECK(0, "previous table lost");
+		return;
+	}
+	EXPECT(t, "b", 0, NULL);
+	sst_close(t);
+}
+
+/* rewrite part of the header of a good table */
+static int
+damage(off_t off, const void *p, size_t len)
+{
+	int	 fd, ok;
+
+	if (!build(NKEYS) || (fd = open(path, O_WRONLY)) == -1)
+		return 0;
+	ok = pwrite(fd, p, len, off) == (ssize_t)len;
+	close(fd);
+	return ok;
+}
+
+static void
+test_damaged(void)
+{
+	struct sst	*t;
+	struct sst_hdr	 hdr;
+	uint64_t	 v;
+	uint32_t	 version = SST_VERSION + 1;
+	int		 fd;
+
+	CHECK(damage(offsetof(struct sst_hdr, magic), "TPGSSX", 6),
+	    "magic not damaged");
+	CHECK((t = sst_open(path)) == NULL, "bad magic accepted");
+	sst_close(t);
+
+	CHECK(damage(offsetof(struct sst_hdr, version), &version,
+	    sizeof(version)), "version not damaged");
+	CHECK((t = sst_open(path)) == NULL, "bad version accepted");
+	sst_close(t);
+
+	v = 1ULL << 40;
+	CHECK(damage(offsetof(struct sst_hdr, index), &v, sizeof(v)),
+	    "index not damaged");
+	CHECK((t = sst_open(path)) == NULL, "index past the end accepted");
+	sst_close(t);
+
+	v = 9;
+	CHECK(damage(offsetof(struct sst_hdr, index), &v, sizeof(v)),
+	    "index not damaged");
+	CHECK((t = sst_open(path)) == NULL, "misaligned index accepted");
+	sst_close(t);
+
+	v = 1ULL << 40;
+	CHECK(damage(offsetof(struct sst_hdr, nblocks), &v, sizeof(v)),
+	    "block count not damaged");
+	CHECK((t = sst_open(path)) == NULL, "block count accepted");
+	sst_close(t);
+
+	/* a truncated header */
+	CHECK(build(NKEYS), "table not written");
+	if ((fd = open(path, O_WRONLY)) != -1) {
+		CHECK(ftruncate(fd, sizeof(hdr) - 1) == 0, "not truncated");
+		close(fd);
+	}
+	CHECK((t = sst_open(path)) == NULL, "truncated table accepted");
+	sst_close(t);
+
+	/* a block offset pointing back into the header fails the lookup */
+	CHECK(build(NKEYS), "table not written");
+	if ((fd = open(path, O_RDWR)) != -1) {
+		v = 1;
+		CHECK(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+		    pwrite(fd, &v, sizeof(v), hdr.index) == sizeof(v),
+		    "block offset not damaged");
+		close(fd);
+	}
+	if ((t = sst_open(path)) == NULL) {
+		CHECK(0, "table not opened");
+		return;
+	}
+	EXPECT(t, "user0000@example.com", -1, NULL);
+	sst_close(t);
+}
+
+int
+main(void)
+{
+	log_init(1);
+
+	if (mkdtemp(dir) == NULL ||
+	    snprintf(path, sizeof(path), "%s/table", dir) >=
+	    (int)sizeof(path)) {
+		printf("FAIL: no temporary directory\n");
+		return 1;
+	}
+
+	test_roundtrip();
+	test_empty();
+	test_damaged();
+
+	(void)unlink(path);
+	(void)rmdir(dir);
+
+	return failed;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Insert domain names and wildcards in a trie and check which entry
+ * names match.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/tree.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "trie.h"
+
+static int	 failed;
+
+static void
+add(struct trie *t, const char *name, const char *value, int want, int line)
+{
+	if (trie_insert(t, name, value) != want) {
+		printf("FAIL: line %d: %s %sinserted\n", line, name,
+		    want ? "not " : "");
+		failed = 1;
+	}
+}
+
+static void
+expect(struct trie *t, const char *name, const char *want, int line)
+{
+	const char	*got;
+
+	got = trie_match(t, name);
+	if ((got == NULL) != (want == NULL) ||
+	    (got != NULL && strcmp(got, want) != 0)) {
+		printf("FAIL: line %d: %s: got \"%s\", want \"%s\"\n", line,
+		    name, got ? got : "(none)", want ? want : "(none)");
+		failed = 1;
+	}
+}
+
+#define	ADD(t, n, v)	add(t, n, v, 1, __LINE__)
+#define	REFUSE(t, n)	add(t, n, "", 0, __LINE__)
+#define	EXPECT(t, n, w)	expect(t, n, w, __LINE__)
+
+/* a wildcard covers the names below the domain, not the domain */
+static void
+test_wildcard(void)
+{
+	struct trie	*t;
+
+	if ((t = trie_new()) == NULL)
+		exit(1);
+	ADD(t, "*.example.com", "wild");
+
+	EXPECT(t, "example.com", NULL);
+	EXPECT(t, "a.example.com", "wild");
+	EXPECT(t, "a.b.example.com", "wild");
+	EXPECT(t, "example.org", NULL);
+	EXPECT(t, "com", NULL);
+	EXPECT(t, "badexample.com", NULL);
+
+	trie_free(t);
+}
+
+/* an exact entry next to a wildcard on the same domain */
+static void
+test_exact(void)
+{
+	struct trie	*t;
+
+	if ((t = trie_new()) == NULL)
+		exit(1);
+	ADD(t, "*.example.com", "wild");
+	ADD(t, "example.com", "exact");
+	ADD(t, "mx.example.com", "mx");
+
+	EXPECT(t, "example.com", "exact");
+	EXPECT(t, "mx.example.com", "mx");
+	EXPECT(t, "a.mx.example.com", "wild");
+	EXPECT(t, "www.example.com", "wild");
+
+	/* the order of the inserts does not matter */
+	trie_free(t);
+	if ((t = trie_new()) == NULL)
+		exit(1);
+	ADD(t, "example.com", "exact");
+	ADD(t, "*.example.com", "wild");
+	EXPECT(t, "example.com", "exact");
+	EXPECT(t, "www.example.com", "wild");
+
+	trie_free(t);
+}
+
+/* the most specific wildcard wins */
+static void
+test_nested(void)
+{
+	struct trie	*t;
+
+	if ((t = trie_new()) == NULL)
+		exit(1);
+	ADD(t, "*.example.com", "outer");
+	ADD(t, "*.lists.example.com", "inner");
+
+	EXPECT(t, "a.lists.example.com", "inner");
+	EXPECT(t, "a.b.lists.example.com", "inner");
+	EXPECT(t, "lists.example.com", "outer");
+	EXPECT(t, "other.example.com", "outer");
+
+	/* an entry inserted again takes the new value */
+	ADD(t, "*.lists.example.com", "inner2");
+	EXPECT(t, "a.lists.example.com", "inner2");
+
+	trie_free(t);
+}
+
+/* names are matched without case and without their trailing dot */
+static void
+test_names(void)
+{
+	struct trie	*t;
+
+	if ((t = trie_new()) == NULL)
+		exit(1);
+	ADD(t, "*.Example.COM.", "wild");
+	ADD(t, "Example.com", "exact");
+
+	EXPECT(t, "EXAMPLE.com.", "exact");
+	EXPECT(t, "Mail.Example.Com", "wild");
+
+	REFUSE(t, "*");
+	REFUSE(t, "*.");
+	REFUSE(t, "a.*.example.com");
+	REFUSE(t, "");
+	EXPECT(t, "", NULL);
+
+	trie_free(t);
+}
+
+int
+main(void)
+{
+	log_init(1);
+
+	test_wildcard();
+	test_exact();
+	test_nested();
+	test_names();
+
+	return failed;
+}
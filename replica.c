@@ -0,0 +1,1254 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libpq-fe.h>
+
+#include "copy.h"
+#include "dict.h"
+#include "log.h"
+#include "replica.h"
+#include "table_stdio.h"
+
+/*
+ * A replica keeps a copy of the tables behind some services in memory.
+ * It is loaded from the snapshot of a temporary logical replication
+ * slot, then kept current by applying what the slot streams from the
+ * publication, decoded by pgoutput.  All of it runs in between
+ * requests, from the first connection on.
+ *
+ * The changes of a transaction are held until its commit, then applied
+ * at once, so that lookups never see half of it.
+ *
+ * A change can only be applied if the old row tells which value it
+ * replaces: the replica identity of the relation has to be FULL, cover
+ * all the columns of the service, or be the key column alone.  A
+ * service whose relation has another identity is left to the database.
+ */
+
+#define	PG_EPOCH	946684800LL	/* 2000-01-01 in unix time */
+#define	FEEDBACK	10		/* seconds between status updates */
+#define	CONNECT_TIMEOUT	"5"		/* seconds, unless the conninfo says */
+#define	REPLICA_STALL	60		/* seconds the server may stay silent */
+
+enum replica_state {
+	REPLICA_IDLE,
+	REPLICA_CONNECT,
+	REPLICA_BEGIN,
+	REPLICA_SLOT,
+	REPLICA_LOAD,		/* the COPY of one service after the other */
+	REPLICA_COMMIT,
+	REPLICA_START,
+	REPLICA_LIVE,
+};
+
+static unsigned int	 nslots;
+
+struct rvals {
+	size_t		  n;
+	char		**v;
+};
+
+/* what the old rows tell about the service, from its replica identity */
+enum {
+	IDENT_UNKNOWN,		/* no change seen yet */
+	IDENT_NONE,		/* not enough, the service is not replicated */
+	IDENT_KEY,		/* the key column, which is unique */
+	IDENT_ROW		/* all the columns of the service */
+};
+
+struct rsvc {
+	int		  service;
+	int		  multi;
+	int		  ident;
+	char		 *nspname;	/* NULL matches any schema */
+	char		 *relname;
+	char		 *relation;
+	char		**cols;		/* the key, then the values */
+	int		  ncols;
+	int		 *attnum;	/* position of the columns in the rows */
+	uint32_t	  relid;
+	struct dict	  rows;		/* key -> struct rvals */
+};
+
+struct replica {
+	struct replica	 *next;		/* in the list of the starting ones */
+	char		 *conninfo;
+	char		 *publication;
+	char		  slot[64];
+	PGconn		 *db;
+	int		  fd;
+	int		  state;
+	size_t		  load;		/* the service being loaded */
+	int		  copying;	/* its rows are streaming */
+	time_t		  deadline;	/* 0 if there is none */
+	void		(*stop)(void *);
+	void		 *arg;
+	uint64_t	  lsn;		/* end of the last transaction applied */
+	time_t		  feedback;
+	unsigned char	 *txn;		/* the messages of the transaction */
+	size_t		  txnlen;
+	size_t		  txnsize;
+	struct rsvc	 *svcs;
+	size_t		  nsvcs;
+};
+
+static struct replica	*replicas;
+static int		 expiring;
+
+/* a pgoutput message being decoded */
+struct rmsg {
+	const unsigned char	*p;
+	size_t			 left;
+	int			 bad;
+};
+
+/* the columns of a row as sent by pgoutput */
+struct rtuple {
+	int		  ncols;
+	char		 *kind;		/* 'n'ull, 'u'nchanged or 't'ext */
+	char		**val;
+};
+
+static void
+rvals_free(struct dict *rows)
+{
+	struct rvals	*rv;
+	size_t		 i;
+
+	while (dict_poproot(rows, (void **)&rv)) {
+		for (i = 0; i < rv->n; i++)
+			free(rv->v[i]);
+		free(rv->v);
+		free(rv);
+	}
+}
+
+static int
+rvals_add(struct dict *rows, const char *key, const char *value)
+{
+	struct rvals	*rv;
+	char		**v, *s;
+
+	if ((rv = dict_get(rows, key)) == NULL) {
+		if ((rv = calloc(1, sizeof(*rv))) == NULL)
+			return 0;
+		dict_set(rows, key, rv);
+	}
+	if ((s = strdup(value)) == NULL)
+		return 0;
+	if ((v = reallocarray(rv->v, rv->n + 1, sizeof(*v))) == NULL) {
+		free(s);
+		return 0;
+	}
+	rv->v = v;
+	rv->v[rv->n++] = s;
+	return 1;
+}
+
+/*
+ * Remove a value of the key, or all of them if value is NULL.
+ */
+static void
+rvals_del(struct dict *rows, const char *key, const char *value)
+{
+	struct rvals	*rv;
+	size_t		 i;
+
+	if ((rv = dict_get(rows, key)) == NULL)
+		return;
+
+	for (i = 0; i < rv->n; ) {
+		if (value && strcmp(rv->v[i], value) != 0) {
+			i++;
+			continue;
+		}
+		free(rv->v[i]);
+		rv->v[i] = rv->v[--rv->n];
+		if (value)
+			break;
+	}
+
+	if (rv->n == 0) {
+		dict_pop(rows, key);
+		free(rv->v);
+		free(rv);
+	}
+}
+
+struct replica *
+replica_new(const char *conninfo, const char *publication)
+{
+	struct replica	*r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL ||
+	    (r->conninfo = strdup(conninfo)) == NULL ||
+	    (r->publication = strdup(publication)) == NULL) {
+		log_warn("warn: calloc");
+		replica_free(r);
+		return NULL;
+	}
+	r->fd = -1;
+
+	return r;
+}
+
+static void
+replica_unlink(struct replica *r)
+{
+	struct replica	**p;
+
+	for (p = &replicas; *p != NULL; p = &(*p)->next)
+		if (*p == r) {
+			*p = r->next;
+			break;
+		}
+}
+
+static void
+replica_reset(struct replica *r)
+{
+	size_t	 i;
+
+	replica_unlink(r);
+	if (r->fd != -1) {
+		table_api_watch(r->fd, NULL, NULL);
+		r->fd = -1;
+	}
+	if (r->db) {
+		PQfinish(r->db);
+		r->db = NULL;
+	}
+	r->state = REPLICA_IDLE;
+	r->copying = 0;
+	r->txnlen = 0;
+	for (i = 0; i < r->nsvcs; i++) {
+		rvals_free(&r->svcs[i].rows);
+		r->svcs[i].relid = 0;
+		r->svcs[i].ident = IDENT_UNKNOWN;
+	}
+}
+
+void
+replica_free(struct replica *r)
+{
+	struct rsvc	*s;
+	size_t		 i;
+	int		 j;
+
+	if (r == NULL)
+		return;
+
+	replica_reset(r);
+	for (i = 0; i < r->nsvcs; i++) {
+		s = &r->svcs[i];
+		for (j = 0; j < s->ncols; j++)
+			free(s->cols[j]);
+		free(s->cols);
+		free(s->attnum);
+		free(s->nspname);
+		free(s->relname);
+		free(s->relation);
+	}
+	free(r->svcs);
+	free(r->txn);
+	free(r->conninfo);
+	free(r->publication);
+	free(r);
+}
+
+/*
+ * Replicate the service from the relation, as described by the spec:
+ * the relation, its key column, then the columns of the value.
+ */
+int
+replica_add(struct replica *r, int service, int multi, const char *spec)
+{
+	struct rsvc	*s;
+	char		*buf, *p, *w, **cols;
+	int		 n;
+
+	if ((buf = strdup(spec)) == NULL) {
+		log_warn("warn: strdup");
+		return 0;
+	}
+
+	s = reallocarray(r->svcs, r->nsvcs + 1, sizeof(*s));
+	if (s == NULL) {
+		log_warn("warn: reallocarray");
+		free(buf);
+		return 0;
+	}
+	r->svcs = s;
+	s = &r->svcs[r->nsvcs];
+	memset(s, 0, sizeof(*s));
+	s->service = service;
+	s->multi = multi;
+	dict_init(&s->rows);
+
+	p = buf;
+	n = 0;
+	while ((w = strsep(&p, " \t")) != NULL) {
+		if (*w == '\0')
+			continue;
+		if (s->relation == NULL) {
+			if ((s->relation = strdup(w)) == NULL)
+				goto fail;
+			continue;
+		}
+		cols = reallocarray(s->cols, n + 1, sizeof(*cols));
+		if (cols == NULL)
+			goto fail;
+		s->cols = cols;
+		if ((s->cols[n] = strdup(w)) == NULL)
+			goto fail;
+		s->ncols = ++n;
+	}
+	if (s->relation == NULL || s->ncols == 0) {
+		log_warnx("warn: replica needs a relation and a key column");
+		goto fail;
+	}
+
+	if ((w = strchr(s->relation, '.')) != NULL) {
+		s->nspname = strndup(s->relation, w - s->relation);
+		s->relname = strdup(w + 1);
+	} else
+		s->relname = strdup(s->relation);
+	s->attnum = calloc(s->ncols, sizeof(*s->attnum));
+	if ((w && s->nspname == NULL) || s->relname == NULL ||
+	    s->attnum == NULL)
+		goto fail;
+
+	free(buf);
+	r->nsvcs++;
+	return 1;
+
+fail:
+	for (n = 0; n < s->ncols; n++)
+		free(s->cols[n]);
+	free(s->cols);
+	free(s->attnum);
+	free(s->nspname);
+	free(s->relname);
+	free(s->relation);
+	free(buf);
+	return 0;
+}
+
+/*
+ * Build the value of a row from its columns, the way a lookup returns
+ * it.
+ */
+static int
+replica_value(struct rsvc *s, char **fields, char *dst, size_t sz)
+{
+	int	 i;
+
+	dst[0] = '\0';
+	for (i = 1; i < s->ncols; i++) {
+		if (i > 1 && strlcat(dst, ":", sz) >= sz)
+			return 0;
+		if (strlcat(dst, fields[i], sz) >= sz)
+			return 0;
+	}
+	return 1;
+}
+
+static int
+replica_load_row(char **fields, int nfields, void *arg)
+{
+	struct rsvc	*s = arg;
+	char		 buf[LINE_MAX];
+
+	if (nfields != s->ncols)
+		return 0;
+	if (!replica_value(s, fields, buf, sizeof(buf))) {
+		log_warnx("warn: replica value too large for %s", fields[0]);
+		return 1;
+	}
+	return rvals_add(&s->rows, fields[0], buf);
+}
+
+static time_t
+replica_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * The connect_timeout of the connection, which libpq only enforces when
+ * it connects by itself.
+ */
+static int
+replica_timeout(PGconn *db)
+{
+	PQconninfoOption	*opts, *o;
+	int			 t = 0;
+
+	if ((opts = PQconninfo(db)) == NULL)
+		return atoi(CONNECT_TIMEOUT);
+	for (o = opts; o->keyword != NULL; o++)
+		if (strcmp(o->keyword, "connect_timeout") == 0 && o->val)
+			t = atoi(o->val);
+	PQconninfoFree(opts);
+	return t;
+}
+
+/*
+ * Give up on the replica, and let the owner know it has to be started
+ * again.
+ */
+static void
+replica_stop(struct replica *r)
+{
+	replica_reset(r);
+	if (r->stop)
+		r->stop(r->arg);
+}
+
+static void	replica_read(int, void *);
+
+static void
+replica_watch(struct replica *r, int events)
+{
+	int	 fd;
+
+	/* libpq may open another socket while it tries the hosts */
+	if ((fd = PQsocket(r->db)) != r->fd) {
+		if (r->fd != -1)
+			table_api_watch(r->fd, NULL, NULL);
+		r->fd = fd;
+		table_api_watch(fd, replica_read, r);
+	}
+	table_api_watch_events(fd, events);
+}
+
+/*
+ * Fail the replicas that could not connect in time, or whose server
+ * went silent before they were streaming.
+ */
+static void
+replica_expire(void *arg)
+{
+	struct replica	*r;
+	time_t		 now;
+
+	(void)arg;
+
+	expiring = 0;
+	now = replica_now();
+again:
+	for (r = replicas; r != NULL; r = r->next) {
+		if (r->deadline == 0 || r->deadline > now)
+			continue;
+		if (r->state == REPLICA_CONNECT)
+			log_warnx("warn: replica: connection timed out");
+		else
+			log_warnx("warn: replica: no data for %d seconds",
+			    REPLICA_STALL);
+		replica_stop(r);
+		goto again;
+	}
+
+	if (replicas && !expiring) {
+		expiring = 1;
+		table_api_add_timer(1000, replica_expire, NULL);
+	}
+}
+
+static int
+replica_send(struct replica *r, int state, const char *cmd)
+{
+	if (!PQsendQuery(r->db, cmd))
+		return 0;
+	r->state = state;
+	replica_watch(r, POLLIN | POLLOUT);
+	return 1;
+}
+
+/*
+ * Copy the rows of the next service from the snapshot, or commit once
+ * they are all loaded.
+ */
+static int
+replica_load(struct replica *r)
+{
+	struct rsvc	*s;
+	char		 q[1024];
+	size_t		 len;
+	int		 j;
+
+	if (r->load == r->nsvcs)
+		return replica_send(r, REPLICA_COMMIT, "COMMIT");
+
+	s = &r->svcs[r->load];
+	(void)strlcpy(q, "COPY (SELECT ", sizeof(q));
+	for (j = 0; j < s->ncols; j++) {
+		if (j > 0)
+			(void)strlcat(q, ", ", sizeof(q));
+		(void)strlcat(q, s->cols[j], sizeof(q));
+	}
+	(void)strlcat(q, " FROM ", sizeof(q));
+	(void)strlcat(q, s->relation, sizeof(q));
+	len = strlcat(q, ") TO STDOUT", sizeof(q));
+	if (len >= sizeof(q)) {
+		log_warnx("warn: replica: query too long for %s", s->relation);
+		return 0;
+	}
+	return replica_send(r, REPLICA_LOAD, q);
+}
+
+/*
+ * Check a result of the command in progress.
+ */
+static int
+replica_result(struct replica *r, PGresult *res)
+{
+	unsigned int	 hi, lo;
+
+	switch (r->state) {
+	case REPLICA_SLOT:
+		if (PQresultStatus(res) != PGRES_TUPLES_OK ||
+		    PQntuples(res) != 1 ||
+		    sscanf(PQgetvalue(res, 0, 1), "%X/%X", &hi, &lo) != 2)
+			return 0;
+		r->lsn = (uint64_t)hi << 32 | lo;
+		return 1;
+	case REPLICA_LOAD:
+		if (PQresultStatus(res) == PGRES_COPY_OUT) {
+			r->copying = 1;
+			return 1;
+		}
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			return 0;
+		log_debug("debug: replica: loaded %zu keys of %s",
+		    dict_count(&r->svcs[r->load].rows),
+		    r->svcs[r->load].relation);
+		return 1;
+	case REPLICA_START:
+		if (PQresultStatus(res) != PGRES_COPY_BOTH)
+			return 0;
+		replica_unlink(r);
+		r->deadline = 0;
+		r->feedback = time(NULL);
+		r->state = REPLICA_LIVE;
+		log_debug("debug: replica: streaming from %s", r->slot);
+		return 1;
+	default:
+		return PQresultStatus(res) == PGRES_COMMAND_OK;
+	}
+}
+
+/*
+ * Send the command that follows the one just over.
+ */
+static int
+replica_next(struct replica *r)
+{
+	char		 q[1024], *pub;
+
+	switch (r->state) {
+	case REPLICA_BEGIN:
+		(void)snprintf(q, sizeof(q),
+		    "CREATE_REPLICATION_SLOT \"%s\" TEMPORARY LOGICAL pgoutput "
+		    "USE_SNAPSHOT", r->slot);
+		return replica_send(r, REPLICA_SLOT, q);
+	case REPLICA_SLOT:
+		r->load = 0;
+		return replica_load(r);
+	case REPLICA_LOAD:
+		r->load++;
+		return replica_load(r);
+	case REPLICA_COMMIT:
+		if ((pub = PQescapeLiteral(r->db, r->publication,
+		    strlen(r->publication))) == NULL)
+			return 0;
+		(void)snprintf(q, sizeof(q),
+		    "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X "
+		    "(proto_version '1', publication_names %s)",
+		    r->slot, (unsigned int)(r->lsn >> 32),
+		    (unsigned int)r->lsn, pub);
+		PQfreemem(pub);
+		return replica_send(r, REPLICA_START, q);
+	default:
+		return 0;
+	}
+}
+
+static int	replica_poll(struct replica *);
+
+static void
+replica_read(int fd, void *arg)
+{
+	struct replica	*r = arg;
+	PGresult	*res;
+	char		*buf, *fields[COPY_MAXFIELDS];
+	int		 n, ok;
+
+	(void)fd;
+
+	if (r->state == REPLICA_CONNECT) {
+		switch (PQconnectPoll(r->db)) {
+		case PGRES_POLLING_READING:
+			replica_watch(r, POLLIN);
+			return;
+		case PGRES_POLLING_WRITING:
+			replica_watch(r, POLLOUT);
+			return;
+		case PGRES_POLLING_OK:
+			break;
+		default:
+			goto fail;
+		}
+		r->deadline = replica_now() + REPLICA_STALL;
+
+		/* the slot exports the snapshot the tables are read from */
+		if (PQsetnonblocking(r->db, 1) == -1 ||
+		    !replica_send(r, REPLICA_BEGIN,
+		    "BEGIN READ ONLY ISOLATION LEVEL REPEATABLE READ"))
+			goto fail;
+		return;
+	}
+
+	if ((n = PQflush(r->db)) == -1)
+		goto fail;
+	replica_watch(r, n ? POLLIN | POLLOUT : POLLIN);
+
+	if (r->state == REPLICA_LIVE) {
+		if (!replica_poll(r))
+			replica_stop(r);
+		return;
+	}
+
+	if (!PQconsumeInput(r->db))
+		goto fail;
+	r->deadline = replica_now() + REPLICA_STALL;
+
+	for (;;) {
+		if (r->copying) {
+			while ((n = PQgetCopyData(r->db, &buf, 1)) > 0) {
+				ok = (n = copy_fields(buf, n, fields,
+				    COPY_MAXFIELDS)) != -1 &&
+				    replica_load_row(fields, n,
+				    &r->svcs[r->load]);
+				PQfreemem(buf);
+				if (!ok)
+					goto fail;
+			}
+			if (n == 0)
+				return;
+			if (n == -2)
+				goto fail;
+			r->copying = 0;
+		}
+
+		if (PQisBusy(r->db))
+			return;
+		if ((res = PQgetResult(r->db)) == NULL) {
+			if (!replica_next(r))
+				goto fail;
+			continue;
+		}
+		ok = replica_result(r, res);
+		PQclear(res);
+		if (!ok)
+			goto fail;
+		if (r->state == REPLICA_LIVE) {
+			if (!replica_poll(r))
+				replica_stop(r);
+			return;
+		}
+	}
+
+fail:
+	log_warnx("warn: replica: %s", PQerrorMessage(r->db));
+	replica_stop(r);
+}
+
+/*
+ * Start connecting, then create the slot and load the tables from its
+ * snapshot, then stream the changes made since, all in the background.
+ * The stop callback is called whenever the replica stops, for it to be
+ * started again.  Return 0 if it could not even start.
+ */
+int
+replica_start(struct replica *r, void (*stop)(void *), void *arg)
+{
+	const char	*keys[] = {
+		"connect_timeout", "dbname", "replication", NULL
+	};
+	const char	*values[] = {
+		CONNECT_TIMEOUT, r->conninfo, "database", NULL
+	};
+	int		 t;
+
+	replica_reset(r);
+	r->stop = stop;
+	r->arg = arg;
+
+	/*
+	 * Temporary slots only have to be unique on the server, and the
+	 * previous one may not be dropped yet.
+	 */
+	(void)snprintf(r->slot, sizeof(r->slot), "table_postgres_%ld_%lld_%u",
+	    (long)getpid(), (long long)time(NULL), nslots++);
+
+	r->db = PQconnectStartParams(keys, values, 1);
+	if (r->db == NULL || PQstatus(r->db) == CONNECTION_BAD) {
+		log_warnx("warn: replica: %s",
+		    r->db ? PQerrorMessage(r->db) : "out of memory");
+		replica_reset(r);
+		return 0;
+	}
+
+	r->state = REPLICA_CONNECT;
+	t = replica_timeout(r->db);
+	r->deadline = t > 0 ? replica_now() + t : 0;
+	r->next = replicas;
+	replicas = r;
+	replica_watch(r, POLLOUT);
+	if (!expiring) {
+		expiring = 1;
+		table_api_add_timer(1000, replica_expire, NULL);
+	}
+
+	return 1;
+}
+
+/*
+ * Return whether the replica is starting or streaming.
+ */
+int
+replica_active(struct replica *r)
+{
+	return r->state != REPLICA_IDLE;
+}
+
+static uint64_t
+rmsg_get(struct rmsg *m, size_t n)
+{
+	uint64_t	 v = 0;
+
+	if (m->left < n) {
+		m->bad = 1;
+		m->left = 0;
+		return 0;
+	}
+	while (n-- > 0) {
+		v = v << 8 | *m->p++;
+		m->left--;
+	}
+	return v;
+}
+
+static const char *
+rmsg_str(struct rmsg *m)
+{
+	const char	*s = (const char *)m->p;
+	size_t		 len;
+
+	len = strnlen(s, m->left);
+	if (len == m->left) {
+		m->bad = 1;
+		m->left = 0;
+		return "";
+	}
+	m->p += len + 1;
+	m->left -= len + 1;
+	return s;
+}
+
+static void
+rtuple_free(struct rtuple *t)
+{
+	int	 i;
+
+	for (i = 0; i < t->ncols; i++)
+		free(t->val[i]);
+	free(t->val);
+	free(t->kind);
+	memset(t, 0, sizeof(*t));
+}
+
+static int
+rtuple_read(struct rmsg *m, struct rtuple *t)
+{
+	size_t	 len;
+	int	 i;
+
+	memset(t, 0, sizeof(*t));
+	t->ncols = rmsg_get(m, 2);
+	if (m->bad)
+		return 0;
+	t->kind = calloc(t->ncols, 1);
+	t->val = calloc(t->ncols, sizeof(*t->val));
+	if ((t->kind == NULL || t->val == NULL) && t->ncols > 0) {
+		log_warn("warn: calloc");
+		rtuple_free(t);
+		return 0;
+	}
+
+	for (i = 0; i < t->ncols; i++) {
+		t->kind[i] = rmsg_get(m, 1);
+		if (t->kind[i] != 't')
+			continue;
+		len = rmsg_get(m, 4);
+		if (m->bad || len > m->left) {
+			m->bad = 1;
+			break;
+		}
+		if ((t->val[i] = strndup((const char *)m->p, len)) == NULL) {
+			log_warn("warn: strndup");
+			m->bad = 1;
+			break;
+		}
+		m->p += len;
+		m->left -= len;
+	}
+	if (m->bad) {
+		rtuple_free(t);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Pick the columns of the service out of the row.  The columns pgoutput
+ * left out as unchanged are taken from the old row, if there is one.
+ */
+static int
+rtuple_fields(struct rsvc *s, struct rtuple *t, struct rtuple *old,
+    char **fields)
+{
+	int	 i, a;
+
+	for (i = 0; i < s->ncols; i++) {
+		a = s->attnum[i];
+		if (a < 0 || a >= t->ncols)
+			return 0;
+		if (t->kind[a] == 'n')
+			fields[i] = "";
+		else if (t->kind[a] == 't')
+			fields[i] = t->val[a];
+		else if (old && a < old->ncols && old->kind[a] == 't')
+			fields[i] = old->val[a];
+		else
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Locate the columns of the services replicated from the relation, and
+ * tell from its replica identity whether their changes can be applied.
+ */
+static void
+replica_relation(struct replica *r, struct rmsg *m)
+{
+	struct rsvc	*s;
+	const char	*nsp, *rel, **names;
+	unsigned char	*flags;
+	uint32_t	 relid;
+	size_t		 i, natts, nident;
+	int		 a, j, ident, all;
+
+	relid = rmsg_get(m, 4);
+	nsp = rmsg_str(m);
+	rel = rmsg_str(m);
+	ident = rmsg_get(m, 1);
+	natts = rmsg_get(m, 2);
+	if (m->bad)
+		return;
+
+	names = calloc(natts, sizeof(*names));
+	flags = calloc(natts, 1);
+	if ((names == NULL || flags == NULL) && natts > 0) {
+		log_warn("warn: calloc");
+		m->bad = 1;
+		goto done;
+	}
+
+	/* the flags tell the columns that are part of the identity */
+	nident = 0;
+	for (a = 0; a < (int)natts && !m->bad; a++) {
+		flags[a] = rmsg_get(m, 1) & 1;
+		names[a] = rmsg_str(m);
+		(void)rmsg_get(m, 8);
+		nident += flags[a];
+	}
+	if (m->bad)
+		goto done;
+
+	for (i = 0; i < r->nsvcs; i++) {
+		s = &r->svcs[i];
+		if (strcmp(s->relname, rel) != 0 ||
+		    (s->nspname && strcmp(s->nspname, nsp) != 0))
+			continue;
+		s->relid = relid;
+
+		all = 1;
+		for (j = 0; j < s->ncols; j++) {
+			s->attnum[j] = -1;
+			for (a = 0; a < (int)natts; a++)
+				if (strcmp(s->cols[j], names[a]) == 0)
+					s->attnum[j] = a;
+			if (s->attnum[j] == -1) {
+				log_warnx("warn: replica: no column %s in %s",
+				    s->cols[j], s->relation);
+				all = -1;
+				break;
+			}
+			if (!flags[s->attnum[j]])
+				all = 0;
+		}
+
+		/* a service that missed changes stays with the database */
+		if (s->ident == IDENT_NONE)
+			continue;
+		if (all == -1)
+			s->ident = IDENT_NONE;
+		else if (ident == 'f' || all)
+			s->ident = IDENT_ROW;
+		else if (nident == 1 && flags[s->attnum[0]])
+			s->ident = IDENT_KEY;
+		else {
+			log_warnx("warn: replica: %s needs REPLICA IDENTITY "
+			    "FULL, not replicated", s->relation);
+			s->ident = IDENT_NONE;
+		}
+		if (s->ident == IDENT_NONE)
+			rvals_free(&s->rows);
+	}
+
+done:
+	free(names);
+	free(flags);
+}
+
+/*
+ * Apply a change to the services replicated from the relation.  The
+ * old row, when there is one, tells the value to remove: the exact one
+ * if the identity covers the columns of the service, otherwise the one
+ * of its unique key.  An update without an old row did not change the
+ * identity.
+ */
+static void
+replica_change(struct replica *r, uint32_t relid, struct rtuple *old,
+    struct rtuple *new, int update)
+{
+	struct rsvc	*s;
+	char		*fields[COPY_MAXFIELDS], buf[LINE_MAX];
+	size_t		 i;
+
+	for (i = 0; i < r->nsvcs; i++) {
+		s = &r->svcs[i];
+		if (s->relid != relid || s->ident == IDENT_NONE)
+			continue;
+		if (s->ident == IDENT_UNKNOWN || s->ncols > COPY_MAXFIELDS)
+			goto lossy;
+
+		if (old) {
+			if (!rtuple_fields(s, old, NULL, fields) ||
+			    old->kind[s->attnum[0]] != 't')
+				goto lossy;
+			if (s->ident == IDENT_KEY)
+				rvals_del(&s->rows, fields[0], NULL);
+			else if (replica_value(s, fields, buf, sizeof(buf)))
+				rvals_del(&s->rows, fields[0], buf);
+			else
+				goto lossy;
+		} else if (update) {
+			/* the columns of the service are all unchanged */
+			if (s->ident == IDENT_ROW)
+				continue;
+			if (!rtuple_fields(s, new, NULL, fields))
+				goto lossy;
+			rvals_del(&s->rows, fields[0], NULL);
+		}
+
+		if (new == NULL)
+			continue;
+		if (!rtuple_fields(s, new, old, fields) ||
+		    !replica_value(s, fields, buf, sizeof(buf)))
+			goto lossy;
+		if (!rvals_add(&s->rows, fields[0], buf)) {
+			log_warn("warn: replica");
+			goto lossy;
+		}
+		continue;
+
+lossy:
+		log_warnx("warn: replica: cannot apply a change to %s, "
+		    "not replicated", s->relation);
+		s->ident = IDENT_NONE;
+		rvals_free(&s->rows);
+	}
+}
+
+static void
+replica_apply(struct replica *r, struct rmsg *m)
+{
+	struct rtuple	 old, new;
+	uint32_t	 relid, n;
+	size_t		 i;
+	int		 type, kind;
+
+	type = rmsg_get(m, 1);
+	switch (type) {
+	case 'R':
+		replica_relation(r, m);
+		break;
+	case 'C':
+		(void)rmsg_get(m, 1);
+		(void)rmsg_get(m, 8);
+		r->lsn = rmsg_get(m, 8);
+		break;
+	case 'I':
+		relid = rmsg_get(m, 4);
+		if (rmsg_get(m, 1) != 'N' || !rtuple_read(m, &new))
+			break;
+		replica_change(r, relid, NULL, &new, 0);
+		rtuple_free(&new);
+		break;
+	case 'U':
+		relid = rmsg_get(m, 4);
+		kind = rmsg_get(m, 1);
+		if (kind == 'K' || kind == 'O') {
+			if (!rtuple_read(m, &old))
+				break;
+			if (rmsg_get(m, 1) != 'N' || !rtuple_read(m, &new)) {
+				rtuple_free(&old);
+				break;
+			}
+			replica_change(r, relid, &old, &new, 1);
+			rtuple_free(&old);
+		} else if (kind == 'N') {
+			if (!rtuple_read(m, &new))
+				break;
+			replica_change(r, relid, NULL, &new, 1);
+		} else
+			break;
+		rtuple_free(&new);
+		break;
+	case 'D':
+		relid = rmsg_get(m, 4);
+		kind = rmsg_get(m, 1);
+		if ((kind != 'K' && kind != 'O') || !rtuple_read(m, &old))
+			break;
+		replica_change(r, relid, &old, NULL, 0);
+		rtuple_free(&old);
+		break;
+	case 'T':
+		n = rmsg_get(m, 4);
+		(void)rmsg_get(m, 1);
+		while (n-- > 0 && !m->bad) {
+			relid = rmsg_get(m, 4);
+			for (i = 0; i < r->nsvcs; i++)
+				if (r->svcs[i].relid == relid)
+					rvals_free(&r->svcs[i].rows);
+		}
+		break;
+	default:
+		/* origin, type: nothing to do */
+		break;
+	}
+}
+
+/*
+ * Take a message of the stream.  The messages of a transaction are
+ * kept until its commit, then applied in order.  Return 0 if the
+ * transaction cannot be kept.
+ */
+static int
+replica_xlog(struct replica *r, struct rmsg *m)
+{
+	struct rmsg	 t;
+	unsigned char	*p;
+	size_t		 len, off, size;
+
+	if (m->left == 0)
+		return 1;
+
+	switch (*m->p) {
+	case 'B':
+		r->txnlen = 0;
+		break;
+	case 'C':
+		for (off = 0; off < r->txnlen; off += len) {
+			memcpy(&len, r->txn + off, sizeof(len));
+			off += sizeof(len);
+			t.p = r->txn + off;
+			t.left = len;
+			t.bad = 0;
+			replica_apply(r, &t);
+			if (t.bad)
+				log_warnx("warn: replica: truncated message");
+		}
+		r->txnlen = 0;
+		replica_apply(r, m);
+		break;
+	default:
+		len = m->left;
+		if (r->txnsize - r->txnlen < sizeof(len) + len) {
+			size = r->txnsize ? r->txnsize : BUFSIZ;
+			while (size - r->txnlen < sizeof(len) + len)
+				size *= 2;
+			if ((p = realloc(r->txn, size)) == NULL) {
+				log_warn("warn: realloc");
+				return 0;
+			}
+			r->txn = p;
+			r->txnsize = size;
+		}
+		memcpy(r->txn + r->txnlen, &len, sizeof(len));
+		memcpy(r->txn + r->txnlen + sizeof(len), m->p, len);
+		r->txnlen += sizeof(len) + len;
+		m->left = 0;
+		break;
+	}
+	return 1;
+}
+
+static int
+replica_feedback(struct replica *r)
+{
+	unsigned char	 buf[34];
+	uint64_t	 v[4];
+	struct timeval	 tv;
+	int		 i, j;
+
+	gettimeofday(&tv, NULL);
+	v[0] = v[1] = v[2] = r->lsn;
+	v[3] = ((uint64_t)tv.tv_sec - PG_EPOCH) * 1000000 + tv.tv_usec;
+
+	buf[0] = 'r';
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 8; j++)
+			buf[1 + i * 8 + j] = v[i] >> (56 - j * 8);
+	buf[33] = 0;
+
+	r->feedback = time(NULL);
+	return PQputCopyData(r->db, (char *)buf, sizeof(buf)) == 1 &&
+	    PQflush(r->db) != -1;
+}
+
+/*
+ * Apply what the server streamed so far.  Return 0 if the stream is
+ * lost.
+ */
+static int
+replica_poll(struct replica *r)
+{
+	struct rmsg	 m;
+	char		*buf;
+	int		 n, reply;
+
+	if (!PQconsumeInput(r->db))
+		goto lost;
+
+	while ((n = PQgetCopyData(r->db, &buf, 1)) > 0) {
+		m.p = (unsigned char *)buf;
+		m.left = n;
+		m.bad = 0;
+		switch (rmsg_get(&m, 1)) {
+		case 'w':
+			/* start, end and time of the WAL data */
+			(void)rmsg_get(&m, 24);
+			if (!replica_xlog(r, &m)) {
+				PQfreemem(buf);
+				goto lost;
+			}
+			break;
+		case 'k':
+			(void)rmsg_get(&m, 16);
+			reply = rmsg_get(&m, 1);
+			if (reply && !replica_feedback(r)) {
+				PQfreemem(buf);
+				goto lost;
+			}
+			break;
+		}
+		if (m.bad)
+			log_warnx("warn: replica: truncated message");
+		PQfreemem(buf);
+	}
+	if (n != 0)
+		goto lost;
+
+	if (time(NULL) - r->feedback >= FEEDBACK && !replica_feedback(r))
+		goto lost;
+
+	return 1;
+
+lost:
+	log_warnx("warn: replica: lost the stream: %s", PQerrorMessage(r->db));
+	return 0;
+}
+
+/*
+ * Look the key up.  Return -1 if the service is not replicated or the
+ * replica is not current, so that the database answers instead.
+ */
+int
+replica_get(struct replica *r, int service, const char *key, char *dst,
+    size_t sz)
+{
+	struct rsvc	*s = NULL;
+	struct rvals	*rv;
+	size_t		 i;
+
+	if (r->state != REPLICA_LIVE)
+		return -1;
+	for (i = 0; i < r->nsvcs; i++)
+		if (r->svcs[i].service == service)
+			s = &r->svcs[i];
+	if (s == NULL || s->ident == IDENT_NONE)
+		return -1;
+
+	if ((rv = dict_get(&s->rows, key)) == NULL || rv->n == 0)
+		return 0;
+	if (dst == NULL)
+		return 1;
+
+	dst[0] = '\0';
+	for (i = 0; i < rv->n; i++) {
+		if (i > 0 && strlcat(dst, ", ", sz) >= sz)
+			return -1;
+		if (strlcat(dst, rv->v[i], sz) >= sz)
+			return -1;
+		if (!s->multi)
+			break;
+	}
+	return 1;
+}
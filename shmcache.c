@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "shmcache.h"
+
+/*
+ * A cache shared by the table-postgres processes of the host through a
+ * POSIX shared memory segment.  It is a set-associative table of fixed
+ * size slots.  Every slot is guarded by a sequence number that is odd
+ * while a writer updates it: readers never lock, they copy the slot and
+ * retry if the sequence number changed meanwhile, and writers only
+ * claim the slot they update.  A writer that loses the race gives up,
+ * as the entry is only a cache.
+ *
+ * The upper half of the sequence number tells when the slot was
+ * claimed, so that a slot left odd by a writer that died is taken over
+ * after SHM_STUCK seconds instead of being lost for good.
+ */
+
+#define	SHM_MAGIC	0x54504743	/* "TPGC" */
+#define	SHM_VERSION	2
+#define	SHM_WAYS	4
+#define	SHM_DATA	448
+#define	SHM_STUCK	10	/* seconds a writer may hold a slot */
+
+struct shmheader {
+	uint32_t	 magic;
+	uint32_t	 version;
+	uint32_t	 nbuckets;
+	uint32_t	 generation;
+};
+
+struct shmslot {
+	uint64_t	 seq;		/* claimed at << 32 | sequence */
+	uint64_t	 hash;
+	int64_t		 expire;
+	uint32_t	 generation;
+	uint16_t	 klen;
+	uint16_t	 vlen;
+	int32_t		 found;
+	char		 data[SHM_DATA];
+};
+
+struct shmcache {
+	struct shmheader *hdr;
+	struct shmslot	*slots;
+	size_t		 size;
+};
+
+/* 64-bit FNV-1a */
+static uint64_t
+shmcache_hash(const char *s, size_t len)
+{
+	uint64_t	 h = 14695981039346656037ULL;
+
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* seconds on a clock that all the processes of the host share */
+static uint32_t
+shmcache_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Attach to the segment, creating it if needed.  Set stale if it exists
+ * but cannot be used.
+ */
+static struct shmcache *
+shmcache_attach(const char *name, size_t entries, int *stale)
+{
+	struct shmcache	*sc;
+	struct stat	 sb;
+	uint32_t	 nbuckets;
+	size_t		 size;
+	int		 fd, i, creator = 1;
+
+	*stale = 0;
+
+	nbuckets = (entries + SHM_WAYS - 1) / SHM_WAYS;
+	size = sizeof(struct shmheader) +
+	    (size_t)nbuckets * SHM_WAYS * sizeof(struct shmslot);
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+		if (errno != EEXIST ||
+		    (fd = shm_open(name, O_RDWR, 0600)) == -1) {
+			log_warn("warn: shm_open: %s", name);
+			return NULL;
+		}
+		creator = 0;
+	}
+
+	if (creator && ftruncate(fd, size) == -1) {
+		log_warn("warn: ftruncate");
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	/* attach with the size chosen by the creator */
+	for (i = 0; !creator; i++) {
+		if (fstat(fd, &sb) == -1) {
+			log_warn("warn: fstat");
+			close(fd);
+			return NULL;
+		}
+		if (sb.st_size > (off_t)sizeof(struct shmheader)) {
+			size = sb.st_size;
+			break;
+		}
+		if (i == 100) {
+			log_warnx("warn: %s: not initialized", name);
+			close(fd);
+			*stale = 1;
+			return NULL;
+		}
+		usleep(1000);
+	}
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL) {
+		log_warn("warn: calloc");
+		close(fd);
+		return NULL;
+	}
+
+	sc->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sc->hdr == MAP_FAILED) {
+		log_warn("warn: mmap");
+		free(sc);
+		return NULL;
+	}
+	sc->size = size;
+	sc->slots = (struct shmslot *)(sc->hdr + 1);
+
+	if (creator) {
+		sc->hdr->version = SHM_VERSION;
+		sc->hdr->nbuckets = nbuckets;
+		__atomic_store_n(&sc->hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	for (i = 0; __atomic_load_n(&sc->hdr->magic, __ATOMIC_ACQUIRE) !=
+	    SHM_MAGIC; i++) {
+		if (i == 100) {
+			log_warnx("warn: %s: not initialized", name);
+			shmcache_close(sc);
+			*stale = 1;
+			return NULL;
+		}
+		usleep(1000);
+	}
+
+	if (sc->hdr->version != SHM_VERSION ||
+	    sizeof(struct shmheader) + (size_t)sc->hdr->nbuckets * SHM_WAYS *
+	    sizeof(struct shmslot) > size) {
+		log_warnx("warn: %s: incompatible segment", name);
+		shmcache_close(sc);
+		*stale = 1;
+		return NULL;
+	}
+
+	return sc;
+}
+
+/*
+ * Attach to the segment of the host, or create it.  A segment whose
+ * creator died before initializing it, or left by another version, is
+ * created again.  The processes still attached to it, if any, keep it
+ * to themselves.
+ */
+struct shmcache *
+shmcache_open(const char *name, size_t entries)
+{
+	struct shmcache	*sc;
+	int		 stale;
+
+	if ((sc = shmcache_attach(name, entries, &stale)) == NULL && stale) {
+		log_warnx("warn: %s: creating the segment again", name);
+		shm_unlink(name);
+		sc = shmcache_attach(name, entries, &stale);
+	}
+	return sc;
+}
+
+void
+shmcache_close(struct shmcache *sc)
+{
+	if (sc == NULL)
+		return;
+	munmap(sc->hdr, sc->size);
+	free(sc);
+}
+
+/*
+ * Drop all the entries, for all the processes, by moving to the next
+ * generation.
+ */
+void
+shmcache_flush(struct shmcache *sc)
+{
+	__atomic_add_fetch(&sc->hdr->generation, 1, __ATOMIC_RELEASE);
+}
+
+static struct shmslot *
+shmcache_bucket(struct shmcache *sc, uint64_t h)
+{
+	return &sc->slots[(h % sc->hdr->nbuckets) * SHM_WAYS];
+}
+
+/*
+ * Return -1 on a miss, or whether the key was found.  For a lookup,
+ * dst is filled with the value.
+ */
+int
+shmcache_get(struct shmcache *sc, const char *key, char *dst, size_t sz)
+{
+	struct shmslot	*b, copy;
+	uint64_t	 h, seq;
+	uint32_t	 gen;
+	size_t		 klen;
+	int		 i;
+
+	klen = strlen(key);
+	if (klen > SHM_DATA)
+		return -1;
+	h = shmcache_hash(key, klen);
+	b = shmcache_bucket(sc, h);
+	gen = __atomic_load_n(&sc->hdr->generation, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < SHM_WAYS; i++) {
+		seq = __atomic_load_n(&b[i].seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		if (__atomic_load_n(&b[i].hash, __ATOMIC_RELAXED) != h)
+			continue;
+		memcpy(&copy, &b[i], sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&b[i].seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (copy.generation != gen || copy.klen != klen ||
+		    copy.klen + copy.vlen > SHM_DATA ||
+		    memcmp(copy.data, key, klen) != 0)
+			continue;
+		if (copy.expire <= time(NULL))
+			return -1;
+		if (copy.found && dst) {
+			if (copy.vlen == 0 || copy.vlen >= sz)
+				return -1;
+			memcpy(dst, copy.data + klen, copy.vlen);
+			dst[copy.vlen] = '\0';
+		}
+		return copy.found;
+	}
+
+	return -1;
+}
+
+void
+shmcache_set(struct shmcache *sc, const char *key, int found,
+    const char *value, int ttl)
+{
+	struct shmslot	*b, *s = NULL;
+	uint64_t	 h, seq, claim;
+	uint32_t	 gen, now;
+	size_t		 klen, vlen;
+	int		 i;
+
+	if (found == -1 || ttl == 0)
+		return;
+
+	klen = strlen(key);
+	vlen = (found && value) ? strlen(value) : 0;
+	if (klen + vlen > SHM_DATA)
+		return;
+
+	h = shmcache_hash(key, klen);
+	b = shmcache_bucket(sc, h);
+	gen = __atomic_load_n(&sc->hdr->generation, __ATOMIC_ACQUIRE);
+
+	/* reuse the slot of the key, or else evict the oldest one */
+	for (i = 0; i < SHM_WAYS; i++) {
+		if (b[i].hash == h && b[i].generation == gen) {
+			s = &b[i];
+			break;
+		}
+		if (s == NULL || b[i].generation != gen ||
+		    b[i].expire < s->expire)
+			s = &b[i];
+	}
+
+	/* take the slot over from a writer that died holding it */
+	now = shmcache_now();
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) && now - (uint32_t)(seq >> 32) < SHM_STUCK)
+		return;
+	claim = (uint64_t)now << 32 | (uint32_t)(seq + ((seq & 1) ? 2 : 1));
+	if (!__atomic_compare_exchange_n(&s->seq, &seq, claim, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	s->generation = gen;
+	__atomic_store_n(&s->hash, h, __ATOMIC_RELAXED);
+	s->expire = time(NULL) + ttl;
+	s->klen = klen;
+	s->vlen = vlen;
+	s->found = found;
+	memcpy(s->data, key, klen);
+	if (vlen)
+		memcpy(s->data + klen, value, vlen);
+
+	/* unless it was taken over meanwhile */
+	(void)__atomic_compare_exchange_n(&s->seq, &claim,
+	    (uint32_t)(claim + 1), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/tree.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+#include "log.h"
+#include "snapshot.h"
+
+/*
+ * A snapshot is a copy of a table held in memory, with the value of
+ * each key formatted the way a lookup returns it.  The rows of a
+ * multi-valued service are joined, the others keep the first row.
+ *
+ * A reload builds the next generation on the side, while the current
+ * one keeps answering, and replaces it in one pointer swap.  Readers
+ * that keep a generation across requests, like the fetch cursor, hold
+ * a reference, and the old generation goes away with the last of them.
+ */
+
+struct snapshot {
+	struct dict	 rows;
+	int		 multi;
+	int		 refs;
+};
+
+struct snapshot *
+snapshot_new(int multi)
+{
+	struct snapshot	*s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		log_warn("warn: calloc");
+		return NULL;
+	}
+	dict_init(&s->rows);
+	s->multi = multi;
+	s->refs = 1;
+
+	return s;
+}
+
+struct snapshot *
+snapshot_ref(struct snapshot *s)
+{
+	if (s)
+		s->refs++;
+	return s;
+}
+
+/*
+ * Drop a reference to the snapshot, and free it with the last one.
+ */
+void
+snapshot_free(struct snapshot *s)
+{
+	void	*v;
+
+	if (s == NULL || --s->refs > 0)
+		return;
+
+	while (dict_poproot(&s->rows, &v))
+		free(v);
+	free(s);
+}
+
+int
+snapshot_add(struct snapshot *s, const char *key, const char *value)
+{
+	char	*old, *v;
+
+	old = dict_get(&s->rows, key);
+	if (old && !s->multi)
+		return 1;
+	if (old) {
+		if (asprintf(&v, "%s, %s", old, value) == -1)
+			v = NULL;
+	} else
+		v = strdup(value);
+	if (v == NULL) {
+		log_warn("warn: strdup");
+		return 0;
+	}
+	free(dict_set(&s->rows, key, v));
+
+	return 1;
+}
+
+/*
+ * Make next the current generation of the slot, which gives up its
+ * reference to the previous one.
+ */
+void
+snapshot_publish(struct snapshot **slot, struct snapshot *next)
+{
+	struct snapshot	*old;
+
+	old = *slot;
+	*slot = next;
+	snapshot_free(old);
+}
+
+/*
+ * Return the generation that follows s, with the keys of the changes
+ * replaced by their value there.  The changes are emptied.  The rows
+ * of s are moved over if nobody else holds it, since then nobody can
+ * tell, and copied otherwise.
+ */
+struct snapshot *
+snapshot_next(struct snapshot *s, struct snapshot *changes)
+{
+	struct snapshot	*n;
+	const char	*k;
+	void		*iter, *v;
+	char		*t;
+
+	if ((n = snapshot_new(s->multi)) == NULL)
+		return NULL;
+
+	if (s->refs == 1) {
+		n->rows = s->rows;
+		dict_init(&s->rows);
+	} else {
+		iter = NULL;
+		while (dict_iter(&s->rows, &iter, &k, &v)) {
+			if ((t = strdup(v)) == NULL) {
+				log_warn("warn: strdup");
+				snapshot_free(n);
+				return NULL;
+			}
+			dict_set(&n->rows, k, t);
+		}
+	}
+
+	while (dict_root(&changes->rows, &k, &v)) {
+		free(dict_set(&n->rows, k, v));
+		dict_pop(&changes->rows, k);
+	}
+
+	return n;
+}
+
+/*
+ * Look the key up.  A NULL dst means a check.  Return 1 if the key is
+ * there, 0 if not, or -1 if the value does not fit.
+ */
+int
+snapshot_get(struct snapshot *s, const char *key, char *dst, size_t sz)
+{
+	const char	*v;
+
+	if ((v = dict_get(&s->rows, key)) == NULL)
+		return 0;
+	if (dst && strlcpy(dst, v, sz) >= sz)
+		return -1;
+	return 1;
+}
+
+/* keys come in ascending order */
+int
+snapshot_iter(struct snapshot *s, void **iter, const char **key,
+    const char **value)
+{
+	return dict_iter(&s->rows, iter, key, (void **)value);
+}
+
+size_t
+snapshot_count(struct snapshot *s)
+{
+	return dict_count(&s->rows);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_SNAPSHOT_H_
+#define	_SNAPSHOT_H_
+
+struct snapshot;
+
+/* snapshot.c */
+struct snapshot	*snapshot_new(int);
+struct snapshot	*snapshot_ref(struct snapshot *);
+void		 snapshot_free(struct snapshot *);
+void		 snapshot_publish(struct snapshot **, struct snapshot *);
+int		 snapshot_add(struct snapshot *, const char *, const char *);
+struct snapshot	*snapshot_next(struct snapshot *, struct snapshot *);
+int		 snapshot_get(struct snapshot *, const char *, char *, size_t);
+int		 snapshot_iter(struct snapshot *, void **, const char **,
+		    const char **);
+size_t		 snapshot_count(struct snapshot *);
+
+#endif
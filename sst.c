@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sst.h"
+
+/*
+ * A sorted string table: a read-only map from keys to values in a file
+ * that is mapped in memory, so that all the processes of the host share
+ * it through the page cache.
+ *
+ * The entries are stored in ascending key order, in blocks of
+ * SST_BLOCK entries.  Each entry only stores the part of its key that
+ * differs from the previous one:
+ *
+ *	varint shared, varint unshared, varint vlen, key suffix, value
+ *
+ * The first entry of a block shares nothing, so that the sparse index
+ * at the end of the file, an array of block offsets, can be binary
+ * searched on the first key of every block.
+ */
+
+#define	SST_MAGIC	"TPGSST\0\0"
+#define	SST_VERSION	1
+#define	SST_BLOCK	16
+
+struct sst_hdr {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 pad;
+	uint64_t	 nkeys;
+	uint64_t	 nblocks;
+	uint64_t	 index;		/* offset of the index */
+};
+
+struct sst {
+	const unsigned char	*base;
+	size_t			 size;
+	const uint64_t		*index;
+	uint64_t		 nblocks;
+	dev_t			 dev;
+	ino_t			 ino;
+	time_t			 mtime;
+};
+
+struct sst_writer {
+	FILE		*fp;
+	char		 path[PATH_MAX];
+	char		 tmp[PATH_MAX];
+	char		 last[LINE_MAX];
+	uint64_t	*index;
+	size_t		 indexsz;
+	uint64_t	 nkeys;
+	uint64_t	 nblocks;
+	uint64_t	 off;
+	int		 error;
+};
+
+static void
+sst_putvarint(struct sst_writer *w, uint64_t v)
+{
+	unsigned char	 buf[10];
+	size_t		 n = 0;
+
+	do {
+		buf[n] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			buf[n] |= 0x80;
+		n++;
+	} while (v);
+
+	if (fwrite(buf, n, 1, w->fp) != 1)
+		w->error = 1;
+	w->off += n;
+}
+
+static void
+sst_put(struct sst_writer *w, const void *p, size_t len)
+{
+	if (len && fwrite(p, len, 1, w->fp) != 1)
+		w->error = 1;
+	w->off += len;
+}
+
+static int
+sst_getvarint(const unsigned char **p, const unsigned char *end,
+    uint64_t *v)
+{
+	int	 shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+struct sst_writer *
+sst_writer_open(const char *path)
+{
+	struct sst_writer	*w;
+	struct sst_hdr		 hdr;
+	int			 fd;
+
+	if ((w = calloc(1, sizeof(*w))) == NULL) {
+		log_warn("warn: calloc");
+		return NULL;
+	}
+
+	if (strlcpy(w->path, path, sizeof(w->path)) >= sizeof(w->path) ||
+	    snprintf(w->tmp, sizeof(w->tmp), "%s.XXXXXXXXXX", path) >=
+	    (int)sizeof(w->tmp)) {
+		log_warnx("warn: snapshot path too long");
+		free(w);
+		return NULL;
+	}
+	if ((fd = mkstemp(w->tmp)) == -1) {
+		log_warn("warn: mkstemp: %s", w->tmp);
+		free(w);
+		return NULL;
+	}
+	if ((w->fp = fdopen(fd, "w")) == NULL) {
+		log_warn("warn: fdopen");
+		close(fd);
+		unlink(w->tmp);
+		free(w);
+		return NULL;
+	}
+
+	/* the real header is written once everything is known */
+	memset(&hdr, 0, sizeof(hdr));
+	sst_put(w, &hdr, sizeof(hdr));
+
+	return w;
+}
+
+/*
+ * Append an entry.  The keys must be added in strictly ascending order.
+ */
+int
+sst_writer_add(struct sst_writer *w, const char *key, const char *value)
+{
+	uint64_t	*index;
+	size_t		 shared = 0, klen, vlen;
+
+	klen = strlen(key);
+	vlen = strlen(value);
+	if (klen >= sizeof(w->last)) {
+		log_warnx("warn: snapshot key too long: %s", key);
+		return 0;
+	}
+	if (w->nkeys && strcmp(w->last, key) >= 0) {
+		log_warnx("warn: snapshot keys out of order: %s", key);
+		w->error = 1;
+		return 0;
+	}
+
+	if (w->nkeys % SST_BLOCK == 0) {
+		if (w->nblocks == w->indexsz) {
+			w->indexsz = w->indexsz ? w->indexsz * 2 : 1024;
+			index = reallocarray(w->index, w->indexsz,
+			    sizeof(*index));
+			if (index == NULL) {
+				log_warn("warn: reallocarray");
+				w->error = 1;
+				return 0;
+			}
+			w->index = index;
+		}
+		w->index[w->nblocks++] = w->off;
+	} else {
+		while (shared < klen && w->last[shared] == key[shared])
+			shared++;
+	}
+
+	sst_putvarint(w, shared);
+	sst_putvarint(w, klen - shared);
+	sst_putvarint(w, vlen);
+	sst_put(w, key + shared, klen - shared);
+	sst_put(w, value, vlen);
+
+	memcpy(w->last, key, klen + 1);
+	w->nkeys++;
+
+	return !w->error;
+}
+
+/*
+ * Finish the table and move it in place, or throw it away if commit is
+ * zero or if something failed.
+ */
+int
+sst_writer_close(struct sst_writer *w, int commit)
+{
+	struct sst_hdr	 hdr;
+	static const char zero[8];
+	int		 r = 0;
+
+	/* keep the index aligned */
+	sst_put(w, zero, (8 - w->off % 8) % 8);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SST_MAGIC, sizeof(hdr.magic));
+	hdr.version = SST_VERSION;
+	hdr.nkeys = w->nkeys;
+	hdr.nblocks = w->nblocks;
+	hdr.index = w->off;
+	sst_put(w, w->index, w->nblocks * sizeof(*w->index));
+
+	if (commit && !w->error) {
+		if (fseek(w->fp, 0, SEEK_SET) == -1 ||
+		    fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1 ||
+		    fflush(w->fp) == EOF || fsync(fileno(w->fp)) == -1)
+			log_warn("warn: %s", w->tmp);
+		else if (rename(w->tmp, w->path) == -1)
+			log_warn("warn: rename %s", w->path);
+		else
+			r = 1;
+	}
+
+	fclose(w->fp);
+	if (!r)
+		unlink(w->tmp);
+	free(w->index);
+	free(w);
+
+	return r;
+}
+
+struct sst *
+sst_open(const char *path)
+{
+	struct sst	*t;
+	struct sst_hdr	 hdr;
+	struct stat	 sb;
+	void		*p;
+	int		 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: fstat: %s", path);
+		close(fd);
+		return NULL;
+	}
+	if ((size_t)sb.st_size < sizeof(hdr)) {
+		log_warnx("warn: %s: truncated snapshot", path);
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_warn("warn: mmap: %s", path);
+		return NULL;
+	}
+
+	memcpy(&hdr, p, sizeof(hdr));
+	if (memcmp(hdr.magic, SST_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SST_VERSION || hdr.index % 8 ||
+	    hdr.index > (uint64_t)sb.st_size ||
+	    hdr.nblocks > (sb.st_size - hdr.index) / sizeof(uint64_t)) {
+		log_warnx("warn: %s: bad snapshot", path);
+		munmap(p, sb.st_size);
+		return NULL;
+	}
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		log_warn("warn: calloc");
+		munmap(p, sb.st_size);
+		return NULL;
+	}
+	t->base = p;
+	t->size = sb.st_size;
+	t->index = (const uint64_t *)(t->base + hdr.index);
+	t->nblocks = hdr.nblocks;
+	t->dev = sb.st_dev;
+	t->ino = sb.st_ino;
+	t->mtime = sb.st_mtime;
+
+	log_debug("debug: %s: %llu keys", path, (unsigned long long)hdr.nkeys);
+
+	return t;
+}
+
+void
+sst_close(struct sst *t)
+{
+	if (t == NULL)
+		return;
+	munmap((void *)t->base, t->size);
+	free(t);
+}
+
+/*
+ * Return whether the file at path is not the one that was opened.
+ */
+int
+sst_changed(struct sst *t, const char *path)
+{
+	struct stat	 sb;
+
+	if (stat(path, &sb) == -1)
+		return 0;
+	return t == NULL || sb.st_dev != t->dev || sb.st_ino != t->ino ||
+	    sb.st_mtime != t->mtime;
+}
+
+/*
+ * Decode the entry at *p, rebuilding its key in buf from the previous
+ * one.
+ */
+static int
+sst_entry(const unsigned char **p,
+    const unsigned char *end, char *buf, size_t bufsz,
+    const unsigned char **value, size_t *vlen)
+{
+	uint64_t	 shared, unshared, len;
+
+	if (!sst_getvarint(p, end, &shared) ||
+	    !sst_getvarint(p, end, &unshared) ||
+	    !sst_getvarint(p, end, &len))
+		return 0;
+	if (shared > strlen(buf) || unshared >= bufsz - shared ||
+	    (uint64_t)(end - *p) < unshared + len)
+		return 0;
+
+	memcpy(buf + shared, *p, unshared);
+	buf[shared + unshared] = '\0';
+	*p += unshared;
+	*value = *p;
+	*vlen = len;
+	*p += len;
+
+	return 1;
+}
+
+static const unsigned char *
+sst_block(const struct sst *t, uint64_t i, const unsigned char **end)
+{
+	uint64_t	 off, next;
+
+	off = t->index[i];
+	next = (i + 1 < t->nblocks) ? t->index[i + 1] :
+	    (uint64_t)((const unsigned char *)t->index - t->base);
+	if (off < sizeof(struct sst_hdr) || off > next ||
+	    next > (uint64_t)((const unsigned char *)t->index - t->base))
+		return NULL;
+
+	*end = t->base + next;
+	return t->base + off;
+}
+
+/*
+ * Look the key up.  Return 1 and fill dst with the value if it is in
+ * the table, 0 if it isn't, or -1 on error.
+ */
+int
+sst_get(struct sst *t, const char *key, char *dst, size_t sz)
+{
+	const unsigned char	*p, *end, *value;
+	char			 buf[LINE_MAX];
+	uint64_t		 lo, hi, mid;
+	size_t			 vlen;
+	int			 c;
+
+	if (t->nblocks == 0)
+		return 0;
+
+	/* find the last block whose first key is not after the key */
+	lo = 0;
+	hi = t->nblocks;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if ((p = sst_block(t, mid, &end)) == NULL)
+			return -1;
+		buf[0] = '\0';
+		if (!sst_entry(&p, end, buf, sizeof(buf), &value, &vlen))
+			return -1;
+		if (strcmp(buf, key) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if ((p = sst_block(t, lo, &end)) == NULL)
+		return -1;
+	buf[0] = '\0';
+	while (p < end) {
+		if (!sst_entry(&p, end, buf, sizeof(buf), &value, &vlen))
+			return -1;
+		if ((c = strcmp(buf, key)) > 0)
+			break;
+		if (c == 0) {
+			if (dst == NULL)
+				return 1;
+			if (vlen >= sz)
+				return -1;
+			memcpy(dst, value, vlen);
+			dst[vlen] = '\0';
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_SST_H_
+#define	_SST_H_
+
+struct sst;
+struct sst_writer;
+
+/* sst.c */
+struct sst_writer *sst_writer_open(const char *);
+int		 sst_writer_add(struct sst_writer *, const char *, const char *);
+int		 sst_writer_close(struct sst_writer *, int);
+struct sst	*sst_open(const char *);
+void		 sst_close(struct sst *);
+int		 sst_changed(struct sst *, const char *);
+int		 sst_get(struct sst *, const char *, char *, size_t);
+
+#endif
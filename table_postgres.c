@@ -16,12 +16,17 @@
 
 #include "compat.h"
 
-#include <sys/tree.h>
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
 
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,9 +35,18 @@
 
 #include <libpq-fe.h>
 
+#include "broker.h"
+#include "cache.h"
+#include "copy.h"
 #include "dict.h"
 #include "log.h"
+#include "radix.h"
+#include "replica.h"
+#include "shmcache.h"
+#include "snapshot.h"
+#include "sst.h"
 #include "table_stdio.h"
+#include "trie.h"
 #include "util.h"
 
 enum {
@@ -49,13 +63,135 @@ enum {
 	SQL_MAX
 };
 
+static const struct {
+	const char	*name;
+	int		 cols;
+} qspec[SQL_MAX] = {
+	{ "query_alias",	1 },
+	{ "query_domain",	1 },
+	{ "query_credentials",	2 },
+	{ "query_netaddr",	1 },
+	{ "query_userinfo",	3 },
+	{ "query_source",	1 },
+	{ "query_mailaddr",	1 },
+	{ "query_addrname",	1 },
+	{ "query_mailaddrmap",	1 },
+};
+
+/* statements that are not the query of a service */
+enum {
+	STMT_ALIAS_CLOSURE = SQL_MAX,
+	STMT_BATCH,			/* one per service */
+
+	STMT_MAX = STMT_BATCH + SQL_MAX
+};
+
+static const struct {
+	const char	*name;
+	int		 cols;
+} xspec[STMT_MAX - SQL_MAX] = {
+	{ "query_alias_closure",	2 },
+	{ "query_alias_batch",		2 },
+	{ "query_domain_batch",		2 },
+	{ "query_credentials_batch",	3 },
+	{ "query_netaddr_batch",	2 },
+	{ "query_userinfo_batch",	4 },
+	{ "query_source_batch",		2 },
+	{ "query_mailaddr_batch",	2 },
+	{ "query_addrname_batch",	2 },
+	{ "query_mailaddrmap_batch",	2 },
+};
+
+/* the steps of a probe */
+enum {
+	PROBE_IDLE,
+	PROBE_CONNECT,
+	PROBE_QUERY
+};
+
+/* the steps of a refresh */
+enum {
+	REFRESH_IDLE,
+	REFRESH_CONNECT,
+	REFRESH_PREPARE,
+	REFRESH_QUERY
+};
+
+struct endpoint {
+	char		*name;
+	const char	*conninfo;
+	PGconn		*db;
+	char		*statements[STMT_MAX];
+	int		 healthy;
+	long long	 latency;	/* EWMA of the round trips, in usec */
+	PGconn		*probe;		/* a connection of its own */
+	int		 pstate;
+	int		 pfd;		/* watched while not idle */
+	long long	 pstart;
+	PGconn		*refresh;	/* another one for the refreshes */
+	int		 rstate;
+	int		 rfd;		/* watched while not idle */
+	int		 rprepared;	/* queries prepared on it */
+};
+
+struct shard {
+	char		 *name;
+	struct endpoint	**endpoints;
+	size_t		  nendpoints;
+	struct endpoint	 *ep;
+};
+
+struct ringpoint {
+	uint32_t	 hash;
+	struct shard	*shard;
+};
+
+struct load;
+
+/* a snapshot held in memory, with the watermark reached on each shard */
+struct snapsvc {
+	struct snapshot	*cur;
+	char		**marks;
+	time_t		  loaded;
+	struct load	 *load;
+	struct radix	 *net;		/* the netaddr blocks */
+	struct trie	 *names;	/* the domains, with wildcards */
+};
+
 struct config {
 	struct dict	 conf;
-	PGconn		*db;
-	char		*statements[SQL_MAX];
-	char		*stmt_fetch_source;
-	struct dict	 sources;
+	struct endpoint	*endpoints;
+	size_t		 nendpoints;
+	struct shard	*shards;
+	size_t		 nshards;
+	struct dict	 shard_map;
+	struct ringpoint *ring;
+	size_t		 nring;
+	int		 probe_interval;
+	int		 pooler;
+	int		 domain_gate;
+	struct cache	*cache;
+	int		 cache_ttl;
+	int		 cache_negttl;
+	struct shmcache	*shmcache;
+	uint32_t	 qtag[SQL_MAX];
+	uint32_t	 tag;		/* hash of the whole file */
+	struct sst	**sst[SQL_MAX];	/* one per shard */
+	struct load	*sst_load[SQL_MAX];
+	int		 sst_refresh;
+	struct replica	*replica;
+	struct snapsvc	 snaps[SQL_MAX];
+	int		 prefetch[SQL_MAX];	/* services to fetch along */
+	int		 variants;	/* services to fetch key variants of */
+	int		 snap_refresh;
+	int		 batch_window;	/* usec */
+	int		 batch_size;
+	int		 ttl_column;	/* the queries end with a ttl */
+	int		 snap_reconcile;
+	struct snapshot	*sources;
+	struct snapshot	*source_gen;	/* the generation the cursor walks */
 	void		*source_iter;
+	struct load	*source_load;
 	size_t		 source_refresh;
 	size_t		 source_ncall;
 	int		 source_expire;
@@ -64,9 +200,63 @@ struct config {
 
 #define	DEFAULT_EXPIRE	60
 #define	DEFAULT_REFRESH	1000
+#define	DEFAULT_PROBE	10
+#define	PROBE_TIMEOUT	5	/* seconds for an endpoint to answer */
+#define	CONNECT_TIMEOUT	"5"	/* seconds, unless the conninfo says */
+#define	DEFAULT_CACHE	10000
+#define	CACHE_SAVE	300	/* seconds between two saves of the cache */
+#define	DEFAULT_SST	3600
+#define	SST_CHECK	60	/* seconds between two checks of the snapshots */
+#define	DEFAULT_SNAP_REFRESH	60
+#define	DEFAULT_SNAP_RECONCILE	3600
+#define	RING_POINTS	64	/* points per shard on the hash ring */
+#define	DEFAULT_BATCH_SIZE	64
+#define	BROKER_RETRY	30	/* seconds before trying a lost broker again */
+#define	VARIANTS_MAX	4	/* other forms smtpd tries for a key */
+#define	PREFETCH_MAX	(SQL_MAX + VARIANTS_MAX)
 
 static char		*conffile;
 static struct config	*config;
+static int		 probing;
+static int		 broker_mode;
+static int		 broker_fd = -1;
+static long long	 broker_retry;	/* usec, when to try the broker again */
+
+/*
+ * What was fetched for the requests being handled together: the keys
+ * of batch_keys are answered from batch, and the ones of batch_found
+ * are known to be there.  batch_ttl holds the lifetime the rows of a
+ * key gave, if any.
+ */
+static int		 batching;
+static struct snapshot	*batch[SQL_MAX];
+static struct dict	 batch_keys[SQL_MAX];
+static struct dict	 batch_found[SQL_MAX];
+static struct dict	 batch_ttl[SQL_MAX];
+
+static int		 refreshing;
+static struct {
+	struct endpoint	*ep;		/* NULL if none is in progress */
+	int		 service;
+	int		 lookup;
+	int		 i;		/* the query of the service */
+	char		 key[LINE_MAX];
+	time_t		 deadline;
+} refresh;
+static int		 db_down;	/* no endpoint could answer */
+static unsigned long long stale_hits;
+
+static void		 load_free(struct load *);
+static void		 table_postgres_refresh(void *);
+
+static long long
+now_usec(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 static char *
 table_postgres_prepare_stmt(PGconn *_db, const char *query, int nparams,
@@ -93,51 +283,487 @@ table_postgres_prepare_stmt(PGconn *_db, const char *query, int nparams,
 }
 
 static void
-config_reset(struct config *conf)
+endpoint_reset(struct endpoint *ep)
 {
 	size_t	i;
 
-	for (i = 0; i < SQL_MAX; i++)
-		if (conf->statements[i]) {
-			free(conf->statements[i]);
-			conf->statements[i] = NULL;
+	for (i = 0; i < STMT_MAX; i++)
+		if (ep->statements[i]) {
+			free(ep->statements[i]);
+			ep->statements[i] = NULL;
 		}
-	if (conf->stmt_fetch_source) {
-		free(conf->stmt_fetch_source);
-		conf->stmt_fetch_source = NULL;
+	if (ep->db) {
+		PQfinish(ep->db);
+		ep->db = NULL;
+	}
+}
+
+/*
+ * Feed a round trip time to the moving average of the endpoint.  The
+ * weight of new samples is high enough that a node that degrades loses
+ * its rank after a probe or two.
+ */
+static void
+endpoint_sample(struct endpoint *ep, long long start)
+{
+	long long	 rtt;
+
+	rtt = now_usec() - start;
+	if (ep->latency == 0)
+		ep->latency = rtt;
+	else
+		ep->latency = (7 * ep->latency + 3 * rtt) / 10;
+}
+
+/* 32-bit FNV-1a */
+static uint32_t
+hash_str(const char *s)
+{
+	uint32_t	 h = 2166136261U;
+
+	for (; *s; s++) {
+		h ^= (unsigned char)*s;
+		h *= 16777619U;
 	}
-	if (conf->db) {
-		PQfinish(conf->db);
-		conf->db = NULL;
+	return h;
+}
+
+static int
+ringpoint_cmp(const void *a, const void *b)
+{
+	const struct ringpoint	*ra = a, *rb = b;
+
+	if (ra->hash < rb->hash)
+		return -1;
+	return ra->hash > rb->hash;
+}
+
+/*
+ * Run a query on the endpoint.  In pooler mode it is sent as an unnamed
+ * statement, which is parsed and executed in a single round trip and
+ * does not depend on the server session.  Otherwise the prepared
+ * statement is used, and prepared again if the server lost it, e.g.
+ * after a DISCARD ALL.
+ */
+static PGresult *
+endpoint_exec(struct config *conf, struct endpoint *ep, char **stmt,
+    const char *query, int nparams, const char *const *params)
+{
+	PGresult	*res;
+	const char	*errfld;
+	char		*n;
+
+	if (conf->pooler)
+		return PQexecParams(ep->db, query, nparams, NULL, params,
+		    NULL, NULL, 0);
+
+	res = PQexecPrepared(ep->db, *stmt, nparams, params, NULL, NULL, 0);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK)
+		return res;
+
+	errfld = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+	if (errfld == NULL || strcmp(errfld, "26000") != 0)
+		return res;
+
+	/*
+	 * If it cannot be prepared, the error is the one of the query
+	 * rather than a lost connection, unless it is really lost.
+	 */
+	log_debug("debug: preparing %s again on %s", *stmt, ep->name);
+	if ((n = table_postgres_prepare_stmt(ep->db, query, nparams, 0))
+	    == NULL) {
+		if (PQstatus(ep->db) == CONNECTION_OK)
+			return res;
+		PQclear(res);
+		return NULL;
 	}
+	PQclear(res);
+	free(*stmt);
+	*stmt = n;
+
+	return PQexecPrepared(ep->db, *stmt, nparams, params, NULL, NULL, 0);
+}
+
+static void
+config_reset(struct config *conf)
+{
+	size_t	i;
+
+	for (i = 0; i < conf->nendpoints; i++)
+		endpoint_reset(&conf->endpoints[i]);
+	for (i = 0; i < conf->nshards; i++)
+		conf->shards[i].ep = NULL;
 }
 
 static void
 config_free(struct config *conf)
 {
 	void	*value;
+	size_t	 i, j;
+
+	for (i = 0; i < SQL_MAX; i++) {
+		load_free(conf->snaps[i].load);
+		load_free(conf->sst_load[i]);
+	}
+	load_free(conf->source_load);
 
 	config_reset(conf);
 
+	for (i = 0; i < conf->nendpoints; i++) {
+		if (conf->endpoints[i].pstate != PROBE_IDLE)
+			table_api_watch(conf->endpoints[i].pfd, NULL, NULL);
+		PQfinish(conf->endpoints[i].probe);
+		if (conf->endpoints[i].rstate != REFRESH_IDLE)
+			table_api_watch(conf->endpoints[i].rfd, NULL, NULL);
+		PQfinish(conf->endpoints[i].refresh);
+		if (refresh.ep == &conf->endpoints[i])
+			refresh.ep = NULL;
+		free(conf->endpoints[i].name);
+	}
+	free(conf->endpoints);
+	for (i = 0; i < conf->nshards; i++)
+		free(conf->shards[i].endpoints);
+	free(conf->shards);
+	free(conf->ring);
+	cache_free(conf->cache);
+	shmcache_close(conf->shmcache);
+	for (i = 0; i < SQL_MAX; i++) {
+		for (j = 0; conf->sst[i] && j < conf->nshards; j++)
+			sst_close(conf->sst[i][j]);
+		free(conf->sst[i]);
+	}
+	replica_free(conf->replica);
+	for (i = 0; i < SQL_MAX; i++) {
+		snapshot_free(conf->snaps[i].cur);
+		radix_free(conf->snaps[i].net);
+		trie_free(conf->snaps[i].names);
+		for (j = 0; conf->snaps[i].marks && j < conf->nshards; j++)
+			free(conf->snaps[i].marks[j]);
+		free(conf->snaps[i].marks);
+	}
+
+	while (dict_poproot(&conf->shard_map, NULL))
+		;
+
 	while (dict_poproot(&conf->conf, &value))
 		free(value);
 
-	while (dict_poproot(&conf->sources, NULL))
-		;
+	snapshot_free(conf->sources);
+	snapshot_free(conf->source_gen);
 
 	free(conf);
 }
 
+static struct endpoint *
+config_find_endpoint(struct config *conf, const char *name)
+{
+	size_t	 i;
+
+	for (i = 0; i < conf->nendpoints; i++)
+		if (!strcmp(conf->endpoints[i].name, name))
+			return &conf->endpoints[i];
+	return NULL;
+}
+
+static struct shard *
+config_add_shard(struct config *conf, const char *name)
+{
+	struct shard	*sh;
+
+	sh = reallocarray(conf->shards, conf->nshards + 1, sizeof(*sh));
+	if (sh == NULL) {
+		log_warn("warn: reallocarray");
+		return NULL;
+	}
+	conf->shards = sh;
+	sh = &conf->shards[conf->nshards++];
+	memset(sh, 0, sizeof(*sh));
+	sh->name = (char *)name;
+	return sh;
+}
+
+static int
+shard_add_endpoint(struct shard *sh, struct endpoint *ep)
+{
+	struct endpoint	**eps;
+
+	eps = reallocarray(sh->endpoints, sh->nendpoints + 1, sizeof(*eps));
+	if (eps == NULL) {
+		log_warn("warn: reallocarray");
+		return 0;
+	}
+	sh->endpoints = eps;
+	sh->endpoints[sh->nendpoints++] = ep;
+	return 1;
+}
+
+/*
+ * Every "shard_<name>" directive lists the endpoints of a shard.  The
+ * keys are routed by the domain part, either through "shard_map" or by
+ * consistent hashing over the shards.  Without shards, all the
+ * endpoints form a single one.
+ */
+static int
+config_load_shards(struct config *conf)
+{
+	struct shard	*sh;
+	struct endpoint	*ep;
+	const char	*k;
+	char		*value, *copy, *p, *t, *dom;
+	char		 buf[LINE_MAX];
+	void		*iter;
+	size_t		 i, j;
+
+	iter = NULL;
+	while (dict_iter(&conf->conf, &iter, &k, (void **)&value)) {
+		if (strncmp(k, "shard_", 6) != 0 || !strcmp(k, "shard_map"))
+			continue;
+		if ((sh = config_add_shard(conf, k + 6)) == NULL)
+			return 0;
+		if ((copy = strdup(value)) == NULL) {
+			log_warn("warn: strdup");
+			return 0;
+		}
+		p = copy;
+		while ((t = strsep(&p, " \t,")) != NULL) {
+			if (*t == '\0')
+				continue;
+			if ((ep = config_find_endpoint(conf, t)) == NULL) {
+				log_warnx("warn: unknown endpoint %s in shard %s",
+				    t, sh->name);
+				free(copy);
+				return 0;
+			}
+			if (!shard_add_endpoint(sh, ep)) {
+				free(copy);
+				return 0;
+			}
+		}
+		free(copy);
+		if (sh->nendpoints == 0) {
+			log_warnx("warn: no endpoint for shard %s", sh->name);
+			return 0;
+		}
+	}
+
+	if (conf->nshards == 0) {
+		if ((sh = config_add_shard(conf, "default")) == NULL)
+			return 0;
+		for (i = 0; i < conf->nendpoints; i++)
+			if (!shard_add_endpoint(sh, &conf->endpoints[i]))
+				return 0;
+		if (dict_check(&conf->conf, "shard_map")) {
+			log_warnx("warn: shard_map without shards");
+			return 0;
+		}
+		return 1;
+	}
+
+	if ((value = dict_get(&conf->conf, "shard_map")) != NULL) {
+		if ((copy = strdup(value)) == NULL) {
+			log_warn("warn: strdup");
+			return 0;
+		}
+		p = copy;
+		while ((t = strsep(&p, " \t,")) != NULL) {
+			if (*t == '\0')
+				continue;
+			dom = strsep(&t, "=");
+			if (t == NULL || !lowercase(buf, dom, sizeof(buf))) {
+				log_warnx("warn: bad shard_map entry: %s", dom);
+				goto end;
+			}
+			for (sh = NULL, i = 0; i < conf->nshards; i++)
+				if (!strcmp(conf->shards[i].name, t))
+					sh = &conf->shards[i];
+			if (sh == NULL) {
+				log_warnx("warn: unknown shard %s in shard_map",
+				    t);
+				goto end;
+			}
+			dict_set(&conf->shard_map, buf, sh);
+		}
+		free(copy);
+	}
+
+	conf->ring = reallocarray(NULL, conf->nshards * RING_POINTS,
+	    sizeof(*conf->ring));
+	if (conf->ring == NULL) {
+		log_warn("warn: reallocarray");
+		return 0;
+	}
+	for (i = 0; i < conf->nshards; i++) {
+		for (j = 0; j < RING_POINTS; j++) {
+			(void)snprintf(buf, sizeof(buf), "%s#%zu",
+			    conf->shards[i].name, j);
+			conf->ring[conf->nring].hash = hash_str(buf);
+			conf->ring[conf->nring].shard = &conf->shards[i];
+			conf->nring++;
+		}
+	}
+	qsort(conf->ring, conf->nring, sizeof(*conf->ring), ringpoint_cmp);
+
+	return 1;
+
+end:
+	free(copy);
+	return 0;
+}
+
+/*
+ * The shared cache is attached by all the processes that use the same
+ * endpoints.  Its keys are tagged with a hash of the query, so that
+ * tables with different queries don't see each other's results.
+ */
+static int
+config_load_shmcache(struct config *conf)
+{
+	const char	*e, *q;
+	char		 name[32];
+	long long	 ll;
+	uint32_t	 h;
+	size_t		 i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if ((q = dict_get(&conf->conf, qspec[i].name)) != NULL)
+			conf->qtag[i] = hash_str(q);
+
+	if ((q = dict_get(&conf->conf, "shared_cache_size")) == NULL)
+		return 1;
+
+	e = NULL;
+	ll = strtonum(q, 1, INT_MAX, &e);
+	if (e) {
+		log_warnx("warn: bad value for shared_cache_size: %s", e);
+		return 0;
+	}
+
+	h = 2166136261U;
+	for (i = 0; i < conf->nendpoints; i++)
+		h = (h ^ hash_str(conf->endpoints[i].conninfo)) * 16777619U;
+	(void)snprintf(name, sizeof(name), "/table-postgres.%08x", h);
+
+	/* run without it rather than failing the table */
+	if ((conf->shmcache = shmcache_open(name, ll)) == NULL)
+		log_warnx("warn: shared cache disabled");
+
+	return 1;
+}
+
+/*
+ * Describe the services to replicate.  The netaddr queries match
+ * networks rather than keys, so they are left to the database.
+ */
+static int
+config_load_replica(struct config *conf)
+{
+	const char	*pub, *ci, *spec;
+	char		 key[64];
+	int		 i;
+
+	if ((pub = dict_get(&conf->conf, "replica_publication")) == NULL)
+		return 1;
+	if ((ci = dict_get(&conf->conf, "replica_conninfo")) == NULL &&
+	    (ci = dict_get(&conf->conf, "conninfo")) == NULL) {
+		log_warnx("warn: missing \"replica_conninfo\" configuration directive");
+		return 0;
+	}
+
+	if ((conf->replica = replica_new(ci, pub)) == NULL)
+		return 0;
+
+	for (i = 0; i < SQL_MAX; i++) {
+		if (i == SQL_NETADDR || i == SQL_SOURCE)
+			continue;
+		(void)snprintf(key, sizeof(key), "replica_%s",
+		    qspec[i].name + 6);
+		if ((spec = dict_get(&conf->conf, key)) == NULL)
+			continue;
+		if (!replica_add(conf->replica, 1 << i,
+		    i == SQL_ALIAS || i == SQL_MAILADDRMAP, spec))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Read the prefetch_<service> rules, which list the services whose
+ * query is sent along with the one of the service.
+ */
+static int
+config_load_prefetch(struct config *conf)
+{
+	const char	*value;
+	char		 key[64], *copy, *p, *t;
+	int		 i, j;
+
+	for (i = 0; i < SQL_MAX; i++) {
+		(void)snprintf(key, sizeof(key), "prefetch_%s",
+		    qspec[i].name + 6);
+		if ((value = dict_get(&conf->conf, key)) == NULL)
+			continue;
+		if ((copy = strdup(value)) == NULL) {
+			log_warn("warn: strdup");
+			return 0;
+		}
+		p = copy;
+		while ((t = strsep(&p, " \t,")) != NULL) {
+			if (*t == '\0')
+				continue;
+			for (j = 0; j < SQL_MAX; j++)
+				if (!strcmp(t, qspec[j].name + 6))
+					break;
+			if (j == SQL_MAX || j == i) {
+				log_warnx("warn: bad service %s in %s", t, key);
+				free(copy);
+				return 0;
+			}
+			conf->prefetch[i] |= 1 << j;
+		}
+		free(copy);
+	}
+
+	if ((value = dict_get(&conf->conf, "key_variants")) == NULL)
+		return 1;
+	if ((copy = strdup(value)) == NULL) {
+		log_warn("warn: strdup");
+		return 0;
+	}
+	p = copy;
+	while ((t = strsep(&p, " \t,")) != NULL) {
+		if (*t == '\0')
+			continue;
+		for (j = 0; j < SQL_MAX; j++)
+			if (!strcmp(t, qspec[j].name + 6))
+				break;
+		if (j == SQL_MAX) {
+			log_warnx("warn: bad service %s in key_variants", t);
+			free(copy);
+			return 0;
+		}
+		conf->variants |= 1 << j;
+	}
+	free(copy);
+
+	return 1;
+}
+
 static struct config *
 config_load(const char *path)
 {
 	struct config	*conf;
+	struct endpoint	*ep;
 	FILE		*fp;
 	size_t		 sz = 0;
 	ssize_t		 flen;
 	char		*key, *value, *buf = NULL;
-	const char	*e;
+	const char	*e, *k;
+	void		*iter;
 	long long	 ll;
+	int		 ttl, negttl;
+	size_t		 csize;
+	int		 ahead, stale, admission;
 
 	if ((conf = calloc(1, sizeof(*conf))) == NULL) {
 		log_warn("warn: calloc");
@@ -145,10 +771,15 @@ config_load(const char *path)
 	}
 
 	dict_init(&conf->conf);
-	dict_init(&conf->sources);
+	dict_init(&conf->shard_map);
 
 	conf->source_refresh = DEFAULT_REFRESH;
 	conf->source_expire = DEFAULT_EXPIRE;
+	conf->probe_interval = DEFAULT_PROBE;
+	conf->sst_refresh = DEFAULT_SST;
+	conf->snap_refresh = DEFAULT_SNAP_REFRESH;
+	conf->batch_size = DEFAULT_BATCH_SIZE;
+	conf->snap_reconcile = DEFAULT_SNAP_RECONCILE;
 
 	if ((fp = fopen(path, "r")) == NULL) {
 		log_warn("warn: \"%s\"", path);
@@ -194,6 +825,14 @@ config_load(const char *path)
 		dict_set(&conf->conf, key, value);
 	}
 
+	/* the broker only serves the processes that share its file */
+	conf->tag = 2166136261U;
+	iter = NULL;
+	while (dict_iter(&conf->conf, &iter, &k, (void **)&value)) {
+		conf->tag = (conf->tag ^ hash_str(k)) * 16777619U;
+		conf->tag = (conf->tag ^ hash_str(value)) * 16777619U;
+	}
+
 	if ((value = dict_get(&conf->conf, "fetch_source_expire"))) {
 		e = NULL;
 		ll = strtonum(value, 0, INT_MAX, &e);
@@ -212,174 +851,1858 @@ config_load(const char *path)
 		}
 		conf->source_refresh = ll;
 	}
-
-	free(buf);
-	fclose(fp);
-	return conf;
-
-end:
-	free(buf);
-	fclose(fp);
-	config_free(conf);
-	return NULL;
-}
-
-static int
-config_connect(struct config *conf)
-{
-	static const struct {
-		const char	*name;
-		int		 cols;
-	} qspec[SQL_MAX] = {
-		{ "query_alias",	1 },
-		{ "query_domain",	1 },
-		{ "query_credentials",	2 },
-		{ "query_netaddr",	1 },
-		{ "query_userinfo",	3 },
-		{ "query_source",	1 },
-		{ "query_mailaddr",	1 },
-		{ "query_addrname",	1 },
-		{ "query_mailaddrmap",	1 },
-	};
-	size_t	 i;
-	char	*conninfo, *q;
-
-	log_debug("debug: (re)connecting");
-
-	/* Disconnect first, if needed */
-	config_reset(conf);
-
-	conninfo = dict_get(&conf->conf, "conninfo");
-	if (conninfo == NULL) {
-		log_warnx("warn: missing \"conninfo\" configuration directive");
-		goto end;
+	if ((value = dict_get(&conf->conf, "probe_interval"))) {
+		e = NULL;
+		ll = strtonum(value, 1, INT_MAX / 1000, &e);
+		if (e) {
+			log_warnx("warn: bad value for probe_interval: %s", e);
+			goto end;
+		}
+		conf->probe_interval = ll;
 	}
 
-	conf->db = PQconnectdb(conninfo);
-	if (conf->db == NULL) {
-		log_warnx("warn: PQconnectdb return NULL");
-		goto end;
+	if ((value = dict_get(&conf->conf, "sst_refresh"))) {
+		e = NULL;
+		ll = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for sst_refresh: %s", e);
+			goto end;
+		}
+		conf->sst_refresh = ll;
 	}
-	if (PQstatus(conf->db) != CONNECTION_OK) {
-		log_warnx("warn: PQconnectdb: %s",
-		    PQerrorMessage(conf->db));
-		goto end;
+	if ((value = dict_get(&conf->conf, "snapshot_refresh"))) {
+		e = NULL;
+		ll = strtonum(value, 1, INT_MAX / 1000, &e);
+		if (e) {
+			log_warnx("warn: bad value for snapshot_refresh: %s", e);
+			goto end;
+		}
+		conf->snap_refresh = ll;
 	}
-
-	for (i = 0; i < SQL_MAX; i++) {
-		q = dict_get(&conf->conf, qspec[i].name);
-		if (q && (conf->statements[i] = table_postgres_prepare_stmt(
-		    conf->db, q, 1, qspec[i].cols)) == NULL)
+	if ((value = dict_get(&conf->conf, "snapshot_reconcile"))) {
+		e = NULL;
+		ll = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for snapshot_reconcile: %s",
+			    e);
 			goto end;
+		}
+		conf->snap_reconcile = ll;
 	}
-
-	q = dict_get(&conf->conf, "fetch_source");
-	if (q && (conf->stmt_fetch_source = table_postgres_prepare_stmt(conf->db,
-	    q, 0, 1)) == NULL)
-		goto end;
-
-	log_debug("debug: connected");
-
+	if ((value = dict_get(&conf->conf, "batch_window"))) {
+		e = NULL;
+		ll = strtonum(value, 0, 1000000, &e);
+		if (e) {
+			log_warnx("warn: bad value for batch_window: %s", e);
+			goto end;
+		}
+		conf->batch_window = ll;
+	}
+	if ((value = dict_get(&conf->conf, "batch_size"))) {
+		e = NULL;
+		ll = strtonum(value, 1, 100000, &e);
+		if (e) {
+			log_warnx("warn: bad value for batch_size: %s", e);
+			goto end;
+		}
+		conf->batch_size = ll;
+	}
+	if ((value = dict_get(&conf->conf, "cache_ttl_column"))) {
+		if (!strcmp(value, "yes"))
+			conf->ttl_column = 1;
+		else if (strcmp(value, "no") != 0) {
+			log_warnx("warn: bad value for cache_ttl_column: %s",
+			    value);
+			goto end;
+		}
+	}
+	if ((value = dict_get(&conf->conf, "domain_gate"))) {
+		if (!strcmp(value, "yes"))
+			conf->domain_gate = 1;
+		else if (strcmp(value, "no") != 0) {
+			log_warnx("warn: bad value for domain_gate: %s", value);
+			goto end;
+		}
+	}
+	if ((value = dict_get(&conf->conf, "pooler_mode"))) {
+		if (!strcmp(value, "yes"))
+			conf->pooler = 1;
+		else if (strcmp(value, "no") != 0) {
+			log_warnx("warn: bad value for pooler_mode: %s", value);
+			goto end;
+		}
+	}
+
+	ttl = 0;
+	if ((value = dict_get(&conf->conf, "cache_ttl"))) {
+		e = NULL;
+		ttl = strtonum(value, 0, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for cache_ttl: %s", e);
+			goto end;
+		}
+	}
+	negttl = ttl;
+	if ((value = dict_get(&conf->conf, "cache_negative_ttl"))) {
+		e = NULL;
+		negttl = strtonum(value, 0, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for cache_negative_ttl: %s",
+			    e);
+			goto end;
+		}
+	}
+	csize = DEFAULT_CACHE;
+	if ((value = dict_get(&conf->conf, "cache_size"))) {
+		e = NULL;
+		csize = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for cache_size: %s", e);
+			goto end;
+		}
+	}
+	ahead = 0;
+	if ((value = dict_get(&conf->conf, "cache_refresh_ahead"))) {
+		e = NULL;
+		ahead = strtonum(value, 0, 99, &e);
+		if (e) {
+			log_warnx("warn: bad value for cache_refresh_ahead: %s",
+			    e);
+			goto end;
+		}
+	}
+	admission = 0;
+	if ((value = dict_get(&conf->conf, "cache_admission"))) {
+		if (!strcmp(value, "yes"))
+			admission = 1;
+		else if (strcmp(value, "no") != 0) {
+			log_warnx("warn: bad value for cache_admission: %s",
+			    value);
+			goto end;
+		}
+	}
+	stale = 0;
+	if ((value = dict_get(&conf->conf, "serve_stale_max"))) {
+		e = NULL;
+		stale = strtonum(value, 0, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for serve_stale_max: %s", e);
+			goto end;
+		}
+	}
+	if ((ttl || negttl || conf->ttl_column) &&
+	    (conf->cache = cache_new(csize, ttl, negttl)) == NULL)
+		goto end;
+	if (conf->cache) {
+		cache_refresh_ahead(conf->cache, ahead);
+		cache_serve_stale(conf->cache, stale);
+		if (admission && !cache_admission(conf->cache))
+			goto end;
+	}
+	conf->cache_ttl = ttl;
+	conf->cache_negttl = negttl;
+
+	/*
+	 * Every "conninfo" and "conninfo_<name>" directive is an
+	 * endpoint.  They are kept in the dict order, which is also the
+	 * order of preference until some latency figures are known.
+	 */
+	iter = NULL;
+	while (dict_iter(&conf->conf, &iter, &k, (void **)&value)) {
+		if (strcmp(k, "conninfo") != 0 &&
+		    strncmp(k, "conninfo_", 9) != 0)
+			continue;
+		ep = reallocarray(conf->endpoints, conf->nendpoints + 1,
+		    sizeof(*ep));
+		if (ep == NULL) {
+			log_warn("warn: reallocarray");
+			goto end;
+		}
+		conf->endpoints = ep;
+		ep = &conf->endpoints[conf->nendpoints];
+		memset(ep, 0, sizeof(*ep));
+		if ((ep->name = strdup(k[8] ? k + 9 : "default")) == NULL) {
+			log_warn("warn: strdup");
+			goto end;
+		}
+		ep->conninfo = value;
+		ep->healthy = 1;
+		conf->nendpoints++;
+	}
+	if (conf->nendpoints == 0) {
+		log_warnx("warn: missing \"conninfo\" configuration directive");
+		goto end;
+	}
+
+	if (config_load_shards(conf) == 0)
+		goto end;
+
+	if (config_load_shmcache(conf) == 0)
+		goto end;
+
+	if (config_load_replica(conf) == 0)
+		goto end;
+
+	if (config_load_prefetch(conf) == 0)
+		goto end;
+
+	free(buf);
+	fclose(fp);
+	return conf;
+
+end:
+	free(buf);
+	fclose(fp);
+	config_free(conf);
+	return NULL;
+}
+
+/*
+ * Connect to the endpoint, giving up after CONNECT_TIMEOUT seconds
+ * unless its conninfo sets another connect_timeout.
+ */
+static PGconn *
+endpoint_open(struct endpoint *ep, int async)
+{
+	const char	*keys[] = { "connect_timeout", "dbname", NULL };
+	const char	*values[] = { CONNECT_TIMEOUT, ep->conninfo, NULL };
+
+	if (async)
+		return PQconnectStartParams(keys, values, 1);
+	return PQconnectdbParams(keys, values, 1);
+}
+
+static int
+endpoint_connect(struct config *conf, struct endpoint *ep)
+{
+	size_t		 i;
+	char		*q;
+	long long	 start;
+
+	log_debug("debug: (re)connecting to %s", ep->name);
+
+	/* Disconnect first, if needed */
+	endpoint_reset(ep);
+
+	start = now_usec();
+	ep->db = endpoint_open(ep, 0);
+	if (ep->db == NULL) {
+		log_warnx("warn: PQconnectdb return NULL");
+		goto end;
+	}
+	if (PQstatus(ep->db) != CONNECTION_OK) {
+		log_warnx("warn: PQconnectdb: %s: %s", ep->name,
+		    PQerrorMessage(ep->db));
+		goto end;
+	}
+
+	/*
+	 * Behind a pooler in transaction mode, the session might not be
+	 * the same from a query to the next, so nothing is prepared.
+	 */
+	if (conf->pooler)
+		goto done;
+
+	for (i = 0; i < SQL_MAX; i++) {
+		q = dict_get(&conf->conf, qspec[i].name);
+		if (q && (ep->statements[i] = table_postgres_prepare_stmt(
+		    ep->db, q, 1, qspec[i].cols)) == NULL)
+			goto end;
+	}
+	for (i = SQL_MAX; i < STMT_MAX; i++) {
+		q = dict_get(&conf->conf, xspec[i - SQL_MAX].name);
+		if (q && (ep->statements[i] = table_postgres_prepare_stmt(
+		    ep->db, q, 1, xspec[i - SQL_MAX].cols)) == NULL)
+			goto end;
+	}
+
+done:
+	endpoint_sample(ep, start);
+	ep->healthy = 1;
+
+	log_debug("debug: connected to %s", ep->name);
+
+	return 1;
+
+    end:
+	endpoint_reset(ep);
+	ep->healthy = 0;
+	return 0;
+}
+
+/*
+ * Route the requests of the shard to its fastest healthy endpoint.  The
+ * probes find an endpoint healthy before it has a connection, which is
+ * opened when it is first used.
+ */
+static void
+shard_select(struct shard *sh)
+{
+	struct endpoint	*ep;
+	size_t		 i;
+
+	sh->ep = NULL;
+	for (i = 0; i < sh->nendpoints; i++) {
+		ep = sh->endpoints[i];
+		if (!ep->healthy)
+			continue;
+		if (sh->ep == NULL || ep->latency < sh->ep->latency)
+			sh->ep = ep;
+	}
+
+	if (sh->ep)
+		log_debug("debug: shard %s using endpoint %s (%lldus)",
+		    sh->name, sh->ep->name, sh->ep->latency);
+}
+
+static void
+config_select(struct config *conf)
+{
+	size_t	 i;
+
+	for (i = 0; i < conf->nshards; i++)
+		shard_select(&conf->shards[i]);
+}
+
+static int
+config_connect(struct config *conf)
+{
+	size_t	 i;
+	int	 r = 0;
+
+	for (i = 0; i < conf->nendpoints; i++)
+		r |= endpoint_connect(conf, &conf->endpoints[i]);
+	config_select(conf);
+
+	return r;
+}
+
+/*
+ * Return the shard owning the key: the one mapped to its domain part,
+ * if any, or the next one on the hash ring.
+ */
+static struct shard *
+config_shard(struct config *conf, const char *key)
+{
+	struct shard	*sh;
+	const char	*dom;
+	char		 buf[LINE_MAX];
+	uint32_t	 h;
+	size_t		 lo, hi, mid;
+
+	if (conf->nshards == 1)
+		return &conf->shards[0];
+
+	if ((dom = strrchr(key, '@')) != NULL && dom[1] != '\0')
+		dom++;
+	else
+		dom = key;
+	if (!lowercase(buf, dom, sizeof(buf)))
+		return &conf->shards[0];
+
+	if ((sh = dict_get(&conf->shard_map, buf)) != NULL)
+		return sh;
+
+	h = hash_str(buf);
+	lo = 0;
+	hi = conf->nring;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (conf->ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == conf->nring)
+		lo = 0;
+	return conf->ring[lo].shard;
+}
+
+/*
+ * Return the endpoint to send the queries of the shard to, trying to
+ * (re)connect its endpoints in order if none is usable.
+ */
+static struct endpoint *
+config_endpoint(struct config *conf, struct shard *sh)
+{
+	size_t	 i;
+
+	if (sh->ep && sh->ep->db && sh->ep->healthy)
+		return sh->ep;
+
+	/* a failed connection makes the endpoint unhealthy */
+	shard_select(sh);
+	while (sh->ep && sh->ep->db == NULL && !endpoint_connect(conf, sh->ep))
+		shard_select(sh);
+	if (sh->ep)
+		return sh->ep;
+
+	for (i = 0; i < sh->nendpoints; i++)
+		if (endpoint_connect(conf, sh->endpoints[i])) {
+			sh->ep = sh->endpoints[i];
+			break;
+		}
+
+	return sh->ep;
+}
+
+static void
+config_fail(struct config *conf, struct endpoint *ep)
+{
+	size_t	 i;
+
+	endpoint_reset(ep);
+	ep->healthy = 0;
+	for (i = 0; i < conf->nshards; i++)
+		if (conf->shards[i].ep == ep)
+			conf->shards[i].ep = NULL;
+}
+
+static void	table_postgres_probe_io(int, void *);
+
+static void
+probe_watch(struct endpoint *ep, int events)
+{
+	int	 fd;
+
+	fd = PQsocket(ep->probe);
+	if (ep->pstate != PROBE_IDLE && ep->pfd != fd)
+		table_api_watch(ep->pfd, NULL, NULL);
+	ep->pfd = fd;
+	table_api_watch(fd, table_postgres_probe_io, ep);
+	table_api_watch_events(fd, events);
+}
+
+static void
+probe_end(struct endpoint *ep, int ok)
+{
+	if (ep->pstate != PROBE_IDLE)
+		table_api_watch(ep->pfd, NULL, NULL);
+	ep->pstate = PROBE_IDLE;
+
+	if (ok) {
+		endpoint_sample(ep, ep->pstart);
+		ep->healthy = 1;
+	} else {
+		PQfinish(ep->probe);
+		ep->probe = NULL;
+		config_fail(config, ep);
+	}
+	config_select(config);
+}
+
+static void
+probe_send(struct endpoint *ep)
+{
+	ep->pstart = now_usec();
+	if (PQsetnonblocking(ep->probe, 1) == -1 ||
+	    !PQsendQuery(ep->probe, "SELECT 1")) {
+		log_warnx("warn: probe of %s failed: %s", ep->name,
+		    PQerrorMessage(ep->probe));
+		probe_end(ep, 0);
+		return;
+	}
+	probe_watch(ep, POLLIN | POLLOUT);
+	ep->pstate = PROBE_QUERY;
+}
+
+/*
+ * Go on with the probe of the endpoint: establish its connection, then
+ * time a query.
+ */
+static void
+table_postgres_probe_io(int fd, void *arg)
+{
+	struct endpoint	*ep = arg;
+	PGresult	*res;
+	int		 ok, r;
+
+	if (ep->pstate == PROBE_CONNECT) {
+		switch (PQconnectPoll(ep->probe)) {
+		case PGRES_POLLING_READING:
+			probe_watch(ep, POLLIN);
+			break;
+		case PGRES_POLLING_WRITING:
+			probe_watch(ep, POLLOUT);
+			break;
+		case PGRES_POLLING_OK:
+			probe_send(ep);
+			break;
+		default:
+			log_warnx("warn: probe of %s failed: %s", ep->name,
+			    PQerrorMessage(ep->probe));
+			probe_end(ep, 0);
+			break;
+		}
+		return;
+	}
+
+	if ((r = PQflush(ep->probe)) == -1 || !PQconsumeInput(ep->probe))
+		goto fail;
+	if (r == 0)
+		table_api_watch_events(fd, POLLIN);
+	if (PQisBusy(ep->probe))
+		return;
+
+	ok = 0;
+	while ((res = PQgetResult(ep->probe)) != NULL) {
+		ok = ok || PQresultStatus(res) == PGRES_TUPLES_OK;
+		PQclear(res);
+	}
+	if (ok) {
+		probe_end(ep, 1);
+		return;
+	}
+
+fail:
+	log_warnx("warn: probe of %s failed: %s", ep->name,
+	    PQerrorMessage(ep->probe));
+	probe_end(ep, 0);
+}
+
+/* Fail the endpoints that did not answer their probe in time. */
+static void
+table_postgres_probe_expire(void *arg)
+{
+	struct endpoint	*ep;
+	size_t		 i;
+
+	(void)arg;
+
+	for (i = 0; i < config->nendpoints; i++) {
+		ep = &config->endpoints[i];
+		if (ep->pstate == PROBE_IDLE)
+			continue;
+		log_warnx("warn: probe of %s timed out", ep->name);
+		probe_end(ep, 0);
+	}
+}
+
+/*
+ * Probe the endpoints in the background, each on a connection of its
+ * own so that the lookups never wait for a probe.
+ */
+static void
+table_postgres_probe(void *arg)
+{
+	struct endpoint	*ep;
+	size_t		 i;
+
+	(void)arg;
+
+	if (config->nendpoints < 2) {
+		probing = 0;
+		return;
+	}
+
+	for (i = 0; i < config->nendpoints; i++) {
+		ep = &config->endpoints[i];
+		if (ep->pstate != PROBE_IDLE)
+			continue;
+		if (ep->probe && PQstatus(ep->probe) == CONNECTION_OK) {
+			probe_send(ep);
+			continue;
+		}
+
+		PQfinish(ep->probe);
+		if ((ep->probe = endpoint_open(ep, 1)) == NULL ||
+		    PQstatus(ep->probe) == CONNECTION_BAD) {
+			log_warnx("warn: probe of %s failed: %s", ep->name,
+			    ep->probe ? PQerrorMessage(ep->probe) :
+			    "out of memory");
+			probe_end(ep, 0);
+			continue;
+		}
+		ep->pstart = now_usec();
+		probe_watch(ep, POLLOUT);
+		ep->pstate = PROBE_CONNECT;
+	}
+
+	/* the probes of a round expire before the next one */
+	table_api_add_timer((config->probe_interval < PROBE_TIMEOUT ?
+	    config->probe_interval : PROBE_TIMEOUT) * 1000,
+	    table_postgres_probe_expire, NULL);
+	table_api_add_timer(config->probe_interval * 1000,
+	    table_postgres_probe, NULL);
+}
+
+static void
+table_postgres_schedule_probe(void)
+{
+	if (probing || config->nendpoints < 2)
+		return;
+	probing = 1;
+	table_api_add_timer(config->probe_interval * 1000,
+	    table_postgres_probe, NULL);
+}
+
+static void	table_postgres_replica_start(void *);
+
+static void
+table_postgres_replica_stop(void *arg)
+{
+	(void)arg;
+
+	table_api_add_timer(config->probe_interval * 1000,
+	    table_postgres_replica_start, NULL);
+}
+
+/*
+ * Start the replica, and retry later if the database is not there.
+ * Lookups go to the database in the meantime.
+ */
+static void
+table_postgres_replica_start(void *arg)
+{
+	(void)arg;
+
+	if (config->replica == NULL || broker_fd != -1 ||
+	    replica_active(config->replica))
+		return;
+
+	if (!replica_start(config->replica, table_postgres_replica_stop,
+	    NULL))
+		table_postgres_replica_stop(NULL);
+}
+
+/*
+ * Format the value columns of a row, starting at column first, the way
+ * a lookup returns them.
+ */
+static int
+table_postgres_format_row(char **fields, int nfields, int first, char *dst,
+    size_t sz)
+{
+	int	 i;
+
+	dst[0] = '\0';
+	for (i = first; i < nfields; i++) {
+		if (i > first && strlcat(dst, ":", sz) >= sz)
+			return 0;
+		if (strlcat(dst, fields[i], sz) >= sz)
+			return 0;
+	}
+	return 1;
+}
+
+struct bulk {
+	struct snapshot	*snap;
+	int		 first;		/* first value column */
+	char		*mark;		/* watermark of the last row */
+};
+
+/*
+ * Store a row of a snapshot as it streams in.  With a watermark, it is
+ * the column that follows the key.
+ */
+static int
+table_postgres_bulk_row(char **fields, int nfields, void *arg)
+{
+	struct bulk	*b = arg;
+	char		 buf[LINE_MAX];
+
+	if (nfields < b->first) {
+		log_warnx("warn: snapshot query returns too few columns");
+		return 0;
+	}
+	if (b->first == 2) {
+		free(b->mark);
+		if ((b->mark = strdup(fields[1])) == NULL) {
+			log_warn("warn: strdup");
+			return 0;
+		}
+	}
+	if (!table_postgres_format_row(fields, nfields, b->first, buf,
+	    sizeof(buf))) {
+		log_warnx("warn: snapshot value too large for %s", fields[0]);
+		return 1;
+	}
+
+	return snapshot_add(b->snap, fields[0], buf);
+}
+
+/*
+ * Run the bulk query of a snapshot on every shard, and collect the
+ * values by key.  If marks is not NULL, the rows carry a watermark and
+ * the last one of each shard is kept there.
+ */
+static int
+table_postgres_bulk(const char *query, struct snapshot *snap, char **marks)
+{
+	struct bulk	 b;
+	struct shard	*sh;
+	struct endpoint	*ep;
+	size_t		 i;
+	int		 r, retries;
+
+	b.snap = snap;
+	b.first = marks ? 2 : 1;
+
+	for (i = 0; i < config->nshards; i++) {
+		sh = &config->shards[i];
+		retries = sh->nendpoints;
+		b.mark = NULL;
+	retry:
+		if ((ep = config_endpoint(config, sh)) == NULL)
+			return 0;
+
+		r = copy_exec(ep->db, query, table_postgres_bulk_row, &b);
+		if (r == -1) {
+			config_fail(config, ep);
+			if (retries-- > 0)
+				goto retry;
+		}
+		if (r != 1) {
+			free(b.mark);
+			return 0;
+		}
+		if (marks) {
+			free(marks[i]);
+			marks[i] = b.mark;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * A load builds the next generation of a snapshot from each shard in
+ * turn, on connections of its own and in between requests, while the
+ * current generation keeps answering.  It is published once the last
+ * shard is done, and simply dropped if a shard fails.
+ */
+struct load {
+	struct load	**owner;	/* cleared when the load is over */
+	const char	 *query;
+	size_t		  shard;
+	struct bulk	  b;
+	char		**marks;	/* watermark of each shard, or NULL */
+	int		  changes;	/* only the rows past the marks */
+	struct copy	 *copy;
+	void		(*publish)(struct load *);
+	int		  index;
+	int		  lockfd;
+	char		 *path;		/* of the snapshot file */
+	struct sst_writer *w;		/* of the shard being loaded */
+	char		 *key;		/* the entry not written yet */
+	char		 *value;
+	size_t		  nkeys;
+};
+
+static void
+load_free(struct load *l)
+{
+	size_t	 i;
+
+	if (l == NULL)
+		return;
+
+	copy_abort(l->copy);
+	*l->owner = NULL;
+	snapshot_free(l->b.snap);
+	free(l->b.mark);
+	for (i = 0; l->marks && i < config->nshards; i++)
+		free(l->marks[i]);
+	free(l->marks);
+	if (l->lockfd != -1)
+		close(l->lockfd);
+	free(l->path);
+	if (l->w)
+		sst_writer_close(l->w, 0);
+	free(l->key);
+	free(l->value);
+	free(l);
+}
+
+static void	load_done(int, void *);
+static int	table_postgres_sst_row(struct load *, char **, int);
+static int	table_postgres_sst_flush(struct load *);
+
+static int
+load_row(char **fields, int nfields, void *arg)
+{
+	struct load	*l = arg;
+
+	if (l->path)
+		return table_postgres_sst_row(l, fields, nfields);
+	return table_postgres_bulk_row(fields, nfields, &l->b);
+}
+
+/*
+ * Start the copy of the next shard.  Return 1 if it started, 0 if it
+ * failed, or -1 if there is none left.
+ */
+static int
+load_next(struct load *l)
+{
+	struct endpoint	*ep;
+	const char	*param = NULL;
+
+	/* a shard that had no rows has no mark yet to start from */
+	while (l->changes && l->shard < config->nshards &&
+	    l->marks[l->shard] == NULL)
+		l->shard++;
+	if (l->shard == config->nshards)
+		return -1;
+
+	if ((ep = config_endpoint(config, &config->shards[l->shard])) == NULL)
+		return 0;
+
+	if (l->changes)
+		param = l->marks[l->shard];
+	l->b.mark = NULL;
+	l->copy = copy_start(ep->conninfo, l->query, param, load_row,
+	    load_done, l);
+	return l->copy != NULL;
+}
+
+static void
+load_done(int ok, void *arg)
+{
+	struct load	*l = arg;
+
+	l->copy = NULL;
+	if (ok && l->path)
+		ok = table_postgres_sst_flush(l);
+	if (!ok) {
+		log_warnx("warn: snapshot load failed, keeping the current one");
+		load_free(l);
+		return;
+	}
+
+	/* a shard without changes keeps its mark */
+	if (l->marks && l->b.mark) {
+		free(l->marks[l->shard]);
+		l->marks[l->shard] = l->b.mark;
+		l->b.mark = NULL;
+	}
+	l->shard++;
+	switch (load_next(l)) {
+	case 1:
+		return;
+	case 0:
+		load_free(l);
+		return;
+	}
+
+	l->publish(l);
+	load_free(l);
+}
+
+/*
+ * Start loading the query into a new snapshot, to be published by the
+ * callback.  If from is not NULL, only the changes past these marks
+ * are loaded, the query taking the mark of each shard as $1.  The load
+ * is tracked in *owner until it is over.  Return NULL if it failed, or
+ * if it is already over.
+ */
+static struct load *
+load_start(struct load **owner, const char *query, int index, int watermark,
+    char **from, void (*publish)(struct load *))
+{
+	struct load	*l;
+	size_t		 i;
+	int		 r;
+
+	if ((l = calloc(1, sizeof(*l))) == NULL) {
+		log_warn("warn: calloc");
+		return NULL;
+	}
+	l->owner = owner;
+	*owner = l;
+	l->query = query;
+	l->index = index;
+	l->publish = publish;
+	l->lockfd = -1;
+	l->b.first = watermark ? 2 : 1;
+	l->b.snap = snapshot_new(index == SQL_ALIAS ||
+	    index == SQL_MAILADDRMAP);
+	if (watermark || from)
+		l->marks = calloc(config->nshards, sizeof(*l->marks));
+	if (l->b.snap == NULL || ((watermark || from) && l->marks == NULL)) {
+		load_free(l);
+		return NULL;
+	}
+
+	if (from) {
+		l->changes = 1;
+		l->b.first = 2;
+		for (i = 0; i < config->nshards; i++) {
+			if (from[i] == NULL)
+				continue;
+			if ((l->marks[i] = strdup(from[i])) == NULL) {
+				log_warn("warn: strdup");
+				load_free(l);
+				return NULL;
+			}
+		}
+	}
+
+	if ((r = load_next(l)) != 1) {
+		if (r == -1)
+			l->publish(l);
+		load_free(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+/*
+ * The snapshot file of a shard: the path itself when there is only one
+ * shard, or the path followed by the name of the shard.
+ */
+static int
+table_postgres_sst_path(const char *path, size_t shard, char *buf, size_t sz)
+{
+	int	 r;
+
+	if (config->nshards == 1)
+		r = snprintf(buf, sz, "%s", path);
+	else
+		r = snprintf(buf, sz, "%s.%s", path, config->shards[shard].name);
+	if (r < 0 || (size_t)r >= sz) {
+		log_warnx("warn: snapshot path too long: %s", path);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Write a row of a snapshot file as it streams in.  The query returns
+ * the rows ordered by key, so the values of a key come together: the
+ * entry is held until the next key shows up, and the values of the
+ * services that take several are joined meanwhile.
+ */
+static int
+table_postgres_sst_row(struct load *l, char **fields, int nfields)
+{
+	char	 buf[LINE_MAX], path[PATH_MAX], *v;
+
+	if (nfields < 1) {
+		log_warnx("warn: snapshot query returns too few columns");
+		return 0;
+	}
+	if (!table_postgres_format_row(fields, nfields, 1, buf, sizeof(buf))) {
+		log_warnx("warn: snapshot value too large for %s", fields[0]);
+		return 1;
+	}
+
+	if (l->w == NULL) {
+		if (!table_postgres_sst_path(l->path, l->shard, path,
+		    sizeof(path)) || (l->w = sst_writer_open(path)) == NULL)
+			return 0;
+	}
+
+	if (l->key && strcmp(l->key, fields[0]) == 0) {
+		if (l->index != SQL_ALIAS && l->index != SQL_MAILADDRMAP)
+			return 1;
+		if (asprintf(&v, "%s, %s", l->value, buf) == -1) {
+			log_warn("warn: asprintf");
+			return 0;
+		}
+		free(l->value);
+		l->value = v;
+		return 1;
+	}
+
+	if (l->key && !sst_writer_add(l->w, l->key, l->value))
+		return 0;
+	free(l->key);
+	free(l->value);
+	l->value = NULL;
+	if ((l->key = strdup(fields[0])) == NULL ||
+	    (l->value = strdup(buf)) == NULL) {
+		log_warn("warn: strdup");
+		return 0;
+	}
+	l->nkeys++;
+
+	return 1;
+}
+
+/*
+ * Write the last entry of the shard and move its file in place.
+ */
+static int
+table_postgres_sst_flush(struct load *l)
+{
+	char	 path[PATH_MAX];
+	int	 r;
+
+	if (l->w == NULL) {
+		if (!table_postgres_sst_path(l->path, l->shard, path,
+		    sizeof(path)) || (l->w = sst_writer_open(path)) == NULL)
+			return 0;
+	}
+
+	r = l->key == NULL || sst_writer_add(l->w, l->key, l->value);
+	r = sst_writer_close(l->w, r);
+	l->w = NULL;
+	free(l->key);
+	free(l->value);
+	l->key = l->value = NULL;
+
+	return r;
+}
+
+static void
+table_postgres_sst_publish(struct load *l)
+{
+	char	 path[PATH_MAX];
+	size_t	 i;
+
+	log_debug("debug: built snapshot %s with %zu keys", l->path, l->nkeys);
+
+	if (config->sst[l->index] == NULL)
+		return;
+	for (i = 0; i < config->nshards; i++) {
+		if (!table_postgres_sst_path(l->path, i, path, sizeof(path)))
+			continue;
+		sst_close(config->sst[l->index][i]);
+		config->sst[l->index][i] = sst_open(path);
+	}
+}
+
+/*
+ * Build the snapshot of the service, unless another process of the
+ * host is already doing it.  The lock is held until the load is over.
+ */
+static void
+table_postgres_sst_build(int i, const char *path, const char *query)
+{
+	struct load	*l;
+	char		 lock[PATH_MAX];
+	int		 fd;
+
+	if (config->sst_load[i])
+		return;
+
+	if (snprintf(lock, sizeof(lock), "%s.lock", path) >= (int)sizeof(lock))
+		return;
+	if ((fd = open(lock, O_RDWR | O_CREAT, 0600)) == -1) {
+		log_warn("warn: %s", lock);
+		return;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		return;
+	}
+
+	if ((l = load_start(&config->sst_load[i], query, i, 0, NULL,
+	    table_postgres_sst_publish)) == NULL) {
+		close(fd);
+		return;
+	}
+	l->lockfd = fd;
+	if ((l->path = strdup(path)) == NULL) {
+		log_warn("warn: strdup");
+		load_free(l);
+	}
+}
+
+/*
+ * Rebuild the snapshots that are too old, and map the ones that changed
+ * on disk, possibly rebuilt by another process.
+ */
+static void
+table_postgres_sst_update(void)
+{
+	struct stat	 sb;
+	char		 key[64], file[PATH_MAX];
+	const char	*path, *query;
+	size_t		 j;
+	int		 i, stale;
+
+	for (i = 0; i < SQL_MAX; i++) {
+		(void)snprintf(key, sizeof(key), "sst_%s", qspec[i].name + 6);
+		if ((path = dict_get(&config->conf, key)) == NULL)
+			continue;
+		(void)snprintf(key, sizeof(key), "sst_query_%s",
+		    qspec[i].name + 6);
+		query = dict_get(&config->conf, key);
+
+		if (config->sst[i] == NULL &&
+		    (config->sst[i] = calloc(config->nshards,
+		    sizeof(*config->sst[i]))) == NULL) {
+			log_warn("warn: calloc");
+			continue;
+		}
+
+		stale = 0;
+		for (j = 0; j < config->nshards; j++) {
+			if (!table_postgres_sst_path(path, j, file,
+			    sizeof(file)))
+				break;
+			if (stat(file, &sb) == -1 ||
+			    sb.st_mtime + config->sst_refresh <= time(NULL))
+				stale = 1;
+			if (sst_changed(config->sst[i][j], file)) {
+				sst_close(config->sst[i][j]);
+				config->sst[i][j] = sst_open(file);
+			}
+		}
+
+		if (query && broker_fd == -1 && stale)
+			table_postgres_sst_build(i, path, query);
+	}
+}
+
+static void
+table_postgres_sst_timer(void *arg)
+{
+	(void)arg;
+
+	table_postgres_sst_update();
+	table_api_add_timer(SST_CHECK * 1000, table_postgres_sst_timer, NULL);
+}
+
+/*
+ * Answer from the snapshot of the service, if the key is in there.
+ * Keys missing from it may be newer, so they are left to the database.
+ */
+static int
+table_postgres_sst_get(int service, const char *key, char *dst, size_t sz)
+{
+	struct sst	*t;
+	int		 i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX || config->sst[i] == NULL)
+		return -1;
+
+	t = config->sst[i][config_shard(config, key) - config->shards];
+	if (t && sst_get(t, key, dst, sz) == 1)
+		return 1;
+	return -1;
+}
+
+/*
+ * Some keys are patterns rather than plain keys, so the snapshot is
+ * indexed for them: the netaddr blocks in a radix tree for the longest
+ * prefix match, the domains in a trie of labels for the wildcards.
+ */
+static void
+table_postgres_snapshot_insert(int i, struct snapshot *snap,
+    struct radix *net, struct trie *names)
+{
+	const char	*k, *v;
+	void		*iter;
+	int		 ok;
+
+	iter = NULL;
+	while (snapshot_iter(snap, &iter, &k, &v)) {
+		ok = net ? radix_insert(net, k, v) : trie_insert(names, k, v);
+		if (!ok)
+			log_warnx("warn: bad %s in snapshot: %s",
+			    qspec[i].name + 6, k);
+	}
+}
+
+static void
+table_postgres_snapshot_index(int i)
+{
+	struct snapsvc	*ss = &config->snaps[i];
+	struct radix	*net = NULL;
+	struct trie	*names = NULL;
+
+	if (i == SQL_NETADDR && (net = radix_new()) == NULL)
+		return;
+	if (i == SQL_DOMAIN && (names = trie_new()) == NULL)
+		return;
+	if (net == NULL && names == NULL)
+		return;
+
+	table_postgres_snapshot_insert(i, ss->cur, net, names);
+
+	if (net) {
+		radix_free(ss->net);
+		ss->net = net;
+	} else {
+		trie_free(ss->names);
+		ss->names = names;
+	}
+}
+
+static void
+table_postgres_snapshot_publish(struct load *l)
+{
+	struct snapsvc	*ss = &config->snaps[l->index];
+	size_t		 j;
+
+	log_debug("debug: loaded %zu keys in the %s snapshot",
+	    snapshot_count(l->b.snap), qspec[l->index].name + 6);
+
+	snapshot_publish(&ss->cur, l->b.snap);
+	l->b.snap = NULL;
+	for (j = 0; ss->marks && j < config->nshards; j++)
+		free(ss->marks[j]);
+	free(ss->marks);
+	ss->marks = l->marks;
+	l->marks = NULL;
+	ss->loaded = time(NULL);
+
+	table_postgres_snapshot_index(l->index);
+}
+
+/*
+ * Make the next generation of the snapshot out of the rows changed on
+ * each shard past its watermark, and insert them into its index.
+ */
+static void
+table_postgres_snapshot_changes(struct load *l)
+{
+	struct snapsvc	*ss = &config->snaps[l->index];
+	struct snapshot	*next;
+	size_t		 j, n;
+
+	if ((n = snapshot_count(l->b.snap)) > 0) {
+		if (ss->net || ss->names)
+			table_postgres_snapshot_insert(l->index, l->b.snap,
+			    ss->net, ss->names);
+		if ((next = snapshot_next(ss->cur, l->b.snap)) == NULL)
+			return;
+		snapshot_publish(&ss->cur, next);
+		log_debug("debug: %zu keys changed in the %s snapshot", n,
+		    qspec[l->index].name + 6);
+	}
+
+	for (j = 0; j < config->nshards; j++)
+		free(ss->marks[j]);
+	free(ss->marks);
+	ss->marks = l->marks;
+	l->marks = NULL;
+}
+
+/*
+ * Bring the snapshots held in memory up to date, incrementally when
+ * there is a changes query, and fully once in a while to catch up with
+ * the deleted rows.
+ */
+static void
+table_postgres_snapshot_update(void)
+{
+	struct snapsvc	*ss;
+	char		 key[64];
+	const char	*query, *changes;
+	int		 i;
+
+	if (broker_fd != -1)
+		return;
+
+	for (i = 0; i < SQL_MAX; i++) {
+		if (i == SQL_SOURCE)
+			continue;
+		(void)snprintf(key, sizeof(key), "snapshot_query_%s",
+		    qspec[i].name + 6);
+		if ((query = dict_get(&config->conf, key)) == NULL)
+			continue;
+		(void)snprintf(key, sizeof(key), "snapshot_changes_%s",
+		    qspec[i].name + 6);
+		changes = dict_get(&config->conf, key);
+
+		ss = &config->snaps[i];
+		if (ss->load)
+			continue;
+		if (ss->cur == NULL || changes == NULL ||
+		    time(NULL) - ss->loaded >= config->snap_reconcile)
+			load_start(&ss->load, query, i, 1, NULL,
+			    table_postgres_snapshot_publish);
+		else
+			load_start(&ss->load, changes, i, 1, ss->marks,
+			    table_postgres_snapshot_changes);
+	}
+}
+
+static void
+table_postgres_snapshot_timer(void *arg)
+{
+	(void)arg;
+
+	table_postgres_snapshot_update();
+	table_api_add_timer(config->snap_refresh * 1000,
+	    table_postgres_snapshot_timer, NULL);
+}
+
+static int
+table_postgres_snapshot_get(int service, const char *key, char *dst,
+    size_t sz)
+{
+	const char	*v;
+	int		 i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX || config->snaps[i].cur == NULL)
+		return -1;
+
+	if (i != SQL_NETADDR && i != SQL_DOMAIN)
+		return snapshot_get(config->snaps[i].cur, key, dst, sz);
+
+	if (i == SQL_NETADDR && config->snaps[i].net)
+		v = radix_match(config->snaps[i].net, key);
+	else if (i == SQL_DOMAIN && config->snaps[i].names)
+		v = trie_match(config->snaps[i].names, key);
+	else
+		return -1;
+	if (v == NULL)
+		return 0;
+	if (dst && strlcpy(dst, v, sz) >= sz)
+		return -1;
 	return 1;
+}
 
-    end:
-	config_reset(conf);
-	return 0;
+/*
+ * Tell whether the address is for a domain the snapshot of the domain
+ * service does not know, so that it cannot be found either.
+ */
+static int
+table_postgres_gated(int service, const char *key)
+{
+	struct trie	*names = config->snaps[SQL_DOMAIN].names;
+	const char	*d;
+
+	if (!config->domain_gate || names == NULL)
+		return 0;
+	if (service != K_ALIAS && service != K_MAILADDR &&
+	    service != K_MAILADDRMAP)
+		return 0;
+	if ((d = strrchr(key, '@')) == NULL)
+		return 0;
+
+	return trie_match(names, d + 1) == NULL;
+}
+
+/*
+ * Forward the request to the broker, if one is configured and
+ * reachable.  Return 0 if the request has to be served locally, which
+ * it is for a while once the broker is lost.
+ */
+static int
+table_postgres_forward(int type, int service, const char *key, char *dst,
+    size_t sz, int *r)
+{
+	const char	*path;
+
+	if (broker_mode ||
+	    (path = dict_get(&config->conf, "broker_socket")) == NULL)
+		return 0;
+
+	if (broker_fd == -1) {
+		if (now_usec() < broker_retry)
+			return 0;
+		if ((broker_fd = broker_connect(path)) == -1)
+			return 0;
+	}
+
+	*r = broker_request(broker_fd, config->tag, type, service, key, dst,
+	    sz);
+	if (*r == -2) {
+		log_warnx("warn: lost the broker, serving locally");
+		close(broker_fd);
+		broker_fd = -1;
+		broker_retry = now_usec() + BROKER_RETRY * 1000000LL;
+		return 0;
+	}
+
+	return 1;
 }
 
 static int
 table_postgres_update(void)
 {
 	struct config	*c;
+	int		 r, forwarded;
+
+	/* the broker reloads its own configuration first */
+	forwarded = table_postgres_forward(BROKER_UPDATE, 0, NULL, NULL, 0, &r);
+	if (forwarded && r != 1)
+		return 0;
 
 	if ((c = config_load(conffile)) == NULL)
 		return 0;
-	if (config_connect(c) == 0) {
+	if (!forwarded && config_connect(c) == 0) {
 		config_free(c);
 		return 0;
 	}
 
 	config_free(config);
 	config = c;
+	broker_retry = 0;
+	table_postgres_schedule_probe();
+	table_postgres_sst_update();
+	table_postgres_snapshot_update();
+	table_postgres_replica_start(NULL);
+	table_api_batch_window(config->batch_window, config->batch_size);
+
+	/* the other processes must not serve what was there either */
+	if (config->shmcache)
+		shmcache_flush(config->shmcache);
 
 	return 1;
 }
 
+/*
+ * Run the statement q, prepared in slot i, with its parameter on the
+ * shard.
+ */
 static PGresult *
-table_postgres_query(const char *key, int service)
+table_postgres_exec(struct shard *sh, int i, const char *q,
+    const char *param)
 {
+	struct endpoint	*ep;
 	PGresult	*res;
 	const char	*errfld;
-	char		*stmt;
-	int		 i, retries = 1;
+	int		 retries;
+	long long	 start;
+
+	retries = sh->nendpoints;
 
 retry:
-	stmt = NULL;
-	for (i = 0; i < SQL_MAX; i++) {
-		if (service == 1 << i) {
-			stmt = config->statements[i];
-			break;
-		}
-	}
-	if (stmt == NULL)
+	if ((ep = config_endpoint(config, sh)) == NULL) {
+		db_down = 1;
 		return NULL;
+	}
 
-	res = PQexecPrepared(config->db, stmt, 1, &key, NULL, NULL, 0);
+	start = now_usec();
+	res = endpoint_exec(config, ep, &ep->statements[i], q, 1, &param);
+	endpoint_sample(ep, start);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		errfld = PQresultErrorField(res, PG_DIAG_SQLSTATE);
 		/* PQresultErrorField can return NULL if the connection to the server
 		   suddenly closed (e.g. server restart) */
 		if (errfld == NULL || (errfld[0] == '0' && errfld[1] == '8')) {
-			log_warnx("warn: table-postgres: trying to reconnect after error: %s",
-			    PQerrorMessage(config->db));
+			log_warnx("warn: table-postgres: %s failed, trying another endpoint after error: %s",
+			    ep->name, PQerrorMessage(ep->db));
 			PQclear(res);
-			if (config_connect(config) && retries-- > 0)
+			config_fail(config, ep);
+			if (retries-- > 0)
 				goto retry;
-			if (retries <= 0)
-				log_warnx("warn: table-postgres: too many retries");
+			log_warnx("warn: table-postgres: too many retries");
+			db_down = 1;
 			return NULL;
 		}
-		log_warnx("warn: PQexecPrepared: %s", PQerrorMessage(config->db));
+		log_warnx("warn: PQexecPrepared: %s", PQerrorMessage(ep->db));
 		PQclear(res);
-		return NULL;
+		res = NULL;
 	}
 
+	if (db_down) {
+		db_down = 0;
+		if (stale_hits)
+			log_warnx("warn: database available again, served %llu "
+			    "stale results", stale_hits);
+		stale_hits = 0;
+	}
 	return res;
 }
 
+/*
+ * Answer from an expired cache entry while the database cannot answer
+ * at all.
+ */
+static int
+table_postgres_stale(int service, const char *key, char *dst, size_t sz)
+{
+	int	 r;
+
+	if (!db_down || config->cache == NULL ||
+	    (r = cache_get_stale(config->cache, service, key, dst, sz)) == -1)
+		return -1;
+
+	if (stale_hits++ == 0)
+		log_warnx("warn: database unavailable, serving stale results");
+	return r;
+}
+
+static PGresult *
+table_postgres_query(const char *key, int service)
+{
+	char	*q;
+	int	 i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX)
+		return NULL;
+	if ((q = dict_get(&config->conf, qspec[i].name)) == NULL)
+		return NULL;
+
+	return table_postgres_exec(config_shard(config, key), i, q, key);
+}
+
+/*
+ * Answer from what was fetched for the batch being handled, if the
+ * key was.  A NULL dst means a check.
+ */
 static int
-table_postgres_check(int service, struct dict *params, const char *key)
+table_postgres_batch_get(int service, const char *key, char *dst, size_t sz,
+    int *ttl)
 {
-	PGresult	*res;
-	int		 r;
+	int	*t, i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX)
+		return -1;
+	if (!dict_check(&batch_keys[i], key) &&
+	    (dst || !dict_check(&batch_found[i], key)))
+		return -1;
+	if ((t = dict_get(&batch_ttl[i], key)) != NULL)
+		*ttl = *t;
+	if (!dict_check(&batch_keys[i], key))
+		return 1;
+	if (batch[i] == NULL)
+		return 0;
+	return snapshot_get(batch[i], key, dst, sz);
+}
+
+/* Keep the shortest lifetime the rows of the key gave in the batch. */
+static void
+table_postgres_batch_ttl(int i, const char *key, int ttl)
+{
+	int	*t;
+
+	if (ttl == -1)
+		return;
+	if ((t = dict_get(&batch_ttl[i], key)) != NULL) {
+		if (ttl < *t)
+			*t = ttl;
+		return;
+	}
+	if ((t = malloc(sizeof(*t))) == NULL) {
+		log_warn("warn: malloc");
+		return;
+	}
+	*t = ttl;
+	dict_set(&batch_ttl[i], key, t);
+}
+
+/*
+ * Keep what a request of the batch fetched, so that the same request
+ * coming again in the batch is answered without another query.  A NULL
+ * value is the result of a check.
+ */
+static void
+table_postgres_batch_set(int service, const char *key, int r,
+    const char *value, int ttl)
+{
+	int	 i;
+
+	if (!batching || r == -1)
+		return;
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX)
+		return;
+	table_postgres_batch_ttl(i, key, ttl);
+
+	if (r == 1 && value == NULL) {
+		dict_set(&batch_found[i], key, NULL);
+		return;
+	}
+	if (batch[i] == NULL && (batch[i] = snapshot_new(0)) == NULL)
+		return;
+	/* rows a failed batch query left for the key are not complete */
+	if (snapshot_get(batch[i], key, NULL, 0) != 0 ||
+	    (r == 1 && !snapshot_add(batch[i], key, value)))
+		return;
+	dict_set(&batch_keys[i], key, NULL);
+}
 
-	if (config->db == NULL && config_connect(config) == 0)
+/*
+ * Return the lifetime the rows give in their last column, the shortest
+ * if they disagree, or -1 for the default one.
+ */
+static int
+table_postgres_row_ttl(PGresult *res)
+{
+	const char	*e;
+	int		 i, n, ttl = -1;
+
+	if (!config->ttl_column || PQnfields(res) < 2)
 		return -1;
 
+	for (i = 0; i < PQntuples(res); i++) {
+		e = NULL;
+		n = strtonum(PQgetvalue(res, i, PQnfields(res) - 1), 0, INT_MAX,
+		    &e);
+		if (e) {
+			log_warnx("warn: bad ttl column: %s", e);
+			return -1;
+		}
+		if (ttl == -1 || n < ttl)
+			ttl = n;
+	}
+	return ttl;
+}
+
+static int
+table_postgres_check_db(int service, const char *key, int *ttl)
+{
+	PGresult	*res;
+	int		 r;
+
 	res = table_postgres_query(key, service);
 	if (res == NULL)
 		return -1;
 
-	r = (PQntuples(res) == 0) ? 0 : 1;
+	r = (PQntuples(res) == 0) ? 0 : 1;
+	*ttl = table_postgres_row_ttl(res);
+
+	PQclear(res);
+
+	return r;
+}
+
+/*
+ * Identify the queries of the configuration, so that a cache file is
+ * not reused after they changed.
+ */
+static uint32_t
+table_postgres_cache_tag(void)
+{
+	uint32_t	 h = 2166136261U;
+	size_t		 i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		h = (h ^ config->qtag[i]) * 16777619U;
+	return h;
+}
+
+static void
+table_postgres_cache_save(void)
+{
+	const char	*path;
+
+	if (config->cache == NULL ||
+	    (path = dict_get(&config->conf, "cache_file")) == NULL)
+		return;
+
+	if (cache_save(config->cache, path, table_postgres_cache_tag()))
+		log_debug("debug: saved the cache to %s", path);
+}
+
+static void
+table_postgres_cache_timer(void *arg)
+{
+	(void)arg;
+
+	table_postgres_cache_save();
+	table_api_add_timer(CACHE_SAVE * 1000, table_postgres_cache_timer,
+	    NULL);
+}
+
+static int
+table_postgres_shmkey(char *buf, size_t sz, int service, const char *key)
+{
+	int	 i, r;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX)
+		return 0;
+
+	r = snprintf(buf, sz, "%x:%08x:%s", service, config->qtag[i], key);
+	return r >= 0 && (size_t)r < sz;
+}
+
+/*
+ * Look the key up in the process cache, then in the shared one.  A
+ * NULL dst means a check.
+ */
+static int
+table_postgres_cache_get(int service, const char *key, char *dst, size_t sz)
+{
+	char	 buf[LINE_MAX];
+	int	 r;
+
+	if (config->cache &&
+	    (r = cache_get(config->cache, service, key, dst, sz)) != -1) {
+		/* refresh in between requests what is about to expire */
+		if (!refreshing && cache_ndue(config->cache)) {
+			refreshing = 1;
+			table_api_add_timer(0, table_postgres_refresh, NULL);
+		}
+		return r;
+	}
+
+	if (config->shmcache &&
+	    table_postgres_shmkey(buf, sizeof(buf), service, key))
+		return shmcache_get(config->shmcache, buf, dst, sz);
+
+	return -1;
+}
+
+/*
+ * Tell if the caches hold the key, without counting it as a use: the
+ * request itself is looked up later.
+ */
+static int
+table_postgres_cache_peek(int service, const char *key)
+{
+	char	 buf[LINE_MAX];
+	int	 r;
+
+	if (config->cache &&
+	    (r = cache_peek(config->cache, service, key, NULL, 0)) != -1)
+		return r;
+
+	if (config->shmcache &&
+	    table_postgres_shmkey(buf, sizeof(buf), service, key))
+		return shmcache_get(config->shmcache, buf, NULL, 0);
+
+	return -1;
+}
+
+/*
+ * Cache the result for ttl seconds or, if it is -1, the default of
+ * the cache.
+ */
+static void
+table_postgres_cache_set_ttl(int service, const char *key, int r,
+    const char *value, int ttl)
+{
+	char	 buf[LINE_MAX];
+
+	if (config->cache)
+		cache_set(config->cache, service, key, r, value, ttl);
+
+	if (ttl == -1)
+		ttl = r ? config->cache_ttl : config->cache_negttl;
+	if (config->shmcache && ttl &&
+	    table_postgres_shmkey(buf, sizeof(buf), service, key))
+		shmcache_set(config->shmcache, buf, r, value, ttl);
+}
+
+static void
+table_postgres_cache_set(int service, const char *key, int r,
+    const char *value)
+{
+	table_postgres_cache_set_ttl(service, key, r, value, -1);
+}
+
+static int
+table_postgres_check(int service, struct dict *params, const char *key)
+{
+	int	 r, ttl = -1;
+
+	if ((r = table_postgres_sst_get(service, key, NULL, 0)) != -1)
+		return r;
+
+	if (config->replica &&
+	    (r = replica_get(config->replica, service, key, NULL, 0)) != -1)
+		return r;
+
+	if ((r = table_postgres_snapshot_get(service, key, NULL, 0)) != -1)
+		return r;
+
+	if (table_postgres_gated(service, key))
+		return 0;
+
+	if ((r = table_postgres_cache_get(service, key, NULL, 0)) != -1)
+		return r;
+
+	if ((r = table_postgres_batch_get(service, key, NULL, 0, &ttl)) == -1) {
+		if (!table_postgres_forward(BROKER_CHECK, service, key, NULL, 0,
+		    &r))
+			r = table_postgres_check_db(service, key, &ttl);
+		/* a stale result is not cached again */
+		if (r == -1 &&
+		    (r = table_postgres_stale(service, key, NULL, 0)) != -1)
+			return r;
+		table_postgres_batch_set(service, key, r, NULL, ttl);
+	}
+
+	table_postgres_cache_set_ttl(service, key, r, NULL, ttl);
+
+	return r;
+}
+
+/*
+ * Fetch the whole expansion tree of an alias in one query and cache
+ * every key of the tree, so that the lookups smtpd does for the next
+ * hops are answered locally.  The destinations that are not a key of
+ * the tree are not aliases, which is cached as well.  Only the keys
+ * owned by the same shard are cached, since the query ran there.
+ * Return the result for the key, or -1 to fall back to query_alias.
+ */
+static int
+table_postgres_alias_closure(const char *key, char *dst, size_t sz)
+{
+	PGresult	*res;
+	struct snapshot	*tree;
+	struct shard	*sh;
+	void		*iter;
+	const char	*k, *v, *q;
+	char		*dup, *d, *p;
+	int		 i, r;
+
+	if ((config->cache == NULL && config->shmcache == NULL) ||
+	    (q = dict_get(&config->conf, "query_alias_closure")) == NULL)
+		return -1;
+
+	sh = config_shard(config, key);
+	if ((res = table_postgres_exec(sh, STMT_ALIAS_CLOSURE, q, key)) == NULL)
+		return -1;
+
+	if ((tree = snapshot_new(1)) == NULL) {
+		PQclear(res);
+		return -1;
+	}
+	for (i = 0; i < PQntuples(res); i++)
+		if (!snapshot_add(tree, PQgetvalue(res, i, 0),
+		    PQgetvalue(res, i, 1))) {
+			PQclear(res);
+			snapshot_free(tree);
+			return -1;
+		}
+	PQclear(res);
+
+	iter = NULL;
+	while (snapshot_iter(tree, &iter, &k, &v)) {
+		if (config_shard(config, k) != sh)
+			continue;
+		if (strcmp(k, key) != 0 && strlen(v) < sz)
+			table_postgres_cache_set(K_ALIAS, k, 1, v);
 
-	PQclear(res);
+		if ((dup = strdup(v)) == NULL)
+			continue;
+		for (p = dup; (d = strsep(&p, ",")) != NULL; ) {
+			d += strspn(d, " ");
+			if (*d && snapshot_get(tree, d, NULL, 0) == 0 &&
+			    config_shard(config, d) == sh)
+				table_postgres_cache_set(K_ALIAS, d, 0, NULL);
+		}
+		free(dup);
+	}
 
+	r = snapshot_get(tree, key, dst, sz);
+	if (r == -1)
+		log_warnx("warn: result too large");
+	snapshot_free(tree);
 	return r;
 }
 
+/*
+ * Format the result of the query of the service, and free it.  The
+ * lifetime the rows give is returned in ttl.
+ */
 static int
-table_postgres_lookup(int service, struct dict *params, const char *key, char *dst, size_t sz)
+table_postgres_lookup_res(int service, PGresult *res, char *dst, size_t sz,
+    int *ttl)
 {
-	PGresult	*res;
-	int		 r, i;
-
-	if (config->db == NULL && config_connect(config) == 0)
-		return -1;
+	int	 r, i;
 
-	res = table_postgres_query(key, service);
-	if (res == NULL)
-		return -1;
+	*ttl = table_postgres_row_ttl(res);
 
 	if (PQntuples(res) == 0) {
 		r = 0;
@@ -440,68 +2763,792 @@ end:
 	return r;
 }
 
+/* Tell if a lookup of the service is answered without a query. */
 static int
-table_postgres_fetch(int service, struct dict *params, char *dst, size_t sz)
+table_postgres_local(int service, const char *key)
+{
+	return table_postgres_sst_get(service, key, NULL, 0) != -1 ||
+	    (config->replica &&
+	    replica_get(config->replica, service, key, NULL, 0) != -1) ||
+	    table_postgres_snapshot_get(service, key, NULL, 0) != -1 ||
+	    table_postgres_gated(service, key) ||
+	    table_postgres_cache_peek(service, key) != -1;
+}
+
+/*
+ * Compute the forms smtpd falls back to when a key misses, in order:
+ * without the tag, the catch-all of the domain, the bare local part,
+ * then the global catch-all, e.g. user@domain, @domain, user and @ for
+ * user+tag@domain.
+ */
+static int
+table_postgres_variants(const char *key, char v[][LINE_MAX])
+{
+	const char	*at, *plus, *end;
+	int		 n = 0;
+
+	at = strrchr(key, '@');
+	plus = strchr(key, '+');
+	if (plus && at && plus > at)
+		plus = NULL;
+	if (plus && plus != key) {
+		if (at)
+			(void)snprintf(v[n++], LINE_MAX, "%.*s%s",
+			    (int)(plus - key), key, at);
+		else
+			(void)snprintf(v[n++], LINE_MAX, "%.*s",
+			    (int)(plus - key), key);
+	}
+	if (at == NULL || at == key || at[1] == '\0')
+		return n;
+
+	(void)strlcpy(v[n++], at, LINE_MAX);
+	end = plus ? plus : at;
+	if (end != key)
+		(void)snprintf(v[n++], LINE_MAX, "%.*s", (int)(end - key),
+		    key);
+	(void)strlcpy(v[n++], "@", LINE_MAX);
+
+	return n;
+}
+
+#ifdef HAVE_PQENTERPIPELINEMODE
+/*
+ * Send the queries in a single pipeline and collect their results.
+ * Return 0 if the pipeline broke, with no result left.  The connection
+ * is left out of pipeline mode if it is still up, so that the plain
+ * query can follow.
+ */
+static int
+table_postgres_prefetch_exec(struct endpoint *ep, const int *sent,
+    const char **keys, int n, PGresult **res)
+{
+	PGresult	*t;
+	PGconn		*db = ep->db;
+	const char	*q;
+	int		 k, ok, synced = 0;
+
+	if (!PQenterPipelineMode(db)) {
+		k = 0;
+		goto broken;
+	}
+	for (k = 0; k < n; k++) {
+		q = dict_get(&config->conf, qspec[sent[k]].name);
+		if (config->pooler)
+			ok = PQsendQueryParams(db, q, 1, NULL, &keys[k], NULL,
+			    NULL, 0);
+		else
+			ok = PQsendQueryPrepared(db, ep->statements[sent[k]],
+			    1, &keys[k], NULL, NULL, 0);
+		if (!ok) {
+			k = 0;
+			goto broken;
+		}
+	}
+	if (!PQpipelineSync(db)) {
+		k = 0;
+		goto broken;
+	}
+	synced = 1;
+
+	/* each result is followed by a NULL, and the sync comes last */
+	for (k = 0; k < n; k++) {
+		if ((res[k] = PQgetResult(db)) == NULL)
+			goto broken;
+		if ((t = PQgetResult(db)) != NULL) {
+			if (PQresultStatus(t) == PGRES_PIPELINE_SYNC)
+				synced = 2;
+			PQclear(t);
+			k++;
+			goto broken;
+		}
+	}
+	if ((t = PQgetResult(db)) == NULL ||
+	    PQresultStatus(t) != PGRES_PIPELINE_SYNC) {
+		PQclear(t);
+		goto broken;
+	}
+	PQclear(t);
+	synced = 2;
+	if (!PQexitPipelineMode(db))
+		goto broken;
+	return 1;
+
+broken:
+	while (k-- > 0)
+		PQclear(res[k]);
+	log_warnx("warn: table-postgres: prefetch failed on %s: %s",
+	    ep->name, PQerrorMessage(db));
+
+	/* drain the pipeline up to its sync, then leave it */
+	if (synced == 0 && PQpipelineStatus(db) != PQ_PIPELINE_OFF &&
+	    PQpipelineSync(db))
+		synced = 1;
+	while (synced == 1 && PQstatus(db) == CONNECTION_OK) {
+		if ((t = PQgetResult(db)) == NULL)
+			continue;
+		if (PQresultStatus(t) == PGRES_PIPELINE_SYNC)
+			synced = 2;
+		PQclear(t);
+	}
+	if (PQpipelineStatus(db) != PQ_PIPELINE_OFF)
+		(void)PQexitPipelineMode(db);
+
+	if (PQstatus(db) != CONNECTION_OK)
+		config_fail(config, ep);
+	else if (PQpipelineStatus(db) != PQ_PIPELINE_OFF)
+		endpoint_reset(ep);
+	return 0;
+}
+#else
+/*
+ * Without pipelines in libpq, send the queries one after the other on
+ * the connection.
+ */
+static int
+table_postgres_prefetch_exec(struct endpoint *ep, const int *sent,
+    const char **keys, int n, PGresult **res)
+{
+	const char	*q;
+	int		 k;
+
+	for (k = 0; k < n; k++) {
+		q = dict_get(&config->conf, qspec[sent[k]].name);
+		if (config->pooler)
+			res[k] = PQexecParams(ep->db, q, 1, NULL, &keys[k],
+			    NULL, NULL, 0);
+		else
+			res[k] = PQexecPrepared(ep->db,
+			    ep->statements[sent[k]], 1, &keys[k], NULL, NULL,
+			    0);
+		if (res[k] == NULL || PQstatus(ep->db) != CONNECTION_OK) {
+			PQclear(res[k]);
+			while (k-- > 0)
+				PQclear(res[k]);
+			log_warnx("warn: table-postgres: prefetch failed on "
+			    "%s: %s", ep->name, PQerrorMessage(ep->db));
+			if (PQstatus(ep->db) != CONNECTION_OK)
+				config_fail(config, ep);
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+/*
+ * Send the query of the service along with the ones of its prefetch
+ * rule, and the ones for the variants of the key if asked to, in a
+ * single pipeline where libpq has them.  The results of the latter are
+ * cached, so that the lookups that usually follow are answered
+ * locally.  Return the result for the service, or -2 to fall back to
+ * a plain query.
+ */
+static int
+table_postgres_prefetch(int service, const char *key, char *dst, size_t sz,
+    int *ttl)
+{
+	struct shard	*sh;
+	struct endpoint	*ep;
+	PGresult	*res[PREFETCH_MAX];
+	const char	*keys[PREFETCH_MAX];
+	char		 buf[LINE_MAX], v[VARIANTS_MAX][LINE_MAX];
+	int		 sent[PREFETCH_MAX], i, j, k, n, nv, r, ok, rttl;
+	long long	 start;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX ||
+	    (config->prefetch[i] == 0 && (config->variants & service) == 0) ||
+	    (config->cache == NULL && config->shmcache == NULL) ||
+	    dict_get(&config->conf, qspec[i].name) == NULL)
+		return -2;
+
+	sh = config_shard(config, key);
+	n = 0;
+	sent[n] = i;
+	keys[n++] = key;
+	nv = (config->variants & service) ? table_postgres_variants(key, v) : 0;
+	for (k = 0; k < nv; k++)
+		if (config_shard(config, v[k]) == sh &&
+		    !table_postgres_local(service, v[k])) {
+			sent[n] = i;
+			keys[n++] = v[k];
+		}
+	for (j = 0; j < SQL_MAX; j++)
+		if (j != i && (config->prefetch[i] & (1 << j)) &&
+		    dict_get(&config->conf, qspec[j].name) &&
+		    !table_postgres_local(1 << j, key)) {
+			sent[n] = j;
+			keys[n++] = key;
+		}
+	if (n == 1)
+		return -2;
+
+	if ((ep = config_endpoint(config, sh)) == NULL)
+		return -2;
+
+	start = now_usec();
+	if (!table_postgres_prefetch_exec(ep, sent, keys, n, res))
+		return -2;
+	endpoint_sample(ep, start);
+
+	r = -2;
+	for (k = 0; k < n; k++) {
+		j = sent[k];
+		if (PQresultStatus(res[k]) != PGRES_TUPLES_OK) {
+			PQclear(res[k]);
+			continue;
+		}
+		if (k == 0) {
+			r = table_postgres_lookup_res(service, res[k], dst, sz,
+			    ttl);
+			continue;
+		}
+		memset(buf, 0, sizeof(buf));
+		if ((ok = table_postgres_lookup_res(1 << j, res[k], buf,
+		    sizeof(buf), &rttl)) != -1)
+			table_postgres_cache_set_ttl(1 << j, keys[k], ok,
+			    ok == 1 ? buf : NULL, rttl);
+	}
+	return r;
+}
+
+/*
+ * Query the database for the key.  The lifetime the rows give, if any,
+ * is returned in ttl.
+ */
+static int
+table_postgres_lookup_db(int service, const char *key, char *dst, size_t sz,
+    int *ttl)
 {
-	char		*stmt;
 	PGresult	*res;
-	const char	*k, *errfld;
-	int		 i, retries = 1;
+	int		 r;
 
-	if (config->db == NULL && config_connect(config) == 0)
-		return -1;
+	*ttl = -1;
+	if (service == K_ALIAS &&
+	    (r = table_postgres_alias_closure(key, dst, sz)) != -1)
+		return r;
 
-retry:
-	if (service != K_SOURCE)
-		return -1;
+	if ((r = table_postgres_prefetch(service, key, dst, sz, ttl)) != -2)
+		return r;
 
-	if ((stmt = config->stmt_fetch_source) == NULL)
+	if ((res = table_postgres_query(key, service)) == NULL)
 		return -1;
 
-	if (config->source_ncall < config->source_refresh &&
-	    time(NULL) - config->source_update < config->source_expire)
-		goto fetch;
+	return table_postgres_lookup_res(service, res, dst, sz, ttl);
+}
 
-	res = PQexecPrepared(config->db, stmt, 0, NULL, NULL, NULL, 0);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		errfld = PQresultErrorField(res, PG_DIAG_SQLSTATE);
-		/*
-		 * PQresultErrorField can return NULL if the
-		 * connection to the server suddenly closed
-		 * (e.g. server restart)
-		 */
-		if (errfld == NULL || (errfld[0] == '0' && errfld[1] == '8')) {
-			log_warnx("warn: trying to reconnect after error: %s", PQerrorMessage(config->db));
-			PQclear(res);
-			if (config_connect(config) && retries-- > 0)
-				goto retry;
-			if (retries <= 0)
-				log_warnx("warn: table-postgres: too many retries");
-			return -1;
+/* Make a text[] literal of the keys. */
+static char *
+table_postgres_array(const char **keys, size_t n)
+{
+	const char	*k;
+	char		*a, *p;
+	size_t		 i, len = 3;
+
+	for (i = 0; i < n; i++)
+		len += 2 * strlen(keys[i]) + 3;
+	if ((a = malloc(len)) == NULL) {
+		log_warn("warn: malloc");
+		return NULL;
+	}
+
+	p = a;
+	*p++ = '{';
+	for (i = 0; i < n; i++) {
+		if (i > 0)
+			*p++ = ',';
+		*p++ = '"';
+		for (k = keys[i]; *k; k++) {
+			if (*k == '"' || *k == '\\')
+				*p++ = '\\';
+			*p++ = *k;
 		}
-		log_warnx("warn: PQexecPrepared: %s", PQerrorMessage(config->db));
+		*p++ = '"';
+	}
+	*p++ = '}';
+	*p = '\0';
+	return a;
+}
+
+/*
+ * Run the batch query of the service for the keys of a shard, and keep
+ * what it returns for the requests of the batch.
+ */
+static void
+table_postgres_batch_query(int i, struct shard *sh, const char *q,
+    const char **keys, size_t n)
+{
+	PGresult	*res;
+	struct bulk	 b;
+	const char	*e;
+	char		*arr, *fields[COPY_MAXFIELDS];
+	size_t		 j;
+	int		 f, row, ok, ttl;
+
+	if ((arr = table_postgres_array(keys, n)) == NULL)
+		return;
+	res = table_postgres_exec(sh, STMT_BATCH + i, q, arr);
+	free(arr);
+	if (res == NULL)
+		return;
+	if (PQnfields(res) < 2 + config->ttl_column ||
+	    PQnfields(res) > COPY_MAXFIELDS) {
+		log_warnx("warn: bad number of columns in %s",
+		    xspec[STMT_BATCH + i - SQL_MAX].name);
 		PQclear(res);
-		return -1;
+		return;
 	}
 
-	config->source_iter = NULL;
-	while (dict_poproot(&config->sources, NULL))
-		;
+	if (batch[i] == NULL &&
+	    (batch[i] = snapshot_new(i == SQL_ALIAS ||
+	    i == SQL_MAILADDRMAP)) == NULL) {
+		PQclear(res);
+		return;
+	}
+	b.snap = batch[i];
+	b.first = 1;
+	b.mark = NULL;
+	ok = 1;
+	for (row = 0; ok && row < PQntuples(res); row++) {
+		for (f = 0; f < PQnfields(res); f++)
+			fields[f] = PQgetvalue(res, row, f);
+		/* the ttl column is not part of the value */
+		if (config->ttl_column) {
+			e = NULL;
+			ttl = strtonum(fields[f - 1], 0, INT_MAX, &e);
+			if (e) {
+				log_warnx("warn: bad ttl column: %s", e);
+				ok = 0;
+				break;
+			}
+			table_postgres_batch_ttl(i, fields[0], ttl);
+		}
+		ok = table_postgres_bulk_row(fields, f - config->ttl_column,
+		    &b);
+	}
+	PQclear(res);
 
-	for (i = 0; i < PQntuples(res); i++)
-		dict_set(&config->sources, PQgetvalue(res, i, 0), NULL);
+	/* the keys without rows are not found, unless a row was lost */
+	for (j = 0; j < n; j++) {
+		if (ok)
+			dict_set(&batch_keys[i], keys[j], NULL);
+		else
+			free(dict_pop(&batch_ttl[i], keys[j]));
+	}
+}
 
-	PQclear(res);
+/*
+ * Fetch the keys of the requests read together that are not answered
+ * locally, with one batch query per service and shard.  The requests
+ * are then answered from the result as they are handled.
+ */
+static void
+table_postgres_batch_begin(size_t n, const int *services, const char **keys)
+{
+	struct shard	 *sh;
+	const char	**todo, *q;
+	size_t		  j, k, m, ntodo;
+	int		  i;
+
+	/* the broker does the queries, the requests are still coalesced */
+	batching = 1;
+	if (broker_fd != -1)
+		return;
+	if ((todo = calloc(n, sizeof(*todo))) == NULL) {
+		log_warn("warn: calloc");
+		return;
+	}
+
+	for (i = 0; i < SQL_MAX; i++) {
+		q = dict_get(&config->conf, xspec[STMT_BATCH + i - SQL_MAX].name);
+		if (q == NULL)
+			continue;
+		for (j = 0; j < config->nshards; j++) {
+			sh = &config->shards[j];
+			ntodo = 0;
+			for (k = 0; k < n; k++) {
+				if (services[k] != 1 << i ||
+				    config_shard(config, keys[k]) != sh ||
+				    table_postgres_local(services[k], keys[k]))
+					continue;
+				/* the same key goes in only once */
+				for (m = 0; m < ntodo; m++)
+					if (!strcmp(todo[m], keys[k]))
+						break;
+				if (m == ntodo)
+					todo[ntodo++] = keys[k];
+			}
+			if (ntodo > 1)
+				table_postgres_batch_query(i, sh, q, todo,
+				    ntodo);
+		}
+	}
+
+	free(todo);
+}
+
+static void
+table_postgres_batch_end(void)
+{
+	void	*p;
+	int	 i;
+
+	batching = 0;
+	for (i = 0; i < SQL_MAX; i++) {
+		snapshot_free(batch[i]);
+		batch[i] = NULL;
+		while (dict_poproot(&batch_keys[i], NULL))
+			;
+		while (dict_poproot(&batch_found[i], NULL))
+			;
+		while (dict_poproot(&batch_ttl[i], &p))
+			free(p);
+	}
+}
+
+static time_t
+refresh_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void	refresh_io(int, void *);
+
+static void
+refresh_watch(struct endpoint *ep, int events)
+{
+	int	 fd;
+
+	fd = PQsocket(ep->refresh);
+	if (ep->rstate != REFRESH_IDLE && ep->rfd != fd)
+		table_api_watch(ep->rfd, NULL, NULL);
+	ep->rfd = fd;
+	table_api_watch(fd, refresh_io, ep);
+	table_api_watch_events(fd, events);
+}
+
+/*
+ * Store what the refresh in progress fetched, or drop the connection if
+ * it failed, and come back for the next entry after the pending
+ * requests.
+ */
+static void
+refresh_end(int r, const char *value, int ttl)
+{
+	struct endpoint	*ep = refresh.ep;
+
+	if (ep->rstate != REFRESH_IDLE)
+		table_api_watch(ep->rfd, NULL, NULL);
+	ep->rstate = REFRESH_IDLE;
+	if (r == -1) {
+		PQfinish(ep->refresh);
+		ep->refresh = NULL;
+		ep->rprepared = 0;
+	}
+	refresh.ep = NULL;
+
+	if (r != -1)
+		table_postgres_cache_set_ttl(refresh.service, refresh.key, r,
+		    r == 1 && refresh.lookup ? value : NULL, ttl);
+
+	if (!refreshing && cache_ndue(config->cache)) {
+		refreshing = 1;
+		table_api_add_timer(0, table_postgres_refresh, NULL);
+	}
+}
+
+/*
+ * Send the query of the refresh, once prepared on the connection unless
+ * a pooler sits in between.
+ */
+static void
+refresh_send(struct endpoint *ep)
+{
+	const char	*q, *key = refresh.key;
+	char		 stmt[32];
+	int		 ok;
+
+	q = dict_get(&config->conf, qspec[refresh.i].name);
+	(void)snprintf(stmt, sizeof(stmt), "refresh%d", refresh.i);
+
+	if (config->pooler) {
+		ok = PQsendQueryParams(ep->refresh, q, 1, NULL, &key, NULL,
+		    NULL, 0);
+		ep->rstate = REFRESH_QUERY;
+	} else if ((ep->rprepared & 1 << refresh.i) == 0) {
+		ok = PQsendPrepare(ep->refresh, stmt, q, 1, NULL);
+		ep->rstate = REFRESH_PREPARE;
+	} else {
+		ok = PQsendQueryPrepared(ep->refresh, stmt, 1, &key, NULL,
+		    NULL, 0);
+		ep->rstate = REFRESH_QUERY;
+	}
+	if (!ok) {
+		log_warnx("warn: refresh on %s failed: %s", ep->name,
+		    PQerrorMessage(ep->refresh));
+		refresh_end(-1, NULL, -1);
+		return;
+	}
+	refresh_watch(ep, POLLIN | POLLOUT);
+}
+
+static void
+refresh_io(int fd, void *arg)
+{
+	struct endpoint	*ep = arg;
+	PGresult	*res, *next;
+	char		 buf[LINE_MAX];
+	int		 r, ttl;
+
+	if (ep->rstate == REFRESH_CONNECT) {
+		switch (PQconnectPoll(ep->refresh)) {
+		case PGRES_POLLING_READING:
+			refresh_watch(ep, POLLIN);
+			return;
+		case PGRES_POLLING_WRITING:
+			refresh_watch(ep, POLLOUT);
+			return;
+		case PGRES_POLLING_OK:
+			if (PQsetnonblocking(ep->refresh, 1) == -1)
+				goto fail;
+			refresh_send(ep);
+			return;
+		default:
+			goto fail;
+		}
+	}
+
+	if ((r = PQflush(ep->refresh)) == -1 || !PQconsumeInput(ep->refresh))
+		goto fail;
+	if (r == 0)
+		table_api_watch_events(fd, POLLIN);
+	if (PQisBusy(ep->refresh))
+		return;
+
+	/* the command is over once its result is followed by NULL */
+	res = PQgetResult(ep->refresh);
+	while ((next = PQgetResult(ep->refresh)) != NULL)
+		PQclear(next);
+
+	if (ep->rstate == REFRESH_PREPARE) {
+		r = PQresultStatus(res) == PGRES_COMMAND_OK;
+		PQclear(res);
+		if (!r)
+			goto fail;
+		ep->rprepared |= 1 << refresh.i;
+		refresh_send(ep);
+		return;
+	}
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		PQclear(res);
+		goto fail;
+	}
+	memset(buf, 0, sizeof(buf));
+	if (refresh.lookup)
+		r = table_postgres_lookup_res(refresh.service, res, buf,
+		    sizeof(buf), &ttl);
+	else {
+		r = PQntuples(res) != 0;
+		ttl = table_postgres_row_ttl(res);
+		PQclear(res);
+	}
+	refresh_end(r, buf, ttl);
+	return;
+
+fail:
+	log_warnx("warn: refresh on %s failed: %s", ep->name,
+	    PQerrorMessage(ep->refresh));
+	refresh_end(-1, NULL, -1);
+}
+
+/* Give up on a refresh whose endpoint did not answer in time. */
+static void
+refresh_expire(void *arg)
+{
+	struct endpoint	*ep = refresh.ep;
+
+	(void)arg;
+
+	if (ep == NULL || refresh.deadline > refresh_now())
+		return;
+	log_warnx("warn: refresh on %s timed out", ep->name);
+	refresh_end(-1, NULL, -1);
+}
+
+/*
+ * Fetch again one of the cache entries due for a refresh, on a
+ * connection of its own to the endpoint that serves the key, so that
+ * the lookups never wait for it.  Nothing is refreshed while the
+ * database is down, and an endpoint is never connected for a refresh
+ * alone: the entries that cannot be refreshed simply expire.
+ */
+static void
+table_postgres_refresh(void *arg)
+{
+	struct endpoint	*ep;
+	char		 key[LINE_MAX], buf[LINE_MAX];
+	int		 service, lookup, r, i;
+
+	(void)arg;
+
+	refreshing = 0;
+	if (config->cache == NULL || refresh.ep != NULL || db_down ||
+	    !cache_due(config->cache, &service, &lookup, key, sizeof(key)))
+		return;
+
+	/* a client leaves it to the broker, over the local socket */
+	if (broker_fd != -1) {
+		memset(buf, 0, sizeof(buf));
+		if (table_postgres_forward(lookup ? BROKER_LOOKUP :
+		    BROKER_CHECK, service, key, lookup ? buf : NULL,
+		    lookup ? sizeof(buf) : 0, &r) && r != -1)
+			table_postgres_cache_set_ttl(service, key, r,
+			    r == 1 && lookup ? buf : NULL, -1);
+		goto next;
+	}
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX || dict_get(&config->conf, qspec[i].name) == NULL ||
+	    (ep = config_shard(config, key)->ep) == NULL || ep->db == NULL ||
+	    strlcpy(refresh.key, key, sizeof(refresh.key)) >=
+	    sizeof(refresh.key))
+		goto next;
+
+	refresh.ep = ep;
+	refresh.service = service;
+	refresh.lookup = lookup;
+	refresh.i = i;
+	refresh.deadline = refresh_now() + PROBE_TIMEOUT;
+	table_api_add_timer(PROBE_TIMEOUT * 1000, refresh_expire, NULL);
+
+	if (ep->refresh && PQstatus(ep->refresh) == CONNECTION_OK) {
+		refresh_send(ep);
+		return;
+	}
+	PQfinish(ep->refresh);
+	ep->rprepared = 0;
+	if ((ep->refresh = endpoint_open(ep, 1)) == NULL ||
+	    PQstatus(ep->refresh) == CONNECTION_BAD) {
+		log_warnx("warn: refresh on %s failed: %s", ep->name,
+		    ep->refresh ? PQerrorMessage(ep->refresh) :
+		    "out of memory");
+		refresh_end(-1, NULL, -1);
+		return;
+	}
+	refresh_watch(ep, POLLOUT);
+	ep->rstate = REFRESH_CONNECT;
+	return;
+
+next:
+	if (cache_ndue(config->cache)) {
+		refreshing = 1;
+		table_api_add_timer(0, table_postgres_refresh, NULL);
+	}
+}
 
+static void
+table_postgres_sources_publish(struct load *l)
+{
+	snapshot_publish(&config->sources, l->b.snap);
+	l->b.snap = NULL;
 	config->source_update = time(NULL);
 	config->source_ncall = 0;
+}
+
+static int
+table_postgres_lookup(int service, struct dict *params, const char *key, char *dst, size_t sz)
+{
+	int	 r, ttl = -1;
+
+	if ((r = table_postgres_sst_get(service, key, dst, sz)) != -1)
+		return r;
+
+	if (config->replica &&
+	    (r = replica_get(config->replica, service, key, dst, sz)) != -1)
+		return r;
+
+	if ((r = table_postgres_snapshot_get(service, key, dst, sz)) != -1)
+		return r;
+
+	if (table_postgres_gated(service, key))
+		return 0;
+
+	if ((r = table_postgres_cache_get(service, key, dst, sz)) != -1)
+		return r;
+
+	if ((r = table_postgres_batch_get(service, key, dst, sz, &ttl)) == -1) {
+		if (!table_postgres_forward(BROKER_LOOKUP, service, key, dst, sz,
+		    &r))
+			r = table_postgres_lookup_db(service, key, dst, sz,
+			    &ttl);
+		/* a stale result is not cached again */
+		if (r == -1 &&
+		    (r = table_postgres_stale(service, key, dst, sz)) != -1)
+			return r;
+		table_postgres_batch_set(service, key, r, dst, ttl);
+	}
+
+	table_postgres_cache_set_ttl(service, key, r, r == 1 ? dst : NULL, ttl);
+
+	return r;
+}
+
+static int
+table_postgres_fetch(int service, struct dict *params, char *dst, size_t sz)
+{
+	struct snapshot	*snap;
+	const char	*k, *q;
+	int		 r;
+
+	if (table_postgres_forward(BROKER_FETCH, service, NULL, dst, sz, &r))
+		return r;
+
+	if (service != K_SOURCE)
+		return -1;
+
+	if ((q = dict_get(&config->conf, "fetch_source")) == NULL)
+		return -1;
+
+	/*
+	 * The sources are the union of what every shard returns.  There
+	 * is nothing to serve before the first load, so it is waited for,
+	 * while the next ones happen in the background.
+	 */
+	if (config->sources == NULL) {
+		if ((snap = snapshot_new(0)) == NULL ||
+		    !table_postgres_bulk(q, snap, NULL)) {
+			snapshot_free(snap);
+			return -1;
+		}
+		snapshot_publish(&config->sources, snap);
+		config->source_update = time(NULL);
+		config->source_ncall = 0;
+	} else if (config->source_load == NULL &&
+	    (config->source_ncall >= config->source_refresh ||
+	    time(NULL) - config->source_update >= config->source_expire))
+		load_start(&config->source_load, q, SQL_SOURCE, 0, NULL,
+		    table_postgres_sources_publish);
 
-fetch:
 	config->source_ncall += 1;
 
-	if (!dict_iter(&config->sources, &config->source_iter, &k, (void **)NULL)) {
+	/* the cursor finishes its generation before moving to the next */
+	if (config->source_gen == NULL ||
+	    !snapshot_iter(config->source_gen, &config->source_iter, &k,
+	    NULL)) {
+		snapshot_free(config->source_gen);
+		config->source_gen = snapshot_ref(config->sources);
 		config->source_iter = NULL;
-		if (!dict_iter(&config->sources, &config->source_iter, &k, (void **)NULL))
+		if (!snapshot_iter(config->source_gen, &config->source_iter,
+		    &k, NULL))
 			return 0;
 	}
 
@@ -511,16 +3558,44 @@ fetch:
 	return 1;
 }
 
+static uint32_t
+table_postgres_broker_tag(void)
+{
+	return config->tag;
+}
+
+static int
+table_postgres_broker(int type, int service, const char *key, char *dst,
+    size_t sz)
+{
+	switch (type) {
+	case BROKER_UPDATE:
+		return table_postgres_update() ? 1 : -1;
+	case BROKER_CHECK:
+		return table_postgres_check(service, NULL, key);
+	case BROKER_LOOKUP:
+		return table_postgres_lookup(service, NULL, key, dst, sz);
+	case BROKER_FETCH:
+		return table_postgres_fetch(service, NULL, dst, sz);
+	}
+
+	return -1;
+}
+
 int
 main(int argc, char **argv)
 {
-	int ch;
+	const char	*path;
+	int		 ch;
 
 	log_init(1);
 	log_setverbose(~0);
 
-	while ((ch = getopt(argc, argv, "")) != -1) {
+	while ((ch = getopt(argc, argv, "B")) != -1) {
 		switch (ch) {
+		case 'B':
+			broker_mode = 1;
+			break;
 		default:
 			fatalx("bad option");
 			/* NOTREACHED */
@@ -534,16 +3609,52 @@ main(int argc, char **argv)
 
 	conffile = argv[0];
 
+	signal(SIGPIPE, SIG_IGN);
+
 	if ((config = config_load(conffile)) == NULL)
 		fatalx("error parsing config file");
-	if (config_connect(config) == 0)
-		fatalx("could not connect");
+
+	path = dict_get(&config->conf, "broker_socket");
+	if (broker_mode && path == NULL)
+		fatalx("missing \"broker_socket\" configuration directive");
+
+	/* without a broker to talk to, connect to the database directly */
+	if (broker_mode || path == NULL ||
+	    (broker_fd = broker_connect(path)) == -1) {
+		if (config_connect(config) == 0)
+			fatalx("could not connect");
+		table_postgres_schedule_probe();
+	}
+
+	table_postgres_sst_update();
+	table_api_add_timer(SST_CHECK * 1000, table_postgres_sst_timer, NULL);
+	table_postgres_replica_start(NULL);
+	table_postgres_snapshot_update();
+	table_api_add_timer(config->snap_refresh * 1000,
+	    table_postgres_snapshot_timer, NULL);
+
+	/* start warm from what the previous run left behind */
+	if (config->cache &&
+	    (path = dict_get(&config->conf, "cache_file")) != NULL) {
+		if (!cache_load(config->cache, path, table_postgres_cache_tag()))
+			log_warnx("warn: starting with an empty cache");
+		table_api_add_timer(CACHE_SAVE * 1000,
+		    table_postgres_cache_timer, NULL);
+	}
+
+	if (broker_mode)
+		broker_serve(dict_get(&config->conf, "broker_socket"),
+		    table_postgres_broker_tag, table_postgres_broker);
 
 	table_api_on_update(table_postgres_update);
 	table_api_on_check(table_postgres_check);
 	table_api_on_lookup(table_postgres_lookup);
 	table_api_on_fetch(table_postgres_fetch);
+	table_api_on_batch(table_postgres_batch_begin, table_postgres_batch_end);
+	table_api_batch_window(config->batch_window, config->batch_size);
 	table_api_dispatch();
 
+	table_postgres_cache_save();
+
 	return 0;
 }
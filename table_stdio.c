@@ -16,14 +16,20 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include "config.h"
+#include "compat.h"
 
 #include <sys/tree.h>
+#include <sys/select.h>
 
 #include <err.h>
+#include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "dict.h"
 #include "table_stdio.h"
@@ -32,8 +38,39 @@ static int (*handler_update)(void);
 static int (*handler_check)(int, struct dict *, const char *);
 static int (*handler_lookup)(int, struct dict *, const char *, char *, size_t);
 static int (*handler_fetch)(int, struct dict *, char *, size_t);
+static void (*handler_batch_begin)(size_t, const int *, const char **);
+static void (*handler_batch_end)(void);
 
 static char		 tablename[128];
+static int		 configured;
+
+struct timer {
+	struct timespec	  when;
+	void		(*cb)(void *);
+	void		 *arg;
+	unsigned int	  pass;		/* the pass it was added in */
+};
+
+static struct timer	*timers;
+static size_t		 ntimers;
+static size_t		 timerssz;
+static unsigned int	 timerpass;
+
+struct watch {
+	int		  fd;
+	int		  events;
+	void		(*cb)(int, void *);
+	void		 *arg;
+};
+
+static struct watch	*watches;
+static size_t		 nwatches;
+
+static int		 batch_window;	/* usec to wait for more requests */
+static size_t		 batch_max = 1;
+
+static char		*input;	/* what was read from stdin */
+static size_t		 inputsize, inputlen;
 
 /* Dummy; just kept for backward compatibility */
 static struct dict	 params;
@@ -87,163 +124,555 @@ table_api_on_fetch(int(*cb)(int, struct dict *, char *, size_t))
 	handler_fetch = cb;
 }
 
+/*
+ * Get the keys of the lookups and checks read together before they
+ * are handled one by one, so that the missing ones can be fetched at
+ * once, and be told when they have been handled.
+ */
+void
+table_api_on_batch(void (*begin)(size_t, const int *, const char **),
+    void (*end)(void))
+{
+	handler_batch_begin = begin;
+	handler_batch_end = end;
+}
+
+/*
+ * Wait up to usec microseconds for more requests to come along with
+ * the ones read, and batch up to max of them.
+ */
+void
+table_api_batch_window(int usec, size_t max)
+{
+	batch_window = usec;
+	batch_max = max ? max : 1;
+}
+
 const char *
 table_api_get_name(void)
 {
 	return tablename;
 }
 
-int
-table_api_dispatch(void)
+static void
+table_api_handle(char *line)
 {
 	char		 buf[LINE_MAX];
 	char		*t, *vers, *tname, *type, *service, *id, *key;
-	char		*line = NULL;
-	size_t		 linesize = 0;
-	ssize_t		 linelen;
-	int		 i, r, configured = 0;
+	int		 r;
+
+	t = line;
+
+	if (!configured) {
+		if (strncmp(t, "config|", 7) != 0)
+			errx(1, "unexpected config line: %s", line);
+		t += 7;
+
+		if (!strcmp(t, "ready")) {
+			configured = 1;
+
+			/*
+			 * XXX register all the services since
+			 * we don't have a clue what the table
+			 * will do.
+			 */
+			puts("register|alias");
+			puts("register|domain");
+			puts("register|credentials");
+			puts("register|netaddr");
+			puts("register|userinfo");
+			puts("register|source");;
+			puts("register|mailaddr");
+			puts("register|addrname");
+			puts("register|mailaddrmap");
+
+			puts("register|ready");
+			if (fflush(stdout) == EOF)
+				err(1, "fflush");
+		}
 
-	dict_init(&params);
+		return;
+	}
 
-	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
-		if (line[linelen - 1] == '\n')
-			line[--linelen] = '\0';
-		t = line;
-
-		if (!configured) {
-			if (strncmp(t, "config|", 7) != 0)
-				errx(1, "unexpected config line: %s", line);
-			t += 7;
-
-			if (!strcmp(t, "ready")) {
-				configured = 1;
-
-				/*
-				 * XXX register all the services since
-				 * we don't have a clue what the table
-				 * will do.
-				 */
-				puts("register|alias");
-				puts("register|domain");
-				puts("register|credentials");
-				puts("register|netaddr");
-				puts("register|userinfo");
-				puts("register|source");;
-				puts("register|mailaddr");
-				puts("register|addrname");
-				puts("register|mailaddrmap");
-
-				puts("register|ready");
-				if (fflush(stdout) == EOF)
-					err(1, "fflush");
-				continue;
-			}
+	if (strncmp(t, "table|", 6))
+		errx(1, "malformed line");
+	t += 6;
 
-			continue;
-		}
+	vers = t;
+	if ((t = strchr(t, '|')) == NULL)
+		errx(1, "malformed line: missing version");
+	*t++ = '\0';
 
-		if (strncmp(t, "table|", 6))
-			errx(1, "malformed line");
-		t += 6;
+	if (strcmp(vers, "0.1") != 0)
+		errx(1, "unsupported protocol version: %s", vers);
 
-		vers = t;
-		if ((t = strchr(t, '|')) == NULL)
-			errx(1, "malformed line: missing version");
-		*t++ = '\0';
+	/* skip timestamp */
+	if ((t = strchr(t, '|')) == NULL)
+		errx(1, "malformed line: missing timestamp");
+	*t++ = '\0';
 
-		if (strcmp(vers, "0.1") != 0)
-			errx(1, "unsupported protocol version: %s", vers);
+	tname = t;
+	if ((t = strchr(t, '|')) == NULL)
+		errx(1, "malformed line: missing table name");
+	*t++ = '\0';
+	strlcpy(tablename, tname, sizeof(tablename));
 
-		/* skip timestamp */
-		if ((t = strchr(t, '|')) == NULL)
-			errx(1, "malformed line: missing timestamp");
-		*t++ = '\0';
+	type = t;
+	if ((t = strchr(t, '|')) == NULL)
+		errx(1, "malformed line: missing type");
+	*t++ = '\0';
 
-		tname = t;
-		if ((t = strchr(t, '|')) == NULL)
-			errx(1, "malformed line: missing table name");
-		*t++ = '\0';
-		strlcpy(tablename, tname, sizeof(tablename));
+	if (!strcmp(type, "update")) {
+		if (handler_update == NULL)
+			errx(1, "no update handler registered");
 
-		type = t;
+		id = t;
+		r = handler_update();
+		printf("update-result|%s|%s\n", id,
+		    r == -1 ? "error" : "ok");
+		if (fflush(stdout) == EOF)
+			err(1, "fflush");
+		return;
+	}
+
+	service = t;
+	if ((t = strchr(t, '|')) == NULL)
+		errx(1, "malformed line: missing service");
+	*t++ = '\0';
+
+	id = t;
+
+	if (!strcmp(type, "fetch")) {
+		if (handler_fetch == NULL)
+			errx(1, "no fetch handler registered");
+
+		r = handler_fetch(service_id(service), &params,
+		    buf, sizeof(buf));
+		if (r == 1)
+			printf("fetch-result|%s|found|%s\n", id, buf);
+		else if (r == 0)
+			printf("fetch-result|%s|not-found\n", id);
+		else
+			printf("fetch-result|%s|error\n", id);
+		if (fflush(stdout) == EOF)
+			err(1, "fflush");
+		return;
+	}
+
+	if ((t = strchr(t, '|')) == NULL)
+		errx(1, "malformed line: missing key");
+	*t++ = '\0';
+	key = t;
+
+	if (!strcmp(type, "check")) {
+		if (handler_check == NULL)
+			errx(1, "no check handler registered");
+		r = handler_check(service_id(service), &params, key);
+		if (r == 1)
+			printf("check-result|%s|found\n", id);
+		else if (r == 0)
+			printf("check-result|%s|not-found\n", id);
+		else
+			printf("check-result|%s|error\n", id);
+	} else if (!strcmp(type, "lookup")) {
+		if (handler_lookup == NULL)
+			errx(1, "no lookup handler registered");
+		r = handler_lookup(service_id(service), &params, key,
+		    buf, sizeof(buf));
+		if (r == 1)
+			printf("lookup-result|%s|found|%s\n", id, buf);
+		else if (r == 0)
+			printf("lookup-result|%s|not-found\n", id);
+		else
+			printf("lookup-result|%s|error\n", id);
+	} else
+		errx(1, "unknown action %s", type);
+
+	if (fflush(stdout) == EOF)
+		err(1, "fflush");
+}
+
+/*
+ * Find the service and the key of a lookup or check line, without
+ * touching it.
+ */
+static int
+table_api_peek(const char *l, int *service, const char **key)
+{
+	const char	*t, *svc;
+	char		 buf[32];
+	int		 i;
+
+	if (!configured || strncmp(l, "table|", 6) != 0)
+		return 0;
+	/* skip the version, the timestamp and the table name */
+	t = l + 6;
+	for (i = 0; i < 3; i++)
 		if ((t = strchr(t, '|')) == NULL)
-			errx(1, "malformed line: missing type");
-		*t++ = '\0';
+			return 0;
+		else
+			t++;
+	if (strncmp(t, "lookup|", 7) == 0)
+		t += 7;
+	else if (strncmp(t, "check|", 6) == 0)
+		t += 6;
+	else
+		return 0;
+
+	svc = t;
+	if ((t = strchr(t, '|')) == NULL || (size_t)(t - svc) >= sizeof(buf))
+		return 0;
+	memcpy(buf, svc, t - svc);
+	buf[t - svc] = '\0';
+
+	/* skip the id */
+	if ((t = strchr(t + 1, '|')) == NULL)
+		return 0;
+
+	*service = service_id(buf);
+	*key = t + 1;
+	return 1;
+}
 
-		if (!strcmp(type, "update")) {
-			if (handler_update == NULL)
-				errx(1, "no update handler registered");
+/* Read what stdin has.  Return 0 at the end of the input. */
+static int
+table_api_read(void)
+{
+	ssize_t	 n;
+	char	*t;
+
+	if (inputsize - inputlen < BUFSIZ) {
+		t = realloc(input, inputsize + BUFSIZ);
+		if (t == NULL)
+			err(1, "realloc");
+		input = t;
+		inputsize += BUFSIZ;
+	}
 
-			id = t;
-			r = handler_update();
-			printf("update-result|%s|%s\n", id,
-			    r == -1 ? "error" : "ok");
-			if (fflush(stdout) == EOF)
-				err(1, "fflush");
-			continue;
+	n = read(STDIN_FILENO, input + inputlen, inputsize - inputlen - 1);
+	if (n == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 1;
+		err(1, "read");
+	}
+	if (n == 0) {
+		/* handle a last line without the newline */
+		if (inputlen > 0 && input[inputlen - 1] != '\n')
+			input[inputlen++] = '\n';
+		return 0;
+	}
+	inputlen += n;
+	return 1;
+}
+
+static size_t
+table_api_lines(void)
+{
+	size_t	 i, n = 0;
+
+	for (i = 0; i < inputlen; i++)
+		if (input[i] == '\n')
+			n++;
+	return n;
+}
+
+/*
+ * Keep reading for the batching window, or until a full batch is
+ * there.  Return 0 at the end of the input.
+ */
+static int
+table_api_linger(void)
+{
+	struct timespec	 end, now;
+	struct timeval	 tv;
+	fd_set		 rfds;
+	long long	 left;
+	int		 r;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_nsec += batch_window * 1000L;
+	end.tv_sec += end.tv_nsec / 1000000000L;
+	end.tv_nsec %= 1000000000L;
+
+	while (table_api_lines() < batch_max) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (end.tv_sec - now.tv_sec) * 1000000LL +
+		    (end.tv_nsec - now.tv_nsec) / 1000;
+		if (left <= 0)
+			break;
+		tv.tv_sec = left / 1000000;
+		tv.tv_usec = left % 1000000;
+		FD_ZERO(&rfds);
+		FD_SET(STDIN_FILENO, &rfds);
+		if ((r = select(STDIN_FILENO + 1, &rfds, NULL, NULL, &tv))
+		    == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "select");
 		}
+		if (r == 0)
+			break;
+		if (!table_api_read())
+			return 0;
+	}
+	return 1;
+}
 
-		service = t;
-		if ((t = strchr(t, '|')) == NULL)
-			errx(1, "malformed line: missing service");
-		*t++ = '\0';
+/*
+ * Handle the complete lines read, by batches: the batch handler gets
+ * the keys of a batch first.
+ */
+static void
+table_api_handle_lines(void)
+{
+	const char	**keys;
+	char		 *nl, **lines;
+	int		 *services;
+	size_t		  off, i, n, nkeys, max;
+
+	/* an update handled in between may change the size */
+	max = batch_max;
+	if ((lines = calloc(max, sizeof(*lines))) == NULL ||
+	    (keys = calloc(max, sizeof(*keys))) == NULL ||
+	    (services = calloc(max, sizeof(*services))) == NULL)
+		err(1, "calloc");
+
+	off = 0;
+	for (;;) {
+		/* the handshake comes first, line by line */
+		n = 0;
+		while (n < (configured ? max : 1) &&
+		    (nl = memchr(input + off, '\n', inputlen - off)) != NULL) {
+			*nl = '\0';
+			lines[n++] = input + off;
+			off = nl - input + 1;
+		}
+		if (n == 0)
+			break;
+
+		nkeys = 0;
+		for (i = 0; handler_batch_begin && i < n; i++)
+			if (table_api_peek(lines[i], &services[nkeys],
+			    &keys[nkeys]))
+				nkeys++;
+		if (nkeys > 1)
+			handler_batch_begin(nkeys, services, keys);
+		for (i = 0; i < n; i++)
+			table_api_handle(lines[i]);
+		if (nkeys > 1)
+			handler_batch_end();
+	}
+	memmove(input, input + off, inputlen - off);
+	inputlen -= off;
 
-		id = t;
+	free(lines);
+	free(keys);
+	free(services);
+}
 
-		if (!strcmp(type, "fetch")) {
-			if (handler_fetch == NULL)
-				errx(1, "no fetch handler registered");
-
-			r = handler_fetch(service_id(service), &params,
-			    buf, sizeof(buf));
-			if (r == 1)
-				printf("fetch-result|%s|found|%s\n", id, buf);
-			else if (r == 0)
-				printf("fetch-result|%s|not-found\n", id);
-			else
-				printf("fetch-result|%s|error\n", id);
-			if (fflush(stdout) == EOF)
-				err(1, "fflush");
-			memset(buf, 0, sizeof(buf));
+/*
+ * Run the expired timers and return the number of milliseconds until
+ * the next one is due, or -1 if there are none left.  The timers added
+ * by the callbacks wait for the next pass, so that the requests pending
+ * in between are read first.
+ */
+int
+table_api_run_timers(void)
+{
+	struct timespec	 now;
+	struct timer	 t;
+	size_t		 i;
+	long long	 ms, next = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timerpass++;
+
+	for (i = 0; i < ntimers; ) {
+		if (timers[i].pass != timerpass &&
+		    (timers[i].when.tv_sec < now.tv_sec ||
+		    (timers[i].when.tv_sec == now.tv_sec &&
+		    timers[i].when.tv_nsec <= now.tv_nsec))) {
+			/* the callback may add timers, so unlink first */
+			t = timers[i];
+			timers[i] = timers[--ntimers];
+			t.cb(t.arg);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			i = 0;
+			next = -1;
 			continue;
 		}
+		ms = (timers[i].when.tv_sec - now.tv_sec) * 1000 +
+		    (timers[i].when.tv_nsec - now.tv_nsec) / 1000000 + 1;
+		if (ms < 0)
+			ms = 0;
+		if (next == -1 || ms < next)
+			next = ms;
+		i++;
+	}
 
-		if ((t = strchr(t, '|')) == NULL)
-			errx(1, "malformed line: missing key");
-		*t++ = '\0';
-		key = t;
-
-		if (!strcmp(type, "check")) {
-			if (handler_check == NULL)
-				errx(1, "no check handler registered");
-			r = handler_check(service_id(service), &params, key);
-			if (r == 1)
-				printf("check-result|%s|found\n", id);
-			else if (r == 0)
-				printf("check-result|%s|not-found\n", id);
-			else
-				printf("check-result|%s|error\n", id);
-		} else if (!strcmp(type, "lookup")) {
-			if (handler_lookup == NULL)
-				errx(1, "no lookup handler registered");
-			r = handler_lookup(service_id(service), &params, key,
-			    buf, sizeof(buf));
-			if (r == 1)
-				printf("lookup-result|%s|found|%s\n", id, buf);
-			else if (r == 0)
-				printf("lookup-result|%s|not-found\n", id);
-			else
-				printf("lookup-result|%s|error\n", id);
-			memset(buf, 0, sizeof(buf));
-		} else
-			errx(1, "unknown action %s", type);
+	if (next > INT_MAX)
+		next = INT_MAX;
+	return next;
+}
 
-		if (fflush(stdout) == EOF)
-			err(1, "fflush");
+void
+table_api_add_timer(int msec, void (*cb)(void *), void *arg)
+{
+	struct timer	*t;
+
+	if (ntimers == timerssz) {
+		timerssz = timerssz ? timerssz * 2 : 8;
+		t = reallocarray(timers, timerssz, sizeof(*timers));
+		if (t == NULL)
+			err(1, "reallocarray");
+		timers = t;
+	}
+
+	t = &timers[ntimers++];
+	clock_gettime(CLOCK_MONOTONIC, &t->when);
+	t->when.tv_sec += msec / 1000;
+	t->when.tv_nsec += (msec % 1000) * 1000000L;
+	if (t->when.tv_nsec >= 1000000000L) {
+		t->when.tv_sec++;
+		t->when.tv_nsec -= 1000000000L;
+	}
+	t->cb = cb;
+	t->arg = arg;
+	t->pass = timerpass;
+}
+
+/*
+ * Call back when the descriptor becomes readable, in between requests.
+ * A NULL callback stops watching it.
+ */
+void
+table_api_watch(int fd, void (*cb)(int, void *), void *arg)
+{
+	struct watch	*w;
+	size_t		 i;
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].fd == fd)
+			break;
+
+	if (cb == NULL) {
+		if (i < nwatches)
+			watches[i] = watches[--nwatches];
+		return;
+	}
+
+	if (i == nwatches) {
+		w = reallocarray(watches, nwatches + 1, sizeof(*watches));
+		if (w == NULL)
+			err(1, "reallocarray");
+		watches = w;
+		nwatches++;
+	}
+	watches[i].fd = fd;
+	watches[i].events = POLLIN;
+	watches[i].cb = cb;
+	watches[i].arg = arg;
+}
+
+/*
+ * Wait for other events than readability on a watched descriptor, e.g.
+ * POLLOUT while a connection is being established.
+ */
+void
+table_api_watch_events(int fd, int events)
+{
+	size_t	 i;
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].fd == fd)
+			watches[i].events = events;
+}
+
+/*
+ * Fill pfd with the watched descriptors, if not NULL, and return how
+ * many there are.
+ */
+size_t
+table_api_watched(struct pollfd *pfd)
+{
+	size_t	 i;
+
+	for (i = 0; pfd && i < nwatches; i++) {
+		pfd[i].fd = watches[i].fd;
+		pfd[i].events = watches[i].events;
+		pfd[i].revents = 0;
 	}
+	return nwatches;
+}
+
+/*
+ * Run the callbacks of the descriptors poll(2) found ready.  They
+ * may change the watches, so each one is looked up again.
+ */
+void
+table_api_run_watch(struct pollfd *pfd, size_t n)
+{
+	size_t	 i, j;
 
-	if (ferror(stdin))
-		err(1, "getline");
+	for (i = 0; i < n; i++) {
+		if (pfd[i].revents == 0)
+			continue;
+		for (j = 0; j < nwatches; j++)
+			if (watches[j].fd == pfd[i].fd)
+				break;
+		if (j < nwatches)
+			watches[j].cb(watches[j].fd, watches[j].arg);
+	}
+}
+
+int
+table_api_dispatch(void)
+{
+	struct pollfd	*pfd = NULL;
+	size_t		 n_pfd = 0, nw;
+	int		 timeout, eof = 0;
+
+	dict_init(&params);
+
+	/*
+	 * stdin is read by hand rather than with getline(3) so that
+	 * poll(2) never misses a line sitting in the stdio buffer while
+	 * waiting for the next timer.
+	 */
+	while (!eof) {
+		timeout = table_api_run_timers();
+
+		nw = table_api_watched(NULL);
+		if (n_pfd < nw + 1) {
+			pfd = reallocarray(pfd, nw + 1, sizeof(*pfd));
+			if (pfd == NULL)
+				err(1, "reallocarray");
+			n_pfd = nw + 1;
+		}
+		pfd[0].fd = STDIN_FILENO;
+		pfd[0].events = POLLIN;
+		table_api_watched(pfd + 1);
+		if (poll(pfd, nw + 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		table_api_run_watch(pfd + 1, nw);
+		if (pfd[0].revents == 0)
+			continue;
+
+		if (!table_api_read())
+			eof = 1;
+		else if (configured && handler_batch_begin && batch_window > 0 &&
+		    table_api_lines() > 0 && !table_api_linger())
+			eof = 1;
+
+		table_api_handle_lines();
+	}
 
+	free(pfd);
+	free(input);
+	input = NULL;
+	inputsize = inputlen = 0;
 	return (0);
 }
@@ -15,6 +15,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+struct pollfd;
+
 enum table_service {
 	K_ALIAS =	0x001,	/* returns struct expand	*/
 	K_DOMAIN =	0x002,	/* returns struct destination	*/
@@ -32,5 +34,14 @@ void		 table_api_on_update(int(*)(void));
 void		 table_api_on_check(int(*)(int, struct dict *, const char *));
 void		 table_api_on_lookup(int(*)(int, struct dict *, const char *, char *, size_t));
 void		 table_api_on_fetch(int(*)(int, struct dict *, char *, size_t));
+void		 table_api_on_batch(void (*)(size_t, const int *, const char **),
+		    void (*)(void));
+void		 table_api_batch_window(int, size_t);
+void		 table_api_add_timer(int, void (*)(void *), void *);
+int		 table_api_run_timers(void);
+void		 table_api_watch(int, void (*)(int, void *), void *);
+void		 table_api_watch_events(int, int);
+size_t		 table_api_watched(struct pollfd *);
+void		 table_api_run_watch(struct pollfd *, size_t);
 int		 table_api_dispatch(void);
 const char	*table_api_get_name(void);
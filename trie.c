@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/tree.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+#include "log.h"
+#include "trie.h"
+
+/*
+ * A trie of domain names on their labels, from the top-level domain
+ * down, so that a name is matched in as many steps as it has labels.
+ * A "*.example.com" entry matches the names below example.com at any
+ * depth, and the most specific entry wins.
+ */
+
+struct tnode {
+	struct dict	 children;
+	char		*value;		/* the name itself */
+	char		*wild;		/* the names below */
+};
+
+struct trie {
+	struct tnode	 root;
+};
+
+static void
+tnode_clear(struct tnode *n)
+{
+	struct tnode	*c;
+
+	while (dict_poproot(&n->children, (void **)&c)) {
+		tnode_clear(c);
+		free(c);
+	}
+	free(n->value);
+	free(n->wild);
+}
+
+struct trie *
+trie_new(void)
+{
+	struct trie	*t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		log_warn("warn: calloc");
+		return NULL;
+	}
+	dict_init(&t->root.children);
+	return t;
+}
+
+void
+trie_free(struct trie *t)
+{
+	if (t == NULL)
+		return;
+	tnode_clear(&t->root);
+	free(t);
+}
+
+/*
+ * Lowercase the name into buf, without its trailing dot.  Return its
+ * length, or -1 if it does not fit or is empty.
+ */
+static int
+trie_name(const char *name, char *buf, size_t sz)
+{
+	size_t	 i;
+
+	for (i = 0; name[i] && i < sz - 1; i++)
+		buf[i] = tolower((unsigned char)name[i]);
+	if (name[i])
+		return -1;
+	if (i > 0 && buf[i - 1] == '.')
+		i--;
+	buf[i] = '\0';
+	return i > 0 ? (int)i : -1;
+}
+
+int
+trie_insert(struct trie *t, const char *name, const char *value)
+{
+	struct tnode	*n, *c;
+	char		 buf[256], *p, *v, **slot;
+	int		 len, wild;
+
+	if ((len = trie_name(name, buf, sizeof(buf))) == -1)
+		return 0;
+
+	wild = 0;
+	p = buf;
+	if (strncmp(p, "*.", 2) == 0) {
+		wild = 1;
+		p += 2;
+	}
+	if (*p == '\0' || strchr(p, '*'))
+		return 0;
+
+	/* walk the labels from the last one */
+	n = &t->root;
+	for (;;) {
+		v = strrchr(p, '.');
+		if ((c = dict_get(&n->children, v ? v + 1 : p)) == NULL) {
+			if ((c = calloc(1, sizeof(*c))) == NULL) {
+				log_warn("warn: calloc");
+				return 0;
+			}
+			dict_init(&c->children);
+			dict_set(&n->children, v ? v + 1 : p, c);
+		}
+		n = c;
+		if (v == NULL)
+			break;
+		*v = '\0';
+	}
+
+	slot = wild ? &n->wild : &n->value;
+	if ((v = strdup(value)) == NULL) {
+		log_warn("warn: strdup");
+		return 0;
+	}
+	free(*slot);
+	*slot = v;
+	return 1;
+}
+
+/*
+ * Return the value of the name, or else of the closest wildcard above
+ * it, or NULL if there is none.
+ */
+const char *
+trie_match(struct trie *t, const char *name)
+{
+	struct tnode	*n;
+	const char	*best = NULL;
+	char		 buf[256], *p, *v;
+
+	if (trie_name(name, buf, sizeof(buf)) == -1)
+		return NULL;
+
+	p = buf;
+	n = &t->root;
+	for (;;) {
+		v = strrchr(p, '.');
+		if ((n = dict_get(&n->children, v ? v + 1 : p)) == NULL)
+			return best;
+		if (v == NULL)
+			return n->value ? n->value : best;
+		if (n->wild)
+			best = n->wild;
+		*v = '\0';
+	}
+}